@@ -0,0 +1,284 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <zlib.h>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include "blockio.hpp"
+#include "serial.hpp"
+
+// Blocks are closed after the first feature that brings them to this
+// much uncompressed data
+#define BLOCK_SIZE (4 * 1024 * 1024)
+
+// Identifies each block uniquely for the threads' caches, since
+// descriptors and positions are reused from one zoom level to the next
+static volatile unsigned long long block_serial = 0;
+
+static void write_block(struct block_writer *bw) {
+	if (bw->raw.size() == 0) {
+		return;
+	}
+
+	if (deflateReset(&bw->zs) != Z_OK) {
+		fprintf(stderr, "%s: Compression of temporary block failed\n", bw->fname);
+		exit(EXIT_FAILURE);
+	}
+
+	bw->compressed.resize(deflateBound(&bw->zs, bw->raw.size()));
+	bw->zs.next_in = (Bytef *) bw->raw.data();
+	bw->zs.avail_in = bw->raw.size();
+	bw->zs.next_out = (Bytef *) bw->compressed.data();
+	bw->zs.avail_out = bw->compressed.size();
+
+	if (deflate(&bw->zs, Z_FINISH) != Z_STREAM_END) {
+		fprintf(stderr, "%s: Compression of temporary block failed\n", bw->fname);
+		exit(EXIT_FAILURE);
+	}
+
+	block_header h;
+	memset(&h, 0, sizeof(h));
+	h.raw_len = bw->raw.size();
+	h.compressed_len = bw->zs.total_out;
+
+	fwrite_check(&h, sizeof(h), 1, bw->out, bw->fname);
+	fwrite_check(bw->compressed.data(), sizeof(char), h.compressed_len, bw->out, bw->fname);
+
+	block_entry e;
+	e.logical = bw->logical;
+	e.physical = bw->physical;
+	e.serial = __sync_add_and_fetch(&block_serial, 1);
+	bw->index->push_back(e);
+
+	bw->logical += h.raw_len;
+	bw->physical += sizeof(h) + h.compressed_len;
+
+	bw->raw.clear();
+}
+
+#ifdef __APPLE__
+static int block_write(void *cookie, const char *buf, int size) {
+#else
+static ssize_t block_write(void *cookie, const char *buf, size_t size) {
+#endif
+	struct block_writer *bw = (struct block_writer *) cookie;
+	bw->raw.append(buf, size);
+	return size;
+}
+
+static int block_writer_fclose(void *) {
+	return 0;
+}
+
+struct block_writer *block_writer_open(FILE *out, const char *fname, std::vector<block_entry> *index) {
+	struct block_writer *bw = new block_writer;
+	bw->out = out;
+	bw->fname = fname;
+	bw->index = index;
+	bw->in_block = 0;
+	bw->logical = 0;
+	bw->physical = 0;
+
+	// The fastest level, since the data is only going to be read once
+	memset(&bw->zs, 0, sizeof(bw->zs));
+	if (deflateInit(&bw->zs, Z_BEST_SPEED) != Z_OK) {
+		fprintf(stderr, "%s: Couldn't set up compression of temporary blocks\n", fname);
+		exit(EXIT_FAILURE);
+	}
+
+#ifdef __APPLE__
+	bw->fp = funopen(bw, NULL, block_write, NULL, block_writer_fclose);
+#else
+	cookie_io_functions_t io = {NULL, block_write, NULL, block_writer_fclose};
+	bw->fp = fopencookie(bw, "w", io);
+#endif
+	if (bw->fp == NULL) {
+		perror("open temporary block stream");
+		exit(EXIT_FAILURE);
+	}
+
+	return bw;
+}
+
+// Called after each feature is serialized, with how many bytes it took,
+// so that blocks only ever end between features. Some of those bytes may
+// already have reached raw, when stdio's buffer filled, so the count of
+// them is kept separately. The stream is only flushed when they make a
+// whole block.
+void block_writer_feature(struct block_writer *bw, long long len) {
+	bw->in_block += len;
+	if (bw->in_block < BLOCK_SIZE) {
+		return;
+	}
+
+	if (fflush(bw->fp) != 0) {
+		perror("flush temporary block stream");
+		exit(EXIT_FAILURE);
+	}
+	bw->in_block = 0;
+
+	write_block(bw);
+}
+
+// Writes out the last block. Returns the length of the compressed file.
+long long block_writer_close(struct block_writer *bw) {
+	if (fclose(bw->fp) != 0) {
+		perror("close temporary block stream");
+		exit(EXIT_FAILURE);
+	}
+	write_block(bw);
+
+	long long physical = bw->physical;
+	deflateEnd(&bw->zs);
+	delete bw;
+	return physical;
+}
+
+struct block_reader {
+	int fd;
+	std::vector<block_entry> const *index;
+	long long end;
+	long long pos;
+	struct block_cache *cache;
+};
+
+static void pread_fully(int fd, void *buf, size_t len, long long off) {
+	while (len > 0) {
+		ssize_t n = pread(fd, buf, len, off);
+		if (n <= 0) {
+			perror("read temporary block");
+			exit(EXIT_FAILURE);
+		}
+		buf = (char *) buf + n;
+		len -= n;
+		off += n;
+	}
+}
+
+static bool logical_less(long long pos, block_entry const &e) {
+	return pos < e.logical;
+}
+
+// Make the cache hold the block that contains the reader's position.
+// Any blocks before it are skipped without being read at all.
+static void load_block(struct block_reader *r) {
+	struct block_cache *c = r->cache;
+
+	auto b = std::upper_bound(r->index->begin(), r->index->end(), r->pos, logical_less);
+	if (b == r->index->begin()) {
+		fprintf(stderr, "Internal error: no temporary block at %lld\n", r->pos);
+		exit(EXIT_FAILURE);
+	}
+	--b;
+
+	if (b->serial == c->serial) {
+		return;
+	}
+
+	block_header h;
+	pread_fully(r->fd, &h, sizeof(h), b->physical);
+
+	c->compressed.resize(h.compressed_len);
+	pread_fully(r->fd, (void *) c->compressed.data(), h.compressed_len, b->physical + sizeof(h));
+
+	c->raw.resize(h.raw_len);
+	uLongf len = h.raw_len;
+	if (uncompress((Bytef *) c->raw.data(), &len, (const Bytef *) c->compressed.data(), h.compressed_len) != Z_OK || len != h.raw_len) {
+		fprintf(stderr, "Corrupt temporary block at %lld\n", b->physical);
+		exit(EXIT_FAILURE);
+	}
+
+	c->serial = b->serial;
+	c->logical = b->logical;
+}
+
+#ifdef __APPLE__
+static int block_read(void *cookie, char *buf, int size) {
+#else
+static ssize_t block_read(void *cookie, char *buf, size_t size) {
+#endif
+	struct block_reader *r = (struct block_reader *) cookie;
+	if (r->pos >= r->end) {
+		return 0;
+	}
+
+	load_block(r);
+	struct block_cache *c = r->cache;
+
+	long long n = c->logical + c->raw.size() - r->pos;
+	if (n > r->end - r->pos) {
+		n = r->end - r->pos;
+	}
+	if (n > (long long) size) {
+		n = size;
+	}
+
+	memcpy(buf, c->raw.data() + (r->pos - c->logical), n);
+	r->pos += n;
+	return n;
+}
+
+static long long block_seek(struct block_reader *r, long long offset, int whence) {
+	if (whence == SEEK_SET) {
+		r->pos = offset;
+	} else if (whence == SEEK_CUR) {
+		r->pos += offset;
+	} else {
+		errno = EINVAL;
+		return -1;
+	}
+
+	// Nothing is decompressed until something is read
+	return r->pos;
+}
+
+#ifdef __APPLE__
+static fpos_t block_reader_seek(void *cookie, fpos_t offset, int whence) {
+	return block_seek((struct block_reader *) cookie, offset, whence);
+}
+#else
+static int block_reader_seek(void *cookie, off64_t *offset, int whence) {
+	long long pos = block_seek((struct block_reader *) cookie, *offset, whence);
+	if (pos < 0) {
+		return -1;
+	}
+	*offset = pos;
+	return 0;
+}
+#endif
+
+static int block_reader_fclose(void *cookie) {
+	delete (struct block_reader *) cookie;
+	return 0;
+}
+
+FILE *block_reader_open(int fd, std::vector<block_entry> const *index, long long start, long long end, struct block_cache *cache) {
+	struct block_reader *r = new block_reader;
+	r->fd = fd;
+	r->index = index;
+	r->end = end;
+	r->pos = 0;
+	r->cache = cache;
+
+#ifdef __APPLE__
+	FILE *fp = funopen(r, block_read, NULL, block_reader_seek, block_reader_fclose);
+#else
+	cookie_io_functions_t io = {block_read, NULL, block_reader_seek, block_reader_fclose};
+	FILE *fp = fopencookie(r, "r", io);
+#endif
+	if (fp == NULL) {
+		perror("open temporary block stream");
+		exit(EXIT_FAILURE);
+	}
+
+	// So that the stream's idea of the position agrees with the reader's
+	if (fseek(fp, start, SEEK_SET) != 0) {
+		perror("seek temporary block stream");
+		exit(EXIT_FAILURE);
+	}
+
+	return fp;
+}
@@ -0,0 +1,69 @@
+#ifndef BLOCKIO_HPP
+#define BLOCKIO_HPP
+
+#include <stdio.h>
+#include <string>
+#include <vector>
+#include <zlib.h>
+
+// Temporary geometry files can be written as a series of compressed
+// blocks instead of a plain stream of serialized features. Positions
+// within the file, like where each tile starts, are still positions in
+// the uncompressed stream; the index of the blocks maps them to the
+// block that holds them, so reading a tile can skip directly to it.
+//
+// This is only compression of the temporary files. A block holds no
+// summary of its features: each tile reads only its own range of the
+// stream, and every feature in that range belongs to the tile, so there
+// is nothing that a block's bounding box would let a reader pass over.
+
+struct block_header {
+	unsigned long long raw_len;
+	unsigned long long compressed_len;
+};
+
+struct block_entry {
+	long long logical;   // uncompressed position of the start of the block
+	long long physical;  // where the block's header is in the file
+	unsigned long long serial;
+};
+
+struct block_writer {
+	FILE *fp;   // features are serialized into this stream
+	FILE *out;  // and the compressed blocks are written to this one
+	const char *fname;
+	std::vector<block_entry> *index;
+
+	std::string raw;     // the block so far, as much of it as fp has passed along
+	long long in_block;  // bytes of features serialized since the last block
+	std::string compressed;
+	z_stream zs;
+
+	long long logical;   // uncompressed bytes already written in blocks
+	long long physical;  // compressed bytes written to out
+};
+
+struct block_writer *block_writer_open(FILE *out, const char *fname, std::vector<block_entry> *index);
+void block_writer_feature(struct block_writer *bw, long long len);
+long long block_writer_close(struct block_writer *bw);
+
+// The most recently decompressed block, which each thread keeps so that
+// reading consecutive tiles from the same block only decompresses it once
+struct block_cache {
+	unsigned long long serial;
+	long long logical;
+	std::string raw;
+	std::string compressed;
+
+	block_cache() {
+		this->serial = 0;
+		this->logical = 0;
+	}
+};
+
+// A read-only stream of the uncompressed bytes from start to end. It
+// reads with pread(), so it does not disturb any other stream that
+// shares the descriptor.
+FILE *block_reader_open(int fd, std::vector<block_entry> const *index, long long start, long long end, struct block_cache *cache);
+
+#endif
@@ -14,6 +14,7 @@
 #include <fcntl.h>
 #include <sys/stat.h>
 #include <sys/mman.h>
+#include <pthread.h>
 #include <protozero/pbf_reader.hpp>
 #include <mapbox/geometry/feature.hpp>
 #include "mvt.hpp"
@@ -26,37 +27,42 @@ int minzoom = 0;
 int maxzoom = 32;
 bool force = false;
 bool merge = false;
+bool parallel = false;
+size_t CPUS = 1;
 
-void do_stats(mvt_tile &tile, size_t size, bool compressed, int z, unsigned x, unsigned y) {
-	printf("{ \"zoom\": %d, \"x\": %u, \"y\": %u, \"bytes\": %zu, \"compressed\": %s", z, x, y, size, compressed ? "true" : "false");
+void do_stats(FILE *fp, mvt_tile_view &tile, size_t size, bool compressed, int z, unsigned x, unsigned y) {
+	fprintf(fp, "{ \"zoom\": %d, \"x\": %u, \"y\": %u, \"bytes\": %zu, \"compressed\": %s", z, x, y, size, compressed ? "true" : "false");
 
-	printf(", \"layers\": { ");
+	fprintf(fp, ", \"layers\": { ");
 	for (size_t i = 0; i < tile.layers.size(); i++) {
 		if (i != 0) {
-			printf(", ");
+			fprintf(fp, ", ");
 		}
-		fprintq(stdout, tile.layers[i].name.c_str());
+		fprintq(fp, tile.layers[i].name.c_str());
 
 		int points = 0, lines = 0, polygons = 0;
 		for (size_t j = 0; j < tile.layers[i].features.size(); j++) {
-			if (tile.layers[i].features[j].type == mvt_point) {
+			mvt_feature_view feature;
+			feature.decode(tile.layers[i].features[j]);
+
+			if (feature.type == mvt_point) {
 				points++;
-			} else if (tile.layers[i].features[j].type == mvt_linestring) {
+			} else if (feature.type == mvt_linestring) {
 				lines++;
-			} else if (tile.layers[i].features[j].type == mvt_polygon) {
+			} else if (feature.type == mvt_polygon) {
 				polygons++;
 			}
 		}
 
-		printf(": { \"points\": %d, \"lines\": %d, \"polygons\": %d, \"extent\": %lld }", points, lines, polygons, tile.layers[i].extent);
+		fprintf(fp, ": { \"points\": %d, \"lines\": %d, \"polygons\": %d, \"extent\": %lld }", points, lines, polygons, tile.layers[i].extent);
 	}
 
-	printf(" } }\n");
+	fprintf(fp, " } }\n");
 }
 
 
-void handle(std::string message, int z, unsigned x, unsigned y, int describe, std::set<std::string> const &to_decode, bool pipeline, bool stats) {
-	mvt_tile tile;
+void handle(FILE *fp, std::string const &message, int z, unsigned x, unsigned y, int describe, std::set<std::string> const &to_decode, bool pipeline, bool stats) {
+	mvt_tile_view tile;
 	bool was_compressed;
 
 	try {
@@ -70,66 +76,67 @@ void handle(std::string message, int z, unsigned x, unsigned y, int describe, st
 	}
 
 	if (stats) {
-		do_stats(tile, message.size(), was_compressed, z, x, y);
+		do_stats(fp, tile, message.size(), was_compressed, z, x, y);
 		return;
 	}
 
 	if (!pipeline) {
-		printf("{ \"type\": \"FeatureCollection\"");
+		fprintf(fp, "{ \"type\": \"FeatureCollection\"");
 
 		if (describe) {
-			printf(", \"properties\": { \"zoom\": %d, \"x\": %d, \"y\": %d", z, x, y);
+			fprintf(fp, ", \"properties\": { \"zoom\": %d, \"x\": %d, \"y\": %d", z, x, y);
 			if (!was_compressed) {
-				printf(", \"compressed\": false");
+				fprintf(fp, ", \"compressed\": false");
 			}
-			printf(" }");
+			fprintf(fp, " }");
 
 			if (projection != projections) {
-				printf(", \"crs\": { \"type\": \"name\", \"properties\": { \"name\": ");
-				fprintq(stdout, projection->alias);
-				printf(" } }");
+				fprintf(fp, ", \"crs\": { \"type\": \"name\", \"properties\": { \"name\": ");
+				fprintq(fp, projection->alias);
+				fprintf(fp, " } }");
 			}
 		}
 
-		printf(", \"features\": [\n");
+		fprintf(fp, ", \"features\": [\n");
 	}
 
 	bool first_layer = true;
 	for (size_t l = 0; l < tile.layers.size(); l++) {
-		mvt_layer &layer = tile.layers[l];
-
-		if (to_decode.size() != 0 && !to_decode.count(layer.name)) {
+		if (to_decode.size() != 0 && !to_decode.count(tile.layers[l].name)) {
 			continue;
 		}
 
+		mvt_layer layer;
+		tile.layers[l].to_layer(layer);
+
 		if (!pipeline) {
 			if (describe) {
 				if (!first_layer) {
-					printf(",\n");
+					fprintf(fp, ",\n");
 				}
 
-				printf("{ \"type\": \"FeatureCollection\"");
-				printf(", \"properties\": { \"layer\": ");
-				fprintq(stdout, layer.name.c_str());
-				printf(", \"version\": %d, \"extent\": %lld", layer.version, layer.extent);
-				printf(" }");
-				printf(", \"features\": [\n");
+				fprintf(fp, "{ \"type\": \"FeatureCollection\"");
+				fprintf(fp, ", \"properties\": { \"layer\": ");
+				fprintq(fp, layer.name.c_str());
+				fprintf(fp, ", \"version\": %d, \"extent\": %lld", layer.version, layer.extent);
+				fprintf(fp, " }");
+				fprintf(fp, ", \"features\": [\n");
 
 				first_layer = false;
 			}
 		}
 
-		layer_to_geojson(stdout, layer, z, x, y, !pipeline, pipeline, pipeline, 0, 0, 0, !force);
+		layer_to_geojson(fp, layer, z, x, y, !pipeline, pipeline, pipeline, 0, 0, 0, !force);
 
 		if (!pipeline) {
 			if (describe) {
-				printf("] }\n");
+				fprintf(fp, "] }\n");
 			}
 		}
 	}
 
 	if (!pipeline) {
-		printf("] }\n");
+		fprintf(fp, "] }\n");
 	}
 }
 
@@ -237,7 +244,7 @@ void decode_merge(char *fname, int z, unsigned x, unsigned y, std::set<std::stri
 						fprintf(stderr, "Not a SQL Lite 3 file, no merge is possible");
 						if (z >= 0) {
 							std::string s = std::string(map, st.st_size);
-							handle(s, z, x, y, 1, to_decode, pipeline, stats);
+							handle(stdout, s, z, x, y, 1, to_decode, pipeline, stats);
 							munmap(map, st.st_size);
 							return;
 						} else {
@@ -281,6 +288,103 @@ void decode_merge(char *fname, int z, unsigned x, unsigned y, std::set<std::stri
     fprintf(stderr, "Extracted %d total features,\n", num_features);
 }
 
+// A tile waiting to be formatted by one of the threads in --parallel mode,
+// and the text that it formatted to
+struct decode_task {
+	std::string message;
+	int z;
+	unsigned x;
+	unsigned y;
+
+	char *out = NULL;
+	size_t len = 0;
+};
+
+struct decode_arg {
+	std::vector<decode_task> *tasks;
+	volatile size_t *next;
+	std::set<std::string> const *to_decode;
+	bool pipeline;
+	bool stats;
+};
+
+void *decode_worker(void *v) {
+	decode_arg *a = (decode_arg *) v;
+
+	while (true) {
+		size_t n = __sync_fetch_and_add(a->next, 1);
+		if (n >= a->tasks->size()) {
+			break;
+		}
+
+		decode_task &task = (*a->tasks)[n];
+		FILE *fp = open_memstream(&task.out, &task.len);
+		if (fp == NULL) {
+			perror("open_memstream");
+			exit(EXIT_FAILURE);
+		}
+
+		handle(fp, task.message, task.z, task.x, task.y, 1, *a->to_decode, a->pipeline, a->stats);
+
+		if (fclose(fp) != 0) {
+			perror("fclose");
+			exit(EXIT_FAILURE);
+		}
+		std::string().swap(task.message);
+	}
+
+	return NULL;
+}
+
+// Format a batch of tiles on all the threads, and then write them out
+// in the order they were read, with the same separators as the serial
+// path, so the output is the same either way.
+void decode_tasks(std::vector<decode_task> &tasks, std::set<std::string> const &to_decode, bool pipeline, bool stats, int &within) {
+	if (tasks.size() == 0) {
+		return;
+	}
+
+	std::vector<pthread_t> pthreads(CPUS);
+	std::vector<decode_arg> args(CPUS);
+	volatile size_t next = 0;
+
+	for (size_t i = 0; i < CPUS; i++) {
+		args[i].tasks = &tasks;
+		args[i].next = &next;
+		args[i].to_decode = &to_decode;
+		args[i].pipeline = pipeline;
+		args[i].stats = stats;
+
+		if (pthread_create(&pthreads[i], NULL, decode_worker, &args[i]) != 0) {
+			perror("pthread_create");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	for (size_t i = 0; i < CPUS; i++) {
+		void *retval;
+
+		if (pthread_join(pthreads[i], &retval) != 0) {
+			perror("pthread_join");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	for (size_t i = 0; i < tasks.size(); i++) {
+		if (!pipeline || stats) {
+			if (within) {
+				printf(",\n");
+			}
+			within = 1;
+		}
+
+		fwrite(tasks[i].out, 1, tasks[i].len, stdout);
+		free(tasks[i].out);
+	}
+
+	tasks.clear();
+}
+
 void decode(char *fname, int z, unsigned x, unsigned y, std::set<std::string> const &to_decode, bool pipeline, bool stats) {
 	sqlite3 *db;
 	int oz = z;
@@ -296,7 +400,7 @@ void decode(char *fname, int z, unsigned x, unsigned y, std::set<std::string> co
 					if (strcmp(map, "SQLite format 3") != 0) {
 						if (z >= 0) {
 							std::string s = std::string(map, st.st_size);
-							handle(s, z, x, y, 1, to_decode, pipeline, stats);
+							handle(stdout, s, z, x, y, 1, to_decode, pipeline, stats);
 							munmap(map, st.st_size);
 							return;
 						} else {
@@ -372,7 +476,26 @@ void decode(char *fname, int z, unsigned x, unsigned y, std::set<std::string> co
 		}
 
 		within = 0;
+		std::vector<decode_task> tasks;
+		size_t task_bytes = 0;
 		while (sqlite3_step(stmt) == SQLITE_ROW) {
+			if (parallel) {
+				decode_task task;
+				task.message = std::string((const char *) sqlite3_column_blob(stmt, 0), sqlite3_column_bytes(stmt, 0));
+				task.z = sqlite3_column_int(stmt, 1);
+				task.x = sqlite3_column_int(stmt, 2);
+				task.y = (1LL << task.z) - 1 - sqlite3_column_int(stmt, 3);
+
+				task_bytes += task.message.size();
+				tasks.push_back(std::move(task));
+
+				if (tasks.size() >= 100 * CPUS || task_bytes > 64 * 1024 * 1024) {
+					decode_tasks(tasks, to_decode, pipeline, stats, within);
+					task_bytes = 0;
+				}
+				continue;
+			}
+
 			if (!pipeline && !stats) {
 				if (within) {
 					printf(",\n");
@@ -393,8 +516,9 @@ void decode(char *fname, int z, unsigned x, unsigned y, std::set<std::string> co
 			ty = (1LL << tz) - 1 - ty;
 			const char *s = (const char *) sqlite3_column_blob(stmt, 0);
 
-			handle(std::string(s, len), tz, tx, ty, 1, to_decode, pipeline, stats);
+			handle(stdout, std::string(s, len), tz, tx, ty, 1, to_decode, pipeline, stats);
 		}
+		decode_tasks(tasks, to_decode, pipeline, stats, within);
 
 		if (!pipeline && !stats) {
 			printf("] }\n");
@@ -426,7 +550,7 @@ void decode(char *fname, int z, unsigned x, unsigned y, std::set<std::string> co
 					fprintf(stderr, "%s: Warning: using tile %d/%u/%u instead of %d/%u/%u\n", fname, z, x, y, oz, ox, oy);
 				}
 
-				handle(std::string(s, len), z, x, y, 0, to_decode, pipeline, stats);
+				handle(stdout, std::string(s, len), z, x, y, 0, to_decode, pipeline, stats);
 				handled = 1;
 			}
 
@@ -445,7 +569,7 @@ void decode(char *fname, int z, unsigned x, unsigned y, std::set<std::string> co
 }
 
 void usage(char **argv) {
-	fprintf(stderr, "Usage: %s [-s projection] [-Z minzoom] [-z maxzoom] [-l layer ...] [-m] file.mbtiles [zoom x y]\n", argv[0]);
+	fprintf(stderr, "Usage: %s [-s projection] [-Z minzoom] [-z maxzoom] [-l layer ...] [-m] [-P] file.mbtiles [zoom x y]\n", argv[0]);
 	exit(EXIT_FAILURE);
 }
 
@@ -466,6 +590,7 @@ int main(int argc, char **argv) {
 		{"stats", no_argument, 0, 'S'},
 		{"force", no_argument, 0, 'f'},
 		{"merge", no_argument, 0, 'm'},
+		{"parallel", no_argument, 0, 'P'},
 		{0, 0, 0, 0},
 	};
 
@@ -517,11 +642,27 @@ int main(int argc, char **argv) {
 				merge = true;
 				break;
 
+		case 'P':
+			parallel = true;
+			break;
+
 		default:
 			usage(argv);
 		}
 	}
 
+	if (parallel) {
+		CPUS = sysconf(_SC_NPROCESSORS_ONLN);
+
+		const char *TIPPECANOE_MAX_THREADS = getenv("TIPPECANOE_MAX_THREADS");
+		if (TIPPECANOE_MAX_THREADS != NULL) {
+			CPUS = atoi(TIPPECANOE_MAX_THREADS);
+		}
+		if (CPUS < 1) {
+			CPUS = 1;
+		}
+	}
+
 	if (argc == optind + 4) {
 		if ( merge ) decode_merge(argv[optind], atoi(argv[optind + 1]), atoi(argv[optind + 2]), atoi(argv[optind + 3]), to_decode, pipeline, stats);
 		else decode(argv[optind], atoi(argv[optind + 1]), atoi(argv[optind + 2]), atoi(argv[optind + 3]), to_decode, pipeline, stats);
@@ -3,6 +3,7 @@
 #include <sstream>
 #include <string>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <dirent.h>
@@ -124,3 +125,56 @@ void check_dir(const char *dir, bool rm) {
 		closedir(d1);
 	}
 }
+
+// Remove the tiles of every zoom level deeper than maxzoom
+void dir_remove_zooms_above(const char *dir, int maxzoom) {
+	DIR *d1 = opendir(dir);
+	if (d1 == NULL) {
+		return;
+	}
+
+	struct dirent *dp;
+	while ((dp = readdir(d1)) != NULL) {
+		if (numeric(dp->d_name) && atoi(dp->d_name) > maxzoom) {
+			std::string z = std::string(dir) + "/" + dp->d_name;
+
+			DIR *d2 = opendir(z.c_str());
+			if (d2 == NULL) {
+				perror(z.c_str());
+				exit(EXIT_FAILURE);
+			}
+
+			struct dirent *dp2;
+			while ((dp2 = readdir(d2)) != NULL) {
+				if (numeric(dp2->d_name)) {
+					std::string x = z + "/" + dp2->d_name;
+
+					DIR *d3 = opendir(x.c_str());
+					if (d3 == NULL) {
+						perror(x.c_str());
+						exit(EXIT_FAILURE);
+					}
+
+					struct dirent *dp3;
+					while ((dp3 = readdir(d3)) != NULL) {
+						if (pbfname(dp3->d_name)) {
+							std::string y = x + "/" + dp3->d_name;
+							if (unlink(y.c_str()) != 0) {
+								perror(y.c_str());
+								exit(EXIT_FAILURE);
+							}
+						}
+					}
+
+					closedir(d3);
+					rmdir(x.c_str());  // error OK if something else is in it
+				}
+			}
+
+			closedir(d2);
+			rmdir(z.c_str());
+		}
+	}
+
+	closedir(d1);
+}
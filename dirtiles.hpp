@@ -9,4 +9,6 @@ void dir_write_tile(const char *outdir, int z, int tx, int ty, std::string const
 
 void check_dir(const char *d, bool rm);
 
+void dir_remove_zooms_above(const char *dir, int maxzoom);
+
 #endif
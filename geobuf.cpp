@@ -2,9 +2,12 @@
 #include <string>
 #include <limits.h>
 #include <pthread.h>
+#include <deque>
+#include <vector>
 #include "mvt.hpp"
 #include "serial.hpp"
 #include "geobuf.hpp"
+#include "threadpool.hpp"
 #include "geojson.hpp"
 #include "projection.hpp"
 #include "main.hpp"
@@ -26,13 +29,12 @@ struct queued_feature {
 	size_t dim;
 	double e;
 	std::vector<std::string> *keys;
-	struct serialization_state *sst;
 	int layer;
 	std::string layername;
+	bool bare;	  // a geometry outside of any feature
+	long long offset;  // of the message within the file
 };
 
-static std::vector<queued_feature> feature_queue;
-
 void ensureDim(size_t dim) {
 	if (dim < 2) {
 		fprintf(stderr, "Geometry has fewer than 2 dimensions: %zu\n", dim);
@@ -421,70 +423,202 @@ void readFeature(protozero::pbf_reader &pbf, size_t dim, double e, std::vector<s
 	}
 }
 
-struct queue_run_arg {
-	size_t start;
-	size_t end;
+// Features are parsed by a pool of worker threads while the main thread
+// goes on scanning the file for more. They are handed over in chunks so
+// that the queue's lock is only taken once per chunk.
+
+#define CHUNK_FEATURES 500
+
+struct geobuf_pool {
+	std::deque<std::vector<queued_feature>> chunks;
+	std::vector<queued_feature> filling;
+	size_t max_chunks;
+	size_t pending;	 // chunks queued or still being parsed
+	bool finished;
+
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	std::vector<struct pool_task *> workers;
+
+	struct serialization_state *sst;
+	const char *src;
+	long long base_seq;
+};
+
+struct geobuf_worker_arg {
+	struct geobuf_pool *pool;
 	size_t segment;
 };
 
-void *run_parse_feature(void *v) {
-	struct queue_run_arg *qra = (struct queue_run_arg *) v;
+void outBareGeometry(drawvec const &dv, int type, size_t dim, double e, std::vector<std::string> &keys, struct serialization_state *sst, int layer, std::string layername);
 
-	for (size_t i = qra->start; i < qra->end; i++) {
-		struct queued_feature &qf = feature_queue[i];
-		readFeature(qf.pbf, qf.dim, qf.e, *qf.keys, &qf.sst[qra->segment], qf.layer, qf.layername);
+static void parse_queued(struct geobuf_pool *pool, struct queued_feature &qf, struct serialization_state *sst) {
+	// The sequence number comes from where the feature is in the file,
+	// so input order is preserved no matter which thread parses it.
+	// Every geometry within takes at least a byte, so the numbers
+	// from one feature can't run into those of the next.
+	*(sst->layer_seq) = pool->base_seq + qf.offset;
+
+	if (qf.bare) {
+		std::vector<drawvec_type> dv = readGeometry(qf.pbf, qf.dim, qf.e, *qf.keys);
+		for (size_t i = 0; i < dv.size(); i++) {
+			outBareGeometry(dv[i].dv, dv[i].type, qf.dim, qf.e, *qf.keys, sst, qf.layer, qf.layername);
+		}
+	} else {
+		readFeature(qf.pbf, qf.dim, qf.e, *qf.keys, sst, qf.layer, qf.layername);
 	}
+}
 
-	return NULL;
+static void pool_lock(struct geobuf_pool *pool) {
+	if (pthread_mutex_lock(&pool->lock) != 0) {
+		perror("pthread_mutex_lock");
+		exit(EXIT_FAILURE);
+	}
 }
 
-void runQueue() {
-	if (feature_queue.size() == 0) {
-		return;
+static void pool_unlock(struct geobuf_pool *pool) {
+	if (pthread_mutex_unlock(&pool->lock) != 0) {
+		perror("pthread_mutex_unlock");
+		exit(EXIT_FAILURE);
 	}
+}
 
-	struct queue_run_arg qra[CPUS];
-	pthread_t pthreads[CPUS];
+static void pool_wait(struct geobuf_pool *pool) {
+	if (pthread_cond_wait(&pool->cond, &pool->lock) != 0) {
+		perror("pthread_cond_wait");
+		exit(EXIT_FAILURE);
+	}
+}
 
-	for (size_t i = 0; i < CPUS; i++) {
-		*(feature_queue[0].sst[i].layer_seq) = *(feature_queue[0].sst[0].layer_seq) + feature_queue.size() * i / CPUS;
+static void pool_broadcast(struct geobuf_pool *pool) {
+	if (pthread_cond_broadcast(&pool->cond) != 0) {
+		perror("pthread_cond_broadcast");
+		exit(EXIT_FAILURE);
+	}
+}
 
-		qra[i].start = feature_queue.size() * i / CPUS;
-		qra[i].end = feature_queue.size() * (i + 1) / CPUS;
-		qra[i].segment = i;
+void *run_parse_feature(void *v) {
+	struct geobuf_worker_arg *a = (struct geobuf_worker_arg *) v;
+	struct geobuf_pool *pool = a->pool;
+	std::vector<queued_feature> chunk;
+
+	pool_lock(pool);
+	while (true) {
+		while (pool->chunks.size() == 0 && !pool->finished) {
+			pool_wait(pool);
+		}
+		if (pool->chunks.size() == 0) {
+			break;
+		}
 
-		if (pthread_create(&pthreads[i], NULL, run_parse_feature, &qra[i]) != 0) {
-			perror("pthread_create");
-			exit(EXIT_FAILURE);
+		chunk.swap(pool->chunks.front());
+		pool->chunks.pop_front();
+		pool_broadcast(pool);  // there is room for the reader to queue more
+		pool_unlock(pool);
+
+		for (size_t i = 0; i < chunk.size(); i++) {
+			parse_queued(pool, chunk[i], &pool->sst[a->segment]);
+		}
+		chunk.clear();
+
+		pool_lock(pool);
+		pool->pending--;
+		if (pool->pending == 0) {
+			pool_broadcast(pool);
 		}
 	}
+	pool_unlock(pool);
+
+	return NULL;
+}
+
+static void start_pool(struct geobuf_pool *pool, struct geobuf_worker_arg *args, struct serialization_state *sst, const char *src) {
+	pool->max_chunks = 2 * CPUS;
+	pool->pending = 0;
+	pool->finished = false;
+	pool->sst = sst;
+	pool->src = src;
+	pool->base_seq = *(sst[0].layer_seq);
+
+	if (pthread_mutex_init(&pool->lock, NULL) != 0 || pthread_cond_init(&pool->cond, NULL) != 0) {
+		perror("pthread_mutex_init");
+		exit(EXIT_FAILURE);
+	}
 
+	pool->workers.resize(CPUS);
 	for (size_t i = 0; i < CPUS; i++) {
-		void *retval;
+		args[i].pool = pool;
+		args[i].segment = i;
 
-		if (pthread_join(pthreads[i], &retval) != 0) {
-			perror("pthread_join");
-		}
+		pool->workers[i] = task_start_concurrent(run_parse_feature, &args[i]);
+	}
+}
+
+// Hand the chunk that is being filled to the workers,
+// waiting if they are too far behind
+static void submit_chunk(struct geobuf_pool *pool) {
+	if (pool->filling.size() == 0) {
+		return;
+	}
+
+	pool_lock(pool);
+	while (pool->chunks.size() >= pool->max_chunks) {
+		pool_wait(pool);
+	}
+	pool->chunks.push_back(std::vector<queued_feature>());
+	pool->chunks.back().swap(pool->filling);
+	pool->pending++;
+	pool_broadcast(pool);
+	pool_unlock(pool);
+}
+
+// Wait until everything queued so far has been parsed
+static void drain_pool(struct geobuf_pool *pool) {
+	submit_chunk(pool);
+
+	pool_lock(pool);
+	while (pool->pending > 0) {
+		pool_wait(pool);
+	}
+	pool_unlock(pool);
+}
+
+static void finish_pool(struct geobuf_pool *pool, size_t len) {
+	submit_chunk(pool);
+
+	pool_lock(pool);
+	pool->finished = true;
+	pool_broadcast(pool);
+	pool_unlock(pool);
+
+	for (size_t i = 0; i < pool->workers.size(); i++) {
+		task_join(pool->workers[i]);
+	}
+
+	if (pthread_mutex_destroy(&pool->lock) != 0 || pthread_cond_destroy(&pool->cond) != 0) {
+		perror("pthread_mutex_destroy");
+		exit(EXIT_FAILURE);
 	}
 
-	*(feature_queue[0].sst[0].layer_seq) = *(feature_queue[0].sst[CPUS - 1].layer_seq);
-	feature_queue.clear();
+	// Past any sequence number used within the file
+	*(pool->sst[0].layer_seq) = pool->base_seq + len;
 }
 
-void queueFeature(protozero::pbf_reader &pbf, size_t dim, double e, std::vector<std::string> &keys, struct serialization_state *sst, int layer, std::string layername) {
+void queueFeature(struct geobuf_pool *pool, protozero::data_view const &message, size_t dim, double e, std::vector<std::string> &keys, int layer, std::string layername, bool bare) {
 	struct queued_feature qf;
-	qf.pbf = pbf;
+	qf.pbf = protozero::pbf_reader(message);
+	qf.offset = message.data() - pool->src;
 	qf.dim = dim;
 	qf.e = e;
 	qf.keys = &keys;
-	qf.sst = sst;
 	qf.layer = layer;
 	qf.layername = layername;
+	qf.bare = bare;
 
-	feature_queue.push_back(qf);
+	pool->filling.push_back(qf);
 
-	if (feature_queue.size() > CPUS * 500) {
-		runQueue();
+	if (pool->filling.size() >= CHUNK_FEATURES) {
+		submit_chunk(pool);
 	}
 }
 
@@ -506,12 +640,11 @@ void outBareGeometry(drawvec const &dv, int type, size_t dim, double e, std::vec
 	serialize_feature(sst, sf);
 }
 
-void readFeatureCollection(protozero::pbf_reader &pbf, size_t dim, double e, std::vector<std::string> &keys, struct serialization_state *sst, int layer, std::string layername) {
+void readFeatureCollection(struct geobuf_pool *pool, protozero::pbf_reader &pbf, size_t dim, double e, std::vector<std::string> &keys, int layer, std::string layername) {
 	while (pbf.next()) {
 		switch (pbf.tag()) {
 		case 1: {
-			protozero::pbf_reader feature_reader(pbf.get_message());
-			queueFeature(feature_reader, dim, e, keys, sst, layer, layername);
+			queueFeature(pool, pbf.get_view(), dim, e, keys, layer, layername, false);
 			break;
 		}
 
@@ -528,9 +661,16 @@ void parse_geobuf(struct serialization_state *sst, const char *src, size_t len,
 	double e = 1e6;
 	std::vector<std::string> keys;
 
+	struct geobuf_pool pool;
+	struct geobuf_worker_arg args[CPUS];
+	start_pool(&pool, args, sst, src);
+
 	while (pbf.next()) {
 		switch (pbf.tag()) {
 		case 1:
+			// The keys normally all come first, but if not,
+			// the workers must not see the list being extended
+			drain_pool(&pool);
 			keys.push_back(pbf.get_string());
 			break;
 
@@ -544,22 +684,17 @@ void parse_geobuf(struct serialization_state *sst, const char *src, size_t len,
 
 		case 4: {
 			protozero::pbf_reader feature_collection_reader(pbf.get_message());
-			readFeatureCollection(feature_collection_reader, dim, e, keys, sst, layer, layername);
+			readFeatureCollection(&pool, feature_collection_reader, dim, e, keys, layer, layername);
 			break;
 		}
 
 		case 5: {
-			protozero::pbf_reader feature_reader(pbf.get_message());
-			queueFeature(feature_reader, dim, e, keys, sst, layer, layername);
+			queueFeature(&pool, pbf.get_view(), dim, e, keys, layer, layername, false);
 			break;
 		}
 
 		case 6: {
-			protozero::pbf_reader geometry_reader(pbf.get_message());
-			std::vector<drawvec_type> dv = readGeometry(geometry_reader, dim, e, keys);
-			for (size_t i = 0; i < dv.size(); i++) {
-				outBareGeometry(dv[i].dv, dv[i].type, dim, e, keys, sst, layer, layername);
-			}
+			queueFeature(&pool, pbf.get_view(), dim, e, keys, layer, layername, true);
 			break;
 		}
 
@@ -568,5 +703,5 @@ void parse_geobuf(struct serialization_state *sst, const char *src, size_t len,
 		}
 	}
 
-	runQueue();
+	finish_pool(&pool, len);
 }
@@ -91,6 +91,39 @@ void to_tile_scale(drawvec &geom, int z, int detail) {
 	}
 }
 
+void to_tile_scale(drawarrays &geom, int z, int detail) {
+	int shift = 32 - detail - z;
+
+	for (size_t i = 0; i < geom.x.size(); i++) {
+		geom.x[i] >>= shift;
+	}
+	for (size_t i = 0; i < geom.y.size(); i++) {
+		geom.y[i] >>= shift;
+	}
+}
+
+drawarrays::drawarrays(drawvec const &geom) {
+	reserve(geom.size());
+
+	for (size_t i = 0; i < geom.size(); i++) {
+		push_back(geom[i].op, geom[i].x, geom[i].y, geom[i].necessary);
+	}
+}
+
+drawvec drawarrays::to_drawvec() const {
+	drawvec out;
+	out.reserve(x.size());
+
+	for (size_t r = 0; r < runs.size(); r++) {
+		for (size_t i = runs[r].start; i < run_end(r); i++) {
+			out.push_back(draw(runs[r].op, x[i], y[i]));
+			out.back().necessary = necessary[i];
+		}
+	}
+
+	return out;
+}
+
 drawvec remove_noop(drawvec geom, int type, int shift) {
 	// first pass: remove empty linetos
 
@@ -323,6 +356,13 @@ drawvec clean_or_clip_poly(drawvec &geom, int z, int detail, int buffer, bool cl
 	return ret;
 }
 
+// The time here is in wagyu, which takes its own ring types,
+// so the arrays only pass through
+drawarrays clean_or_clip_poly(drawarrays &geom, int z, int detail, int buffer, bool clip) {
+	drawvec dv = geom.to_drawvec();
+	return drawarrays(clean_or_clip_poly(dv, z, detail, buffer, clip));
+}
+
 /* pnpoly:
 Copyright (c) 1970-2003, Wm. Randolph Franklin
 
@@ -679,6 +719,11 @@ drawvec clip_lines(drawvec &geom, int z, long long buffer) {
 	return out;
 }
 
+drawarrays clip_lines(drawarrays &geom, int z, long long buffer) {
+	drawvec dv = geom.to_drawvec();
+	return drawarrays(clip_lines(dv, z, buffer));
+}
+
 static double square_distance_from_line(long long point_x, long long point_y, long long segA_x, long long segA_y, long long segB_x, long long segB_y) {
 	double p2x = segB_x - segA_x;
 	double p2y = segB_y - segA_y;
@@ -840,6 +885,166 @@ drawvec simplify_lines(drawvec &geom, int z, int detail, bool mark_tile_bounds,
 	return out;
 }
 
+// The drawarrays versions of douglas_peucker(), impose_tile_boundaries(),
+// and simplify_lines() above, which must keep giving the same results
+
+static void douglas_peucker(drawarrays &geom, int start, int n, double e, size_t kept, size_t retain) {
+	e = e * e;
+	std::stack<int> recursion_stack;
+
+	long long *x = geom.x.data() + start;
+	long long *y = geom.y.data() + start;
+	signed char *necessary = geom.necessary.data() + start;
+
+	{
+		int left_border = 0;
+		int right_border = 1;
+		// Sweep linerarily over array and identify those ranges that need to be checked
+		do {
+			if (necessary[right_border]) {
+				recursion_stack.push(left_border);
+				recursion_stack.push(right_border);
+				left_border = right_border;
+			}
+			++right_border;
+		} while (right_border < n);
+	}
+
+	while (!recursion_stack.empty()) {
+		// pop next element
+		int second = recursion_stack.top();
+		recursion_stack.pop();
+		int first = recursion_stack.top();
+		recursion_stack.pop();
+
+		double max_distance = -1;
+		int farthest_element_index = second;
+
+		// find index idx of element with max_distance
+		int i;
+		for (i = first + 1; i < second; i++) {
+			double temp_dist = square_distance_from_line(x[i], y[i], x[first], y[first], x[second], y[second]);
+
+			double distance = std::fabs(temp_dist);
+
+			if ((distance > e || kept < retain) && distance > max_distance) {
+				farthest_element_index = i;
+				max_distance = distance;
+			}
+		}
+
+		if (max_distance >= 0) {
+			// mark idx as necessary
+			necessary[farthest_element_index] = 1;
+			kept++;
+
+			if (1 < farthest_element_index - first) {
+				recursion_stack.push(first);
+				recursion_stack.push(farthest_element_index);
+			}
+			if (1 < second - farthest_element_index) {
+				recursion_stack.push(farthest_element_index);
+				recursion_stack.push(second);
+			}
+		}
+	}
+}
+
+static drawarrays impose_tile_boundaries(drawarrays &geom, long long extent) {
+	drawarrays out;
+	out.reserve(geom.size());
+
+	for (size_t r = 0; r < geom.runs.size(); r++) {
+		signed char op = geom.runs[r].op;
+		size_t i = geom.runs[r].start;
+		size_t end = geom.run_end(r);
+
+		if (op != VT_LINETO) {
+			for (; i < end; i++) {
+				out.push_back(op, geom.x[i], geom.y[i], geom.necessary[i]);
+			}
+			continue;
+		}
+
+		if (r == 0 || geom.runs[r - 1].op != VT_MOVETO) {
+			out.push_back(op, geom.x[i], geom.y[i], geom.necessary[i]);
+			i++;
+		}
+
+		for (; i < end; i++) {
+			double x1 = geom.x[i - 1];
+			double y1 = geom.y[i - 1];
+
+			double x2 = geom.x[i - 0];
+			double y2 = geom.y[i - 0];
+
+			int c = clip(&x1, &y1, &x2, &y2, 0, 0, extent, extent);
+
+			if (c > 1) {  // clipped
+				if (x1 != geom.x[i - 1] || y1 != geom.y[i - 1]) {
+					out.push_back(VT_LINETO, x1, y1, 1);
+				}
+				if (x2 != geom.x[i - 0] || y2 != geom.y[i - 0]) {
+					out.push_back(VT_LINETO, x2, y2, 1);
+				}
+			}
+
+			out.push_back(VT_LINETO, geom.x[i], geom.y[i], geom.necessary[i]);
+		}
+	}
+
+	return out;
+}
+
+drawarrays simplify_lines(drawarrays &geom, int z, int detail, bool mark_tile_bounds, double simplification, size_t retain) {
+	int res = 1 << (32 - detail - z);
+	long long area = 1LL << (32 - z);
+
+	for (size_t r = 0; r < geom.runs.size(); r++) {
+		signed char necessary = geom.runs[r].op != VT_LINETO;
+
+		for (size_t i = geom.runs[r].start; i < geom.run_end(r); i++) {
+			geom.necessary[i] = necessary;
+		}
+	}
+
+	if (mark_tile_bounds) {
+		geom = impose_tile_boundaries(geom, area);
+	}
+
+	for (size_t r = 0; r < geom.runs.size(); r++) {
+		if (geom.runs[r].op != VT_MOVETO) {
+			continue;
+		}
+
+		// Each moveto but the last in a run starts a part with no linetos.
+		// The last one starts a part that goes through the linetos after it.
+		size_t i = geom.run_end(r) - 1;
+		size_t j = i + 1;
+		if (r + 1 < geom.runs.size() && geom.runs[r + 1].op == VT_LINETO) {
+			j = geom.run_end(r + 1);
+		}
+
+		geom.necessary[i] = 1;
+		geom.necessary[j - 1] = 1;
+
+		if (j - i > 1) {
+			douglas_peucker(geom, i, j - i, res * simplification, 2, retain);
+		}
+	}
+
+	drawarrays out;
+	for (size_t r = 0; r < geom.runs.size(); r++) {
+		for (size_t i = geom.runs[r].start; i < geom.run_end(r); i++) {
+			if (geom.necessary[i]) {
+				out.push_back(geom.runs[r].op, geom.x[i], geom.y[i], geom.necessary[i]);
+			}
+		}
+	}
+
+	return out;
+}
+
 drawvec reorder_lines(drawvec &geom) {
 	// Only reorder simple linestrings with a single moveto
 
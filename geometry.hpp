@@ -55,19 +55,84 @@ struct draw {
 
 typedef std::vector<draw> drawvec;
 
+// The same geometry as a drawvec, but with the x and y coordinates each in
+// an array of its own, so that the loops that simplify and scale them go
+// straight through memory instead of unpacking each draw. The ops
+// are kept as runs of points that have the same one, which for lines and
+// polygons start where each ring or part starts and again where its
+// linetos start.
+//
+// The constructor and to_drawvec() convert from and to drawvec, so that
+// callers can move over one function at a time. The drawvec versions are
+// still the ones tiling uses unless --prefer-geometry-arrays is given,
+// since the conversions cost about as much as the arrays save so far.
+struct drawarrays {
+	struct run {
+		signed char op;
+		size_t start;  // index in x and y of the first point with this op
+	};
+
+	std::vector<long long> x;
+	std::vector<long long> y;
+	std::vector<signed char> necessary;
+	std::vector<run> runs;
+
+	drawarrays() {
+	}
+
+	explicit drawarrays(drawvec const &geom);
+	drawvec to_drawvec() const;
+
+	size_t size() const {
+		return x.size();
+	}
+
+	// Where the points of run r end
+	size_t run_end(size_t r) const {
+		if (r + 1 < runs.size()) {
+			return runs[r + 1].start;
+		} else {
+			return x.size();
+		}
+	}
+
+	void reserve(size_t n) {
+		x.reserve(n);
+		y.reserve(n);
+		necessary.reserve(n);
+	}
+
+	void push_back(signed char op, long long nx, long long ny, signed char nnecessary = 0) {
+		if (runs.size() == 0 || runs.back().op != op) {
+			run r;
+			r.op = op;
+			r.start = x.size();
+			runs.push_back(r);
+		}
+
+		x.push_back(nx);
+		y.push_back(ny);
+		necessary.push_back(nnecessary);
+	}
+};
+
 drawvec decode_geometry(FILE *meta, long long *geompos, int z, unsigned tx, unsigned ty, long long *bbox, unsigned initial_x, unsigned initial_y);
 void to_tile_scale(drawvec &geom, int z, int detail);
+void to_tile_scale(drawarrays &geom, int z, int detail);
 drawvec remove_noop(drawvec geom, int type, int shift);
 drawvec clip_point(drawvec &geom, int z, long long buffer);
 drawvec clean_or_clip_poly(drawvec &geom, int z, int detail, int buffer, bool clip);
+drawarrays clean_or_clip_poly(drawarrays &geom, int z, int detail, int buffer, bool clip);
 drawvec simple_clip_poly(drawvec &geom, int z, int buffer);
 drawvec close_poly(drawvec &geom);
 drawvec reduce_tiny_poly(drawvec &geom, int z, int detail, bool *reduced, double *accum_area);
 drawvec clip_lines(drawvec &geom, int z, long long buffer);
+drawarrays clip_lines(drawarrays &geom, int z, long long buffer);
 drawvec stairstep(drawvec &geom, int z, int detail);
 bool point_within_tile(long long x, long long y, int z, long long buffer);
 int quick_check(long long *bbox, int z, long long buffer);
 drawvec simplify_lines(drawvec &geom, int z, int detail, bool mark_tile_bounds, double simplification, size_t retain);
+drawarrays simplify_lines(drawarrays &geom, int z, int detail, bool mark_tile_bounds, double simplification, size_t retain);
 drawvec reorder_lines(drawvec &geom);
 drawvec fix_polygon(drawvec &geom);
 std::vector<drawvec> chop_polygon(std::vector<drawvec> &geoms);
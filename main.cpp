@@ -57,6 +57,7 @@
 #include "mvt.hpp"
 #include "dirtiles.hpp"
 #include "evaluator.hpp"
+#include "threadpool.hpp"
 
 static int low_detail = 12;
 static int full_detail = -1;
@@ -86,7 +87,7 @@ void checkdisk(struct reader *r, int nreader) {
 	for (i = 0; i < nreader; i++) {
 		// Meta, pool, and tree are used once.
 		// Geometry and index will be duplicated during sorting and tiling.
-		used += r[i].metapos + 2 * r[i].geompos + 2 * r[i].indexpos + r[i].poolfile->len + r[i].treefile->len;
+		used += r[i].metapos + 2 * r[i].geompos + 2 * r[i].indexpos + r[i].poolfile->off + r[i].treefile->off;
 	}
 
 	static int warned = 0;
@@ -182,20 +183,137 @@ int indexcmp(const void *v1, const void *v2) {
 	return 0;
 }
 
+// The same order as indexcmp, for sorts that can inline the comparison
+struct index_key {
+	static inline unsigned long long key(struct index const &ix) {
+		return ix.index;
+	}
+
+	inline bool operator()(struct index const &a, struct index const &b) const {
+		if (a.index != b.index) {
+			return a.index < b.index;
+		}
+		return a.seq < b.seq;
+	}
+};
+
+#define RADIX_BITS 12
+
+// Buckets smaller than this are finished with a comparison sort
+#define RADIX_CUTOFF 65536
+
+// Most-significant-digit radix sort from src into dst. The digit is
+// taken from the highest bits where the keys of the range differ, so
+// that spatially clustered input still spreads across the buckets.
+// Ties within a bucket, including records with equal keys, are
+// ordered by the comparator. src is left in an unspecified order.
+template <typename T, typename K>
+static void radix_sort(T *src, T *dst, size_t n) {
+	if (n < RADIX_CUTOFF) {
+		memcpy(dst, src, n * sizeof(T));
+		std::sort(dst, dst + n, K());
+		return;
+	}
+
+	unsigned long long lo = K::key(src[0]);
+	unsigned long long hi = lo;
+	for (size_t i = 1; i < n; i++) {
+		unsigned long long k = K::key(src[i]);
+		if (k < lo) {
+			lo = k;
+		}
+		if (k > hi) {
+			hi = k;
+		}
+	}
+
+	if (lo == hi) {
+		memcpy(dst, src, n * sizeof(T));
+		std::sort(dst, dst + n, K());
+		return;
+	}
+
+	int shift = 0;
+	while (((lo ^ hi) >> shift) >= (1ULL << RADIX_BITS)) {
+		shift++;
+	}
+	unsigned long long base = (lo >> shift) << shift;
+
+	std::vector<size_t> ends((1 << RADIX_BITS) + 1, 0);
+	for (size_t i = 0; i < n; i++) {
+		ends[((K::key(src[i]) - base) >> shift) + 1]++;
+	}
+	for (size_t b = 1; b <= (1 << RADIX_BITS); b++) {
+		ends[b] += ends[b - 1];
+	}
+
+	std::vector<size_t> next(ends.begin(), ends.end() - 1);
+	for (size_t i = 0; i < n; i++) {
+		dst[next[(K::key(src[i]) - base) >> shift]++] = src[i];
+	}
+
+	for (size_t b = 0; b < (1 << RADIX_BITS); b++) {
+		size_t len = ends[b + 1] - ends[b];
+
+		if (len < RADIX_CUTOFF) {
+			std::sort(dst + ends[b], dst + ends[b + 1], K());
+		} else {
+			// src is free for reuse now that everything is in dst
+			memcpy(src + ends[b], dst + ends[b], len * sizeof(T));
+			radix_sort<T, K>(src + ends[b], dst + ends[b], len);
+		}
+	}
+}
+
 struct mergelist {
 	long long start;
 	long long end;
-
-	struct mergelist *next;
+	long long prefetched;  // how far ahead of start the index has been asked for
 };
 
-static void insert(struct mergelist *m, struct mergelist **head, unsigned char *map) {
-	while (*head != NULL && indexcmp(map + m->start, map + (*head)->start) > 0) {
-		head = &((*head)->next);
+// How much of each run's index to ask the kernel for at a time
+#define MERGE_PREFETCH (256 * 1024)
+
+// How much to buffer the reordered geometry and index before writing
+#define MERGE_BUFFER (4 * 1024 * 1024)
+
+// Restore the heap order of the runs after the run at position i,
+// usually the top, has moved on to its next record
+static void sift_down(struct mergelist **heap, size_t n, size_t i, unsigned char *map) {
+	struct mergelist *m = heap[i];
+
+	while (true) {
+		size_t child = 2 * i + 1;
+		if (child >= n) {
+			break;
+		}
+		if (child + 1 < n && indexcmp(map + heap[child + 1]->start, map + heap[child]->start) < 0) {
+			child++;
+		}
+		if (indexcmp(map + heap[child]->start, map + m->start) >= 0) {
+			break;
+		}
+
+		heap[i] = heap[child];
+		i = child;
 	}
 
-	m->next = *head;
-	*head = m;
+	heap[i] = m;
+}
+
+static void prefetch_run(struct mergelist *m, unsigned char *map) {
+	if (m->start + MERGE_PREFETCH / 2 > m->prefetched && m->prefetched < m->end) {
+		// madvise() needs a page-aligned address
+		long long page = sysconf(_SC_PAGESIZE);
+		long long from = m->prefetched / page * page;
+		long long to = m->start + MERGE_PREFETCH;
+		if (to > m->end) {
+			to = m->end;
+		}
+
+		madvise(map + from, to - from, MADV_WILLNEED);
+		m->prefetched = to;
+	}
 }
 
 struct drop_state {
@@ -255,43 +373,294 @@ int calc_feature_minzoom(struct index *ix, struct drop_state *ds, int maxzoom, i
 	return feature_minzoom;
 }
 
-static void merge(struct mergelist *merges, size_t nmerges, unsigned char *map, FILE *indexfile, int bytes, long long nrec, char *geom_map, FILE *geom_out, long long *geompos, long long *progress, long long *progress_max, long long *progress_reported, int maxzoom, int basezoom, double droprate, double gamma, struct drop_state *ds) {
-	struct mergelist *head = NULL;
+static bool index_less(struct index const &a, struct index const &b) {
+	return indexcmp(&a, &b) < 0;
+}
 
-	for (size_t i = 0; i < nmerges; i++) {
-		if (merges[i].start < merges[i].end) {
-			insert(&(merges[i]), &head, map);
+struct merge_arg {
+	std::vector<struct mergelist> runs;  // this thread's part of each sorted run
+	unsigned char *map;
+	int bytes;
+	long long records;
+	long long geom_bytes;
+
+	char *geom_map;
+	int geomfd;
+	long long geompos;  // where this thread's geometry goes in the output
+	int indexfd;
+	long long indexpos;  // and where its index records go
+	long long *progress;
+	long long *progress_max;
+	long long *progress_reported;
+	bool report;
+};
+
+// Count how many records and how much geometry this thread's key range
+// holds, so that each thread's part of the output can be placed before
+// any of them are merged
+void *run_merge_count(void *v) {
+	struct merge_arg *a = (struct merge_arg *) v;
+
+	a->records = 0;
+	a->geom_bytes = 0;
+	for (size_t i = 0; i < a->runs.size(); i++) {
+		for (long long pos = a->runs[i].start; pos < a->runs[i].end; pos += a->bytes) {
+			struct index *ix = (struct index *) (a->map + pos);
+			a->geom_bytes += ix->end - ix->start;
+		}
+		a->records += (a->runs[i].end - a->runs[i].start) / a->bytes;
+	}
+
+	return NULL;
+}
+
+static void pwrite_check(int fd, std::string &buf, long long *pos, const char *what) {
+	const char *s = buf.data();
+	size_t len = buf.size();
+
+	while (len > 0) {
+		ssize_t n = pwrite(fd, s, len, *pos);
+		if (n <= 0) {
+			perror(what);
+			exit(EXIT_FAILURE);
 		}
+		s += n;
+		len -= n;
+		*pos += n;
 	}
 
-	while (head != NULL) {
-		struct index ix = *((struct index *) (map + head->start));
-		long long pos = *geompos;
-		fwrite_check(geom_map + ix.start, 1, ix.end - ix.start, geom_out, "merge geometry");
-		*geompos += ix.end - ix.start;
-		int feature_minzoom = calc_feature_minzoom(&ix, ds, maxzoom, basezoom, droprate, gamma);
-		serialize_byte(geom_out, feature_minzoom, geompos, "merge geometry");
+	buf.clear();
+}
+
+// Merge this thread's key range of all the runs, copying each record's
+// geometry straight into the thread's own part of the output. The minzoom
+// after each geometry is left as 0 until merge() can fill them all in order.
+void *run_merge(void *v) {
+	struct merge_arg *a = (struct merge_arg *) v;
+
+	// A binary heap of the runs that still have records, ordered by
+	// each one's next record, so that finding the next record overall
+	// takes log(runs) comparisons instead of a walk through the runs
+	std::vector<struct mergelist *> heap;
+
+	for (size_t i = 0; i < a->runs.size(); i++) {
+		if (a->runs[i].start < a->runs[i].end) {
+			a->runs[i].prefetched = a->runs[i].start;
+			prefetch_run(&a->runs[i], a->map);
+			heap.push_back(&a->runs[i]);
+		}
+	}
+
+	for (size_t i = heap.size(); i > 0; i--) {
+		sift_down(heap.data(), heap.size(), i - 1, a->map);
+	}
+
+	std::string geom, index;
+	geom.reserve(MERGE_BUFFER + 1);
+	long long geompos = a->geompos;
+	long long indexpos = a->indexpos;
+	long long written = geompos;  // how far geom has been flushed
+	long long progress = 0;
+
+	while (heap.size() > 0) {
+		struct mergelist *head = heap[0];
+		struct index ix = *((struct index *) (a->map + head->start));
+		head->start += a->bytes;
+
+		if (head->start < head->end) {
+			prefetch_run(head, a->map);
+		} else {
+			heap[0] = heap.back();
+			heap.pop_back();
+		}
+		if (heap.size() > 0) {
+			sift_down(heap.data(), heap.size(), 0, a->map);
+		}
+
+		geom.append(a->geom_map + ix.start, ix.end - ix.start);
+		geom.push_back(0);
+		progress += (ix.end - ix.start) * 3 / 4;
+
+		long long len = ix.end - ix.start + 1;  // geometry plus minzoom
+		ix.start = geompos;
+		geompos += len;
+		ix.end = geompos;
+		index.append((char *) &ix, a->bytes);
+
+		if (geom.size() >= MERGE_BUFFER) {
+			pwrite_check(a->geomfd, geom, &written, "merge geometry");
+		}
+		if (index.size() >= MERGE_BUFFER) {
+			pwrite_check(a->indexfd, index, &indexpos, "merge temporary");
+		}
 
 		// Count this as an 75%-accomplishment, since we already 25%-counted it
-		*progress += (ix.end - ix.start) * 3 / 4;
-		if (!quiet && 100 * *progress / *progress_max != *progress_reported) {
-			fprintf(stderr, "Reordering geometry: %lld%% \r", 100 * *progress / *progress_max);
-			*progress_reported = 100 * *progress / *progress_max;
+		if (progress >= MERGE_BUFFER || heap.size() == 0) {
+			long long now = __sync_add_and_fetch(a->progress, progress);
+			progress = 0;
+
+			if (a->report && !quiet && 100 * now / *a->progress_max != *a->progress_reported) {
+				fprintf(stderr, "Reordering geometry: %lld%% \r", 100 * now / *a->progress_max);
+				*a->progress_reported = 100 * now / *a->progress_max;
+			}
+		}
+	}
+
+	pwrite_check(a->geomfd, geom, &written, "merge geometry");
+	pwrite_check(a->indexfd, index, &indexpos, "merge temporary");
+	return NULL;
+}
+
+// Dropping depends on every feature that came before, so the minzooms
+// have to be calculated in order. They only need the index, so read back
+// the index that the merge just wrote, and patch each minzoom into the
+// byte after its geometry.
+static void merge_minzooms(int indexfd, long long indexstart, long long indexend, int geomfd, long long geomstart, long long geomend, int bytes, int maxzoom, int basezoom, double droprate, double gamma, struct drop_state *ds) {
+	if (indexstart >= indexend) {
+		return;
+	}
+
+	long long page = sysconf(_SC_PAGESIZE);
+	long long geombase = geomstart - geomstart % page;
+	char *geommap = (char *) mmap(NULL, geomend - geombase, PROT_READ | PROT_WRITE, MAP_SHARED, geomfd, geombase);
+	if (geommap == MAP_FAILED) {
+		perror("map merged geometry");
+		exit(EXIT_FAILURE);
+	}
+	madvise(geommap, geomend - geombase, MADV_SEQUENTIAL);
+
+	std::vector<char> buf((MERGE_BUFFER / bytes) * bytes);
+	for (long long pos = indexstart; pos < indexend;) {
+		size_t want = buf.size();
+		if (indexend - pos < (long long) want) {
+			want = indexend - pos;
+		}
+
+		ssize_t n = pread(indexfd, buf.data(), want, pos);
+		if (n <= 0 || n % bytes != 0) {
+			perror("read merged index");
+			exit(EXIT_FAILURE);
+		}
+
+		for (ssize_t i = 0; i < n; i += bytes) {
+			struct index *ix = (struct index *) (buf.data() + i);
+			signed char feature_minzoom = calc_feature_minzoom(ix, ds, maxzoom, basezoom, droprate, gamma);
+			if (feature_minzoom != 0) {
+				geommap[ix->end - 1 - geombase] = feature_minzoom;
+			}
+		}
+
+		pos += n;
+	}
+
+	if (munmap(geommap, geomend - geombase) < 0) {
+		perror("unmap merged geometry");
+		exit(EXIT_FAILURE);
+	}
+}
+
+static void merge(struct mergelist *merges, size_t nmerges, unsigned char *map, FILE *indexfile, int bytes, long long nrec, char *geom_map, FILE *geom_out, long long *geompos, long long *progress, long long *progress_max, long long *progress_reported, int maxzoom, int basezoom, double droprate, double gamma, struct drop_state *ds) {
+	// Divide the key space into one range for each thread, using
+	// splitters sampled evenly from each of the sorted runs
+	size_t threads = CPUS;
+	if (nrec < 10000 * (long long) threads) {
+		threads = nrec / 10000 + 1;
+	}
+
+	std::vector<struct index> splitters;
+	if (threads > 1) {
+		std::vector<struct index> samples;
+		for (size_t i = 0; i < nmerges; i++) {
+			long long n = (merges[i].end - merges[i].start) / bytes;
+			for (size_t s = 0; s < 16 * threads && n > 0; s++) {
+				samples.push_back(*((struct index *) (map + merges[i].start + (n * s / (16 * threads)) * bytes)));
+			}
 		}
+		std::sort(samples.begin(), samples.end(), index_less);
+		for (size_t t = 1; t < threads; t++) {
+			splitters.push_back(samples[samples.size() * t / threads]);
+		}
+	}
+
+	std::vector<struct merge_arg> args(threads);
+	for (size_t t = 0; t < threads; t++) {
+		args[t].map = map;
+		args[t].bytes = bytes;
+		args[t].geom_map = geom_map;
+		args[t].progress = progress;
+		args[t].progress_max = progress_max;
+		args[t].progress_reported = progress_reported;
+		args[t].report = (t == 0);
+	}
+
+	for (size_t i = 0; i < nmerges; i++) {
+		struct index *begin = (struct index *) (map + merges[i].start);
+		struct index *end = (struct index *) (map + merges[i].end);
 
-		ix.start = pos;
-		ix.end = *geompos;
-		fwrite_check(&ix, bytes, 1, indexfile, "merge temporary");
-		head->start += bytes;
+		struct index *here = begin;
+		for (size_t t = 0; t < threads; t++) {
+			struct index *there = end;
+			if (t < splitters.size()) {
+				there = std::lower_bound(here, end, splitters[t], index_less);
+			}
 
-		struct mergelist *m = head;
-		head = m->next;
-		m->next = NULL;
+			struct mergelist m;
+			m.start = merges[i].start + (here - begin) * bytes;
+			m.end = merges[i].start + (there - begin) * bytes;
+			m.prefetched = m.start;
+			args[t].runs.push_back(m);
 
-		if (m->start < m->end) {
-			insert(m, &head, map);
+			here = there;
 		}
 	}
+
+	std::vector<struct pool_task *> workers(threads);
+	for (size_t t = 0; t < threads; t++) {
+		workers[t] = task_start(run_merge_count, &args[t]);
+	}
+	for (size_t t = 0; t < threads; t++) {
+		task_join(workers[t]);
+	}
+
+	// Each thread's records and geometry go right after the previous thread's,
+	// which puts the whole output in key order
+
+	if (fflush(geom_out) != 0 || fflush(indexfile) != 0) {
+		perror("flush merge output");
+		exit(EXIT_FAILURE);
+	}
+	long long indexstart = ftello(indexfile);
+	if (indexstart < 0) {
+		perror("ftell index");
+		exit(EXIT_FAILURE);
+	}
+	long long geomstart = *geompos;
+	long long indexpos = indexstart;
+
+	for (size_t t = 0; t < threads; t++) {
+		args[t].geomfd = fileno(geom_out);
+		args[t].geompos = *geompos;
+		args[t].indexfd = fileno(indexfile);
+		args[t].indexpos = indexpos;
+
+		*geompos += args[t].geom_bytes + args[t].records;
+		indexpos += args[t].records * bytes;
+	}
+
+	for (size_t t = 0; t < threads; t++) {
+		workers[t] = task_start(run_merge, &args[t]);
+	}
+	for (size_t t = 0; t < threads; t++) {
+		task_join(workers[t]);
+	}
+
+	merge_minzooms(fileno(indexfile), indexstart, indexpos, fileno(geom_out), geomstart, *geompos, bytes, maxzoom, basezoom, droprate, gamma, ds);
+
+	// Carry on writing after everything the threads wrote
+	if (fseeko(geom_out, *geompos, SEEK_SET) != 0 || fseeko(indexfile, indexpos, SEEK_SET) != 0) {
+		perror("seek merge output");
+		exit(EXIT_FAILURE);
+	}
 }
 
 struct sort_arg {
@@ -305,6 +674,10 @@ struct sort_arg {
 	int bytes;
 };
 
+// Totals for --report-thread-utilization
+static long long sort_bytes = 0;
+static double sort_seconds = 0;
+
 void *run_sort(void *v) {
 	struct sort_arg *a = (struct sort_arg *) v;
 
@@ -314,10 +687,9 @@ void *run_sort(void *v) {
 		if (end > a->indexpos) {
 			end = a->indexpos;
 		}
-
 		a->merges[start / a->unit].start = start;
 		a->merges[start / a->unit].end = end;
-		a->merges[start / a->unit].next = NULL;
+		a->merges[start / a->unit].prefetched = start;
 
 		// MAP_PRIVATE to avoid disk writes if it fits in memory
 		void *map = mmap(NULL, end - start, PROT_READ | PROT_WRITE, MAP_PRIVATE, a->indexfd, start);
@@ -325,10 +697,21 @@ void *run_sort(void *v) {
 			perror("mmap in run_sort");
 			exit(EXIT_FAILURE);
 		}
-		madvise(map, end - start, MADV_RANDOM);
+		madvise(map, end - start, MADV_SEQUENTIAL);
 		madvise(map, end - start, MADV_WILLNEED);
 
-		qsort(map, (end - start) / a->bytes, a->bytes, indexcmp);
+		// The radix sort needs somewhere to put the records other
+		// than where they started. The private mapping can't be
+		// sorted into the shared one directly, because pages of it
+		// that haven't been copied yet would see the writes.
+
+		size_t n = (end - start) / a->bytes;
+		struct index *sorted = (struct index *) malloc(end - start);
+		if (sorted != NULL) {
+			radix_sort<struct index, index_key>((struct index *) map, sorted, n);
+		} else {
+			std::sort((struct index *) map, (struct index *) map + n, index_key());
+		}
 
 		// Sorting and then copying avoids disk access to
 		// write out intermediate stages of the sort.
@@ -340,7 +723,12 @@ void *run_sort(void *v) {
 		}
 		madvise(map2, end - start, MADV_SEQUENTIAL);
 
-		memcpy(map2, map, end - start);
+		if (sorted != NULL) {
+			memcpy(map2, sorted, end - start);
+			free(sorted);
+		} else {
+			memcpy(map2, map, end - start);
+		}
 
 		// No madvise, since caller will want the sorted data
 		munmap(map, end - start);
@@ -376,7 +764,7 @@ void do_read_parallel(char *map, long long len, long long initial_offset, const
 
 	struct parse_json_args pja[CPUS];
 	struct serialization_state sst[CPUS];
-	pthread_t pthreads[CPUS];
+	struct pool_task *workers[CPUS];
 	std::vector<std::set<type_and_string> > file_subkeys;
 
 	for (size_t i = 0; i < CPUS; i++) {
@@ -413,18 +801,11 @@ void do_read_parallel(char *map, long long len, long long initial_offset, const
 
 		pja[i].sst = &sst[i];
 
-		if (pthread_create(&pthreads[i], NULL, run_parse_json, &pja[i]) != 0) {
-			perror("pthread_create");
-			exit(EXIT_FAILURE);
-		}
+		workers[i] = task_start(run_parse_json, &pja[i]);
 	}
 
 	for (size_t i = 0; i < CPUS; i++) {
-		void *retval;
-
-		if (pthread_join(pthreads[i], &retval) != 0) {
-			perror("pthread_join 370");
-		}
+		task_join(workers[i]);
 
 		*dist_sum += dist_sums[i];
 		*dist_count += dist_counts[i];
@@ -503,7 +884,7 @@ void *run_read_parallel(void *v) {
 	return NULL;
 }
 
-void start_parsing(int fd, FILE *fp, long long offset, long long len, volatile int *is_parsing, pthread_t *parallel_parser, bool &parser_created, const char *reading, struct reader *readers, volatile long long *progress_seq, std::set<std::string> *exclude, std::set<std::string> *include, int exclude_all, json_object *filter, char *fname, int basezoom, int source, int nlayers, std::vector<std::map<std::string, layermap_entry> > &layermaps, double droprate, int *initialized, unsigned *initial_x, unsigned *initial_y, int maxzoom, std::string layername, bool uses_gamma, std::map<std::string, int> const *attribute_types, int separator, double *dist_sum, size_t *dist_count, bool want_dist, bool filters) {
+void start_parsing(int fd, FILE *fp, long long offset, long long len, volatile int *is_parsing, struct pool_task **parallel_parser, bool &parser_created, const char *reading, struct reader *readers, volatile long long *progress_seq, std::set<std::string> *exclude, std::set<std::string> *include, int exclude_all, json_object *filter, char *fname, int basezoom, int source, int nlayers, std::vector<std::map<std::string, layermap_entry> > &layermaps, double droprate, int *initialized, unsigned *initial_x, unsigned *initial_y, int maxzoom, std::string layername, bool uses_gamma, std::map<std::string, int> const *attribute_types, int separator, double *dist_sum, size_t *dist_count, bool want_dist, bool filters) {
 	// This has to kick off an intermediate thread to start the parser threads,
 	// so the main thread can get back to reading the next input stage while
 	// the intermediate thread waits for the completion of the parser threads.
@@ -548,10 +929,7 @@ void start_parsing(int fd, FILE *fp, long long offset, long long len, volatile i
 	rpa->want_dist = want_dist;
 	rpa->filters = filters;
 
-	if (pthread_create(parallel_parser, NULL, run_read_parallel, rpa) != 0) {
-		perror("pthread_create");
-		exit(EXIT_FAILURE);
-	}
+	*parallel_parser = task_start(run_read_parallel, rpa);
 	parser_created = true;
 }
 
@@ -711,7 +1089,10 @@ void radix1(int *geomfds_in, int *indexfds_in, int inputs, int prefix, int split
 				// Don't try to sort more than 2GB at once,
 				// which used to crash Macs and may still
 				long long max_unit = 2LL * 1024 * 1024 * 1024;
-				long long unit = ((indexpos / CPUS + bytes - 1) / bytes) * bytes;
+				// Each chunk is only half of what the CPUs could share,
+				// since the radix sort needs another buffer as big as the
+				// chunk, and the two together still have to fit in memory
+				long long unit = ((indexpos / (2 * CPUS) + bytes - 1) / bytes) * bytes;
 				if (unit > max_unit) {
 					unit = max_unit;
 				}
@@ -727,8 +1108,9 @@ void radix1(int *geomfds_in, int *indexfds_in, int inputs, int prefix, int split
 					merges[a].start = merges[a].end = 0;
 				}
 
-				pthread_t pthreads[CPUS];
+				struct pool_task *workers[CPUS];
 				struct sort_arg args[CPUS];
+				double sort_start = wall_time();
 
 				for (size_t a = 0; a < CPUS; a++) {
 					args[a].task = a;
@@ -740,20 +1122,16 @@ void radix1(int *geomfds_in, int *indexfds_in, int inputs, int prefix, int split
 					args[a].unit = unit;
 					args[a].bytes = bytes;
 
-					if (pthread_create(&pthreads[a], NULL, run_sort, &args[a]) != 0) {
-						perror("pthread_create");
-						exit(EXIT_FAILURE);
-					}
+					workers[a] = task_start(run_sort, &args[a]);
 				}
 
 				for (size_t a = 0; a < CPUS; a++) {
-					void *retval;
-
-					if (pthread_join(pthreads[a], &retval) != 0) {
-						perror("pthread_join 679");
-					}
+					task_join(workers[a]);
 				}
 
+				sort_bytes += indexpos;
+				sort_seconds += wall_time() - sort_start;
+
 				struct indexmap *indexmap = (struct indexmap *) mmap(NULL, indexst.st_size, PROT_READ, MAP_PRIVATE, indexfds[i], 0);
 				if (indexmap == MAP_FAILED) {
 					fprintf(stderr, "fd %lld, len %lld\n", (long long) indexfds[i], (long long) indexst.st_size);
@@ -948,6 +1326,10 @@ void radix(struct reader *readers, int nreaders, FILE *geomfile, int geomfd, FIL
 	long long availfiles_before = availfiles;
 	radix1(geomfds, indexfds, nreaders, 0, splits, mem, tmpdir, &availfiles, geomfile, indexfile, geompos, &progress, &progress_max, &progress_reported, maxzoom, basezoom, droprate, gamma, ds);
 
+	if (additional[A_REPORT_UTILIZATION] && sort_bytes > 0) {
+		fprintf(stderr, "Sorted %.1f MB of index in %.3f seconds (%.3f seconds per GB)\n", sort_bytes / 1048576.0, sort_seconds, sort_seconds / (sort_bytes / 1073741824.0));
+	}
+
 	if (availfiles - 2 * nreaders != availfiles_before) {
 		fprintf(stderr, "Internal error: miscounted available file descriptors: %lld vs %lld\n", availfiles - 2 * nreaders, availfiles);
 		exit(EXIT_FAILURE);
@@ -1055,12 +1437,12 @@ int read_input(std::vector<source> &sources, char *fname, int maxzoom, int minzo
 			perror(metaname);
 			exit(EXIT_FAILURE);
 		}
-		r->poolfile = memfile_open(r->poolfd);
+		r->poolfile = memfile_open(r->poolfd, additional[A_HUGEPAGES]);
 		if (r->poolfile == NULL) {
 			perror(poolname);
 			exit(EXIT_FAILURE);
 		}
-		r->treefile = memfile_open(r->treefd);
+		r->treefile = memfile_open(r->treefd, additional[A_HUGEPAGES]);
 		if (r->treefile == NULL) {
 			perror(treename);
 			exit(EXIT_FAILURE);
@@ -1085,11 +1467,7 @@ int read_input(std::vector<source> &sources, char *fname, int maxzoom, int minzo
 		unlink(geomname);
 		unlink(indexname);
 
-		// To distinguish a null value
-		{
-			struct stringpool p;
-			memfile_write(r->treefile, &p, sizeof(struct stringpool));
-		}
+		pool_init(r->treefile);
 		// Keep metadata file from being completely empty if no attributes
 		serialize_int(r->metafile, 0, &r->metapos, "meta");
 
@@ -1351,7 +1729,7 @@ int read_input(std::vector<source> &sources, char *fname, int maxzoom, int minzo
 				volatile int is_parsing = 0;
 				long long ahead = 0;
 				long long initial_offset = overall_offset;
-				pthread_t parallel_parser;
+				struct pool_task *parallel_parser;
 				bool parser_created = false;
 
 #define READ_BUF 2000
@@ -1372,10 +1750,7 @@ int read_input(std::vector<source> &sources, char *fname, int maxzoom, int minzo
 
 						if (is_parsing == 0 || ahead >= PARSE_MAX) {
 							if (parser_created) {
-								if (pthread_join(parallel_parser, NULL) != 0) {
-									perror("pthread_join 1088");
-									exit(EXIT_FAILURE);
-								}
+								task_join(parallel_parser);
 								parser_created = false;
 							}
 
@@ -1407,10 +1782,7 @@ int read_input(std::vector<source> &sources, char *fname, int maxzoom, int minzo
 				}
 
 				if (parser_created) {
-					if (pthread_join(parallel_parser, NULL) != 0) {
-						perror("pthread_join 1122");
-						exit(EXIT_FAILURE);
-					}
+					task_join(parallel_parser);
 					parser_created = false;
 				}
 
@@ -1420,9 +1792,7 @@ int read_input(std::vector<source> &sources, char *fname, int maxzoom, int minzo
 					start_parsing(readfd, readfp, initial_offset, ahead, &is_parsing, &parallel_parser, parser_created, reading.c_str(), readers, &progress_seq, exclude, include, exclude_all, filter, fname, basezoom, layer, nlayers, layermaps, droprate, initialized, initial_x, initial_y, maxzoom, sources[layer].layer, gamma != 0, attribute_types, read_parallel_this, &dist_sum, &dist_count, guess_maxzoom, prefilter != NULL || postfilter != NULL);
 
 					if (parser_created) {
-						if (pthread_join(parallel_parser, NULL) != 0) {
-							perror("pthread_join 1133");
-						}
+						task_join(parallel_parser);
 						parser_created = false;
 					}
 
@@ -1477,6 +1847,7 @@ int read_input(std::vector<source> &sources, char *fname, int maxzoom, int minzo
 		//     (stderr, "Read 10000.00 million features\r", *progress_seq / 1000000.0);
 	}
 
+	long long pool_hits = 0, pool_misses = 0, pool_saved = 0;
 	for (size_t i = 0; i < CPUS; i++) {
 		if (fclose(readers[i].metafile) != 0) {
 			perror("fclose meta");
@@ -1490,6 +1861,10 @@ int read_input(std::vector<source> &sources, char *fname, int maxzoom, int minzo
 			perror("fclose index");
 			exit(EXIT_FAILURE);
 		}
+		struct pool_header *ph = (struct pool_header *) readers[i].treefile->map;
+		pool_hits += ph->hits;
+		pool_misses += ph->misses;
+		pool_saved += ph->bytes_saved;
 		memfile_close(readers[i].treefile);
 
 		if (fstat(readers[i].geomfd, &readers[i].geomst) != 0) {
@@ -1621,11 +1996,14 @@ int read_input(std::vector<source> &sources, char *fname, int maxzoom, int minzo
 		perror(indexname);
 		exit(EXIT_FAILURE);
 	}
-	FILE *indexfile = fopen_oflag(indexname, "wb", O_WRONLY | O_CLOEXEC);
+	// Read as well as written, since merge() goes back over what it wrote
+	FILE *indexfile = fopen_oflag(indexname, "w+b", O_RDWR | O_CLOEXEC);
 	if (indexfile == NULL) {
 		perror(indexname);
 		exit(EXIT_FAILURE);
 	}
+	std::vector<char> indexbuf(MERGE_BUFFER);
+	setvbuf(indexfile, indexbuf.data(), _IOFBF, indexbuf.size());
 
 	unlink(indexname);
 
@@ -1637,11 +2015,13 @@ int read_input(std::vector<source> &sources, char *fname, int maxzoom, int minzo
 		perror(geomname);
 		exit(EXIT_FAILURE);
 	}
-	FILE *geomfile = fopen_oflag(geomname, "wb", O_WRONLY | O_CLOEXEC);
+	FILE *geomfile = fopen_oflag(geomname, "w+b", O_RDWR | O_CLOEXEC);
 	if (geomfile == NULL) {
 		perror(geomname);
 		exit(EXIT_FAILURE);
 	}
+	std::vector<char> geombuf(MERGE_BUFFER);
+	setvbuf(geomfile, geombuf.data(), _IOFBF, geombuf.size());
 	unlink(geomname);
 
 	unsigned iz = 0, ix = 0, iy = 0;
@@ -1679,6 +2059,9 @@ int read_input(std::vector<source> &sources, char *fname, int maxzoom, int minzo
 	if (!quiet) {
 		fprintf(stderr, "%lld features, %lld bytes of geometry, %lld bytes of separate metadata, %lld bytes of string pool\n", progress_seq, geompos, metapos, poolpos);
 	}
+	if (!quiet && additional[A_REPORT_UTILIZATION]) {
+		fprintf(stderr, "string pool: %lld strings added, %lld reused, %lld bytes saved\n", pool_misses, pool_hits, pool_saved);
+	}
 
 	if (indexpos == 0) {
 		fprintf(stderr, "Did not read any valid geometries\n");
@@ -2002,7 +2385,9 @@ int read_input(std::vector<source> &sources, char *fname, int maxzoom, int minzo
 	}
 
 	unsigned midx = 0, midy = 0;
-	int written = traverse_zooms(fd, size, meta, stringpool, &midx, &midy, maxzoom, minzoom, basezoom, outdb, outdir, droprate, buffer, fname, tmpdir, gamma, full_detail, low_detail, min_detail, meta_off, pool_off, initial_x, initial_y, simplification, layermaps, prefilter, postfilter);
+	tile_writer *writer = tile_writer_start(outdb, outdir, additional[A_DEDUPLICATE_TILES]);
+	int written = traverse_zooms(fd, size, meta, stringpool, &midx, &midy, maxzoom, minzoom, basezoom, writer, droprate, buffer, fname, tmpdir, gamma, full_detail, low_detail, min_detail, meta_off, pool_off, initial_x, initial_y, simplification, layermaps, prefilter, postfilter);
+	tile_writer_finish(writer);
 
 	if (maxzoom != written) {
 		fprintf(stderr, "\n\n\n*** NOTE TILES ONLY COMPLETE THROUGH ZOOM %d ***\n\n\n", written);
@@ -2117,6 +2502,7 @@ int main(int argc, char **argv) {
 #endif
 
 	init_cpus();
+	threadpool_init(CPUS);
 
 	extern int optind;
 	extern char *optarg;
@@ -2162,6 +2548,7 @@ int main(int argc, char **argv) {
 		{"output-to-directory", required_argument, 0, 'e'},
 		{"force", no_argument, 0, 'f'},
 		{"allow-existing", no_argument, 0, 'F'},
+		{"deduplicate-tiles", no_argument, &additional[A_DEDUPLICATE_TILES], 1},
 
 		{"Tileset description and attribution", 0, 0, 0},
 		{"name", required_argument, 0, 'n'},
@@ -2208,6 +2595,7 @@ int main(int argc, char **argv) {
 		{"drop-smallest-as-needed", no_argument, &additional[A_DROP_SMALLEST_AS_NEEDED], 1},
 		{"coalesce-smallest-as-needed", no_argument, &additional[A_COALESCE_SMALLEST_AS_NEEDED], 1},
 		{"force-feature-limit", no_argument, &prevent[P_DYNAMIC_DROP], 1},
+		{"predict-tile-size", no_argument, &additional[A_PREDICT_TILE_SIZE], 1},
 
 		{"Dropping tightly overlapping features", 0, 0, 0},
 		{"gamma", required_argument, 0, 'g'},
@@ -2249,14 +2637,18 @@ int main(int argc, char **argv) {
 		{"no-feature-limit", no_argument, &prevent[P_FEATURE_LIMIT], 1},
 		{"no-tile-size-limit", no_argument, &prevent[P_KILOBYTE_LIMIT], 1},
 		{"no-tile-compression", no_argument, &prevent[P_TILE_COMPRESSION], 1},
+		{"parallel-tile-compression", no_argument, &additional[A_PARALLEL_COMPRESSION], 1},
 		{"no-tile-stats", no_argument, &prevent[P_TILE_STATS], 1},
 
 		{"Temporary storage", 0, 0, 0},
 		{"temporary-directory", required_argument, 0, 't'},
+		{"use-transparent-hugepages", no_argument, &additional[A_HUGEPAGES], 1},
+		{"compress-temporary-files", no_argument, &additional[A_COMPRESS_TEMPORARY], 1},
 
 		{"Progress indicator", 0, 0, 0},
 		{"quiet", no_argument, 0, 'q'},
 		{"version", no_argument, 0, 'v'},
+		{"report-thread-utilization", no_argument, &additional[A_REPORT_UTILIZATION], 1},
 
 		{"", 0, 0, 0},
 		{"prevent", required_argument, 0, 'p'},
@@ -2264,6 +2656,8 @@ int main(int argc, char **argv) {
 		{"check-polygons", no_argument, &additional[A_DEBUG_POLYGON], 1},
 		{"no-polygon-splitting", no_argument, &prevent[P_POLYGON_SPLIT], 1},
 		{"prefer-radix-sort", no_argument, &additional[A_PREFER_RADIX_SORT], 1},
+		{"prefer-geometry-arrays", no_argument, &additional[A_GEOMETRY_ARRAYS], 1},
+		{"no-zoom-pipelining", no_argument, &prevent[P_ZOOM_PIPELINE], 1},
 
 		{0, 0, 0, 0},
 	};
@@ -2648,7 +3042,7 @@ int main(int argc, char **argv) {
 			unlink(out_mbtiles);
 		}
 
-		outdb = mbtiles_open(out_mbtiles, argv, forcetable);
+		outdb = mbtiles_open(out_mbtiles, argv, forcetable, additional[A_DEDUPLICATE_TILES]);
 	}
 	if (out_dir != NULL) {
 		if (force) {
@@ -19,6 +19,7 @@ extern int quiet;
 
 extern size_t CPUS;
 extern size_t TEMP_FILES;
+extern long long MAX_FILES;
 
 extern size_t max_tile_size;
 
@@ -6,17 +6,21 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <limits.h>
 #include <sqlite3.h>
+#include <pthread.h>
 #include <vector>
 #include <string>
 #include <set>
 #include <map>
+#include <unordered_map>
 #include "mvt.hpp"
 #include "mbtiles.hpp"
+#include "dirtiles.hpp"
 #include "text.hpp"
 #include "milo/dtoa_milo.h"
 
-sqlite3 *mbtiles_open(char *dbname, char **argv, int forcetable) {
+sqlite3 *mbtiles_open(char *dbname, char **argv, int forcetable, bool deduplicate) {
 	sqlite3 *outdb;
 
 	if (sqlite3_open(dbname, &outdb) != SQLITE_OK) {
@@ -43,10 +47,34 @@ sqlite3 *mbtiles_open(char *dbname, char **argv, int forcetable) {
 			exit(EXIT_FAILURE);
 		}
 	}
-	if (sqlite3_exec(outdb, "CREATE TABLE tiles (zoom_level integer, tile_column integer, tile_row integer, tile_data blob);", NULL, NULL, &err) != SQLITE_OK) {
-		fprintf(stderr, "%s: create tiles table: %s\n", argv[0], err);
-		if (!forcetable) {
-			exit(EXIT_FAILURE);
+	if (deduplicate) {
+		// Each distinct tile is stored once in images, and map points
+		// each zoom/x/y at one of them. The tiles view makes the result
+		// look like an ordinary tileset to anything that reads it.
+		if (sqlite3_exec(outdb, "CREATE TABLE map (zoom_level integer, tile_column integer, tile_row integer, tile_id text);", NULL, NULL, &err) != SQLITE_OK) {
+			fprintf(stderr, "%s: create map table: %s\n", argv[0], err);
+			if (!forcetable) {
+				exit(EXIT_FAILURE);
+			}
+		}
+		if (sqlite3_exec(outdb, "CREATE TABLE images (tile_data blob, tile_id text);", NULL, NULL, &err) != SQLITE_OK) {
+			fprintf(stderr, "%s: create images table: %s\n", argv[0], err);
+			if (!forcetable) {
+				exit(EXIT_FAILURE);
+			}
+		}
+		if (sqlite3_exec(outdb, "CREATE VIEW tiles AS SELECT map.zoom_level AS zoom_level, map.tile_column AS tile_column, map.tile_row AS tile_row, images.tile_data AS tile_data FROM map JOIN images ON images.tile_id = map.tile_id;", NULL, NULL, &err) != SQLITE_OK) {
+			fprintf(stderr, "%s: create tiles view: %s\n", argv[0], err);
+			if (!forcetable) {
+				exit(EXIT_FAILURE);
+			}
+		}
+	} else {
+		if (sqlite3_exec(outdb, "CREATE TABLE tiles (zoom_level integer, tile_column integer, tile_row integer, tile_data blob);", NULL, NULL, &err) != SQLITE_OK) {
+			fprintf(stderr, "%s: create tiles table: %s\n", argv[0], err);
+			if (!forcetable) {
+				exit(EXIT_FAILURE);
+			}
 		}
 	}
 	if (sqlite3_exec(outdb, "create unique index name on metadata (name);", NULL, NULL, &err) != SQLITE_OK) {
@@ -55,37 +83,388 @@ sqlite3 *mbtiles_open(char *dbname, char **argv, int forcetable) {
 			exit(EXIT_FAILURE);
 		}
 	}
-	if (sqlite3_exec(outdb, "create unique index tile_index on tiles (zoom_level, tile_column, tile_row);", NULL, NULL, &err) != SQLITE_OK) {
-		fprintf(stderr, "%s: index tiles: %s\n", argv[0], err);
-		if (!forcetable) {
-			exit(EXIT_FAILURE);
+	if (deduplicate) {
+		if (sqlite3_exec(outdb, "create unique index map_index on map (zoom_level, tile_column, tile_row);", NULL, NULL, &err) != SQLITE_OK) {
+			fprintf(stderr, "%s: index map: %s\n", argv[0], err);
+			if (!forcetable) {
+				exit(EXIT_FAILURE);
+			}
+		}
+		if (sqlite3_exec(outdb, "create unique index images_id on images (tile_id);", NULL, NULL, &err) != SQLITE_OK) {
+			fprintf(stderr, "%s: index images: %s\n", argv[0], err);
+			if (!forcetable) {
+				exit(EXIT_FAILURE);
+			}
+		}
+	} else {
+		if (sqlite3_exec(outdb, "create unique index tile_index on tiles (zoom_level, tile_column, tile_row);", NULL, NULL, &err) != SQLITE_OK) {
+			fprintf(stderr, "%s: index tiles: %s\n", argv[0], err);
+			if (!forcetable) {
+				exit(EXIT_FAILURE);
+			}
 		}
 	}
 
 	return outdb;
 }
 
-void mbtiles_write_tile(sqlite3 *outdb, int z, int tx, int ty, const char *data, int size) {
+// Finished tiles are handed to a single writer thread, which owns the
+// database (or output directory) while tiling is in progress. It reuses
+// one prepared insert statement and groups inserts into transactions of
+// TIPPECANOE_WRITE_BATCH_SIZE tiles. The queue between the tiling threads
+// and the writer is bounded so that a slow disk eventually makes the
+// tiling threads wait instead of letting finished tiles pile up in memory.
+
+#define WRITE_BATCH_SIZE 1000
+#define WRITE_QUEUE_BYTES (64 * 1024 * 1024)
+
+struct queued_tile {
+	int z;
+	int x;
+	int y;
+	std::string data;
+};
+
+struct tile_writer {
+	sqlite3 *outdb;
+	const char *outdir;
 	sqlite3_stmt *stmt;
-	const char *query = "insert into tiles (zoom_level, tile_column, tile_row, tile_data) values (?, ?, ?, ?)";
-	if (sqlite3_prepare_v2(outdb, query, -1, &stmt, NULL) != SQLITE_OK) {
-		fprintf(stderr, "sqlite3 insert prep failed\n");
+	size_t batch_size;
+
+	// For deduplicated output: the tile_ids of the images written so
+	// far, by hash of their contents
+	bool deduplicate;
+	sqlite3_stmt *image_stmt;
+	sqlite3_stmt *find_stmt;
+	std::unordered_map<unsigned long long, std::vector<std::string>> images;
+	size_t in_batch;
+
+	std::vector<queued_tile> queue;
+	size_t queued_bytes;
+	bool finishing;
+	int discard_above;  // zoom level to discard deeper tiles from, once the queue is written
+
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t nonempty;
+	pthread_cond_t nonfull;
+};
+
+static void writer_exec(sqlite3 *outdb, const char *sql) {
+	char *err = NULL;
+	if (sqlite3_exec(outdb, sql, NULL, NULL, &err) != SQLITE_OK) {
+		fprintf(stderr, "sqlite3 %s failed: %s\n", sql, err);
 		exit(EXIT_FAILURE);
 	}
+}
+
+// 64-bit FNV-1a
+static unsigned long long tile_hash(std::string const &data) {
+	unsigned long long h = 14695981039346656037ULL;
+	for (size_t i = 0; i < data.size(); i++) {
+		h ^= (unsigned char) data[i];
+		h *= 1099511628211ULL;
+	}
+	return h;
+}
+
+static bool image_matches(tile_writer *tw, std::string const &id, std::string const &data) {
+	bool same = false;
+
+	sqlite3_bind_text(tw->find_stmt, 1, id.c_str(), -1, SQLITE_STATIC);
+	if (sqlite3_step(tw->find_stmt) == SQLITE_ROW) {
+		const char *blob = (const char *) sqlite3_column_blob(tw->find_stmt, 0);
+		size_t len = sqlite3_column_bytes(tw->find_stmt, 0);
+		same = len == data.size() && (len == 0 || memcmp(blob, data.data(), len) == 0);
+	}
+	sqlite3_reset(tw->find_stmt);
+	sqlite3_clear_bindings(tw->find_stmt);
+
+	return same;
+}
+
+// Returns the tile_id of the image with these contents, adding it to
+// the images table if it is new. Tiles whose hashes collide are told
+// apart by comparing them with what was already written.
+static std::string find_image(tile_writer *tw, std::string const &data) {
+	unsigned long long h = tile_hash(data);
+	std::vector<std::string> &ids = tw->images[h];
+
+	for (size_t i = 0; i < ids.size(); i++) {
+		if (image_matches(tw, ids[i], data)) {
+			return ids[i];
+		}
+	}
+
+	char buf[40];
+	if (ids.size() == 0) {
+		sprintf(buf, "%016llx", h);
+	} else {
+		sprintf(buf, "%016llx-%zu", h, ids.size());
+	}
+	std::string id(buf);
+
+	sqlite3_bind_blob(tw->image_stmt, 1, data.data(), data.size(), SQLITE_STATIC);
+	sqlite3_bind_text(tw->image_stmt, 2, id.c_str(), -1, SQLITE_STATIC);
+	if (sqlite3_step(tw->image_stmt) != SQLITE_DONE) {
+		fprintf(stderr, "sqlite3 insert failed: %s\n", sqlite3_errmsg(tw->outdb));
+	}
+	sqlite3_reset(tw->image_stmt);
+	sqlite3_clear_bindings(tw->image_stmt);
+
+	ids.push_back(id);
+	return id;
+}
+
+static void writer_insert(tile_writer *tw, queued_tile const &t) {
+	if (tw->outdb != NULL) {
+		if (tw->in_batch == 0) {
+			writer_exec(tw->outdb, "BEGIN");
+		}
+
+		std::string id;
+		sqlite3_bind_int(tw->stmt, 1, t.z);
+		sqlite3_bind_int(tw->stmt, 2, t.x);
+		sqlite3_bind_int(tw->stmt, 3, (1 << t.z) - 1 - t.y);
+		if (tw->deduplicate) {
+			id = find_image(tw, t.data);
+			sqlite3_bind_text(tw->stmt, 4, id.c_str(), -1, SQLITE_STATIC);
+		} else {
+			sqlite3_bind_blob(tw->stmt, 4, t.data.data(), t.data.size(), SQLITE_STATIC);
+		}
 
-	sqlite3_bind_int(stmt, 1, z);
-	sqlite3_bind_int(stmt, 2, tx);
-	sqlite3_bind_int(stmt, 3, (1 << z) - 1 - ty);
-	sqlite3_bind_blob(stmt, 4, data, size, NULL);
+		if (sqlite3_step(tw->stmt) != SQLITE_DONE) {
+			fprintf(stderr, "sqlite3 insert failed: %s\n", sqlite3_errmsg(tw->outdb));
+		}
+		sqlite3_reset(tw->stmt);
+		sqlite3_clear_bindings(tw->stmt);
 
-	if (sqlite3_step(stmt) != SQLITE_DONE) {
-		fprintf(stderr, "sqlite3 insert failed: %s\n", sqlite3_errmsg(outdb));
+		tw->in_batch++;
+		if (tw->in_batch >= tw->batch_size) {
+			writer_exec(tw->outdb, "COMMIT");
+			tw->in_batch = 0;
+		}
+	} else if (tw->outdir != NULL) {
+		dir_write_tile(tw->outdir, t.z, t.x, t.y, t.data);
 	}
-	if (sqlite3_finalize(stmt) != SQLITE_OK) {
-		fprintf(stderr, "sqlite3 finalize failed: %s\n", sqlite3_errmsg(outdb));
+}
+
+static void writer_discard(tile_writer *tw, int z) {
+	if (tw->outdb != NULL) {
+		if (tw->in_batch > 0) {
+			writer_exec(tw->outdb, "COMMIT");
+			tw->in_batch = 0;
+		}
+
+		char *sql;
+		if (tw->deduplicate) {
+			sql = sqlite3_mprintf("DELETE FROM map WHERE zoom_level > %d; DELETE FROM images WHERE tile_id NOT IN (SELECT tile_id FROM map);", z);
+		} else {
+			sql = sqlite3_mprintf("DELETE FROM tiles WHERE zoom_level > %d;", z);
+		}
+		writer_exec(tw->outdb, sql);
+		sqlite3_free(sql);
+	} else if (tw->outdir != NULL) {
+		dir_remove_zooms_above(tw->outdir, z);
 	}
 }
 
+static void *run_writer(void *v) {
+	tile_writer *tw = (tile_writer *) v;
+	std::vector<queued_tile> batch;
+
+	while (true) {
+		if (pthread_mutex_lock(&tw->lock) != 0) {
+			perror("pthread_mutex_lock");
+			exit(EXIT_FAILURE);
+		}
+		while (tw->queue.size() == 0 && !tw->finishing && tw->discard_above == INT_MAX) {
+			if (pthread_cond_wait(&tw->nonempty, &tw->lock) != 0) {
+				perror("pthread_cond_wait");
+				exit(EXIT_FAILURE);
+			}
+		}
+		if (tw->queue.size() == 0 && tw->discard_above == INT_MAX) {
+			if (pthread_mutex_unlock(&tw->lock) != 0) {
+				perror("pthread_mutex_unlock");
+				exit(EXIT_FAILURE);
+			}
+			break;
+		}
+
+		// Take everything that is waiting, so the tiling threads only
+		// contend for the lock once per batch rather than once per tile.
+		batch.swap(tw->queue);
+		tw->queued_bytes = 0;
+		int discard = tw->discard_above;
+		tw->discard_above = INT_MAX;
+		if (pthread_cond_broadcast(&tw->nonfull) != 0) {
+			perror("pthread_cond_broadcast");
+			exit(EXIT_FAILURE);
+		}
+		if (pthread_mutex_unlock(&tw->lock) != 0) {
+			perror("pthread_mutex_unlock");
+			exit(EXIT_FAILURE);
+		}
+
+		for (size_t i = 0; i < batch.size(); i++) {
+			writer_insert(tw, batch[i]);
+		}
+		batch.clear();
+
+		if (discard != INT_MAX) {
+			writer_discard(tw, discard);
+		}
+	}
+
+	return NULL;
+}
+
+tile_writer *tile_writer_start(sqlite3 *outdb, const char *outdir, bool deduplicate) {
+	tile_writer *tw = new tile_writer;
+	tw->outdb = outdb;
+	tw->outdir = outdir;
+	tw->stmt = NULL;
+	tw->deduplicate = deduplicate;
+	tw->image_stmt = NULL;
+	tw->find_stmt = NULL;
+	tw->batch_size = WRITE_BATCH_SIZE;
+	tw->in_batch = 0;
+	tw->queued_bytes = 0;
+	tw->finishing = false;
+	tw->discard_above = INT_MAX;
+
+	const char *s = getenv("TIPPECANOE_WRITE_BATCH_SIZE");
+	if (s != NULL && atoll(s) > 0) {
+		tw->batch_size = atoll(s);
+	}
+
+	if (outdb != NULL) {
+		const char *query = "insert into tiles (zoom_level, tile_column, tile_row, tile_data) values (?, ?, ?, ?)";
+		if (deduplicate) {
+			query = "insert into map (zoom_level, tile_column, tile_row, tile_id) values (?, ?, ?, ?)";
+		}
+		if (sqlite3_prepare_v2(outdb, query, -1, &tw->stmt, NULL) != SQLITE_OK) {
+			fprintf(stderr, "sqlite3 insert prep failed\n");
+			exit(EXIT_FAILURE);
+		}
+
+		if (deduplicate) {
+			if (sqlite3_prepare_v2(outdb, "insert into images (tile_data, tile_id) values (?, ?)", -1, &tw->image_stmt, NULL) != SQLITE_OK) {
+				fprintf(stderr, "sqlite3 insert prep failed\n");
+				exit(EXIT_FAILURE);
+			}
+			if (sqlite3_prepare_v2(outdb, "select tile_data from images where tile_id = ?", -1, &tw->find_stmt, NULL) != SQLITE_OK) {
+				fprintf(stderr, "sqlite3 select prep failed\n");
+				exit(EXIT_FAILURE);
+			}
+		}
+	}
+
+	if (pthread_mutex_init(&tw->lock, NULL) != 0) {
+		perror("pthread_mutex_init");
+		exit(EXIT_FAILURE);
+	}
+	if (pthread_cond_init(&tw->nonempty, NULL) != 0 || pthread_cond_init(&tw->nonfull, NULL) != 0) {
+		perror("pthread_cond_init");
+		exit(EXIT_FAILURE);
+	}
+	if (pthread_create(&tw->thread, NULL, run_writer, tw) != 0) {
+		perror("pthread_create");
+		exit(EXIT_FAILURE);
+	}
+
+	return tw;
+}
+
+void tile_writer_put(tile_writer *tw, int z, int tx, int ty, std::string &data) {
+	if (pthread_mutex_lock(&tw->lock) != 0) {
+		perror("pthread_mutex_lock");
+		exit(EXIT_FAILURE);
+	}
+
+	// A tile is always accepted into an empty queue, however large it is
+	while (tw->queue.size() > 0 && tw->queued_bytes + data.size() > WRITE_QUEUE_BYTES) {
+		if (pthread_cond_wait(&tw->nonfull, &tw->lock) != 0) {
+			perror("pthread_cond_wait");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	queued_tile t;
+	t.z = z;
+	t.x = tx;
+	t.y = ty;
+	t.data.swap(data);
+	tw->queued_bytes += t.data.size();
+	tw->queue.push_back(std::move(t));
+
+	if (pthread_cond_signal(&tw->nonempty) != 0) {
+		perror("pthread_cond_signal");
+		exit(EXIT_FAILURE);
+	}
+	if (pthread_mutex_unlock(&tw->lock) != 0) {
+		perror("pthread_mutex_unlock");
+		exit(EXIT_FAILURE);
+	}
+}
+
+// Remove the tiles deeper than zoom level z, once everything put before
+// this has been written
+void tile_writer_discard_above(tile_writer *tw, int z) {
+	if (pthread_mutex_lock(&tw->lock) != 0) {
+		perror("pthread_mutex_lock");
+		exit(EXIT_FAILURE);
+	}
+	if (z < tw->discard_above) {
+		tw->discard_above = z;
+	}
+	if (pthread_cond_signal(&tw->nonempty) != 0) {
+		perror("pthread_cond_signal");
+		exit(EXIT_FAILURE);
+	}
+	if (pthread_mutex_unlock(&tw->lock) != 0) {
+		perror("pthread_mutex_unlock");
+		exit(EXIT_FAILURE);
+	}
+}
+
+void tile_writer_finish(tile_writer *tw) {
+	if (pthread_mutex_lock(&tw->lock) != 0) {
+		perror("pthread_mutex_lock");
+		exit(EXIT_FAILURE);
+	}
+	tw->finishing = true;
+	if (pthread_cond_signal(&tw->nonempty) != 0) {
+		perror("pthread_cond_signal");
+		exit(EXIT_FAILURE);
+	}
+	if (pthread_mutex_unlock(&tw->lock) != 0) {
+		perror("pthread_mutex_unlock");
+		exit(EXIT_FAILURE);
+	}
+
+	void *retval;
+	if (pthread_join(tw->thread, &retval) != 0) {
+		perror("pthread_join");
+		exit(EXIT_FAILURE);
+	}
+
+	if (tw->outdb != NULL) {
+		if (tw->in_batch > 0) {
+			writer_exec(tw->outdb, "COMMIT");
+		}
+		if (sqlite3_finalize(tw->stmt) != SQLITE_OK || sqlite3_finalize(tw->image_stmt) != SQLITE_OK || sqlite3_finalize(tw->find_stmt) != SQLITE_OK) {
+			fprintf(stderr, "sqlite3 finalize failed: %s\n", sqlite3_errmsg(tw->outdb));
+		}
+	}
+
+	pthread_mutex_destroy(&tw->lock);
+	pthread_cond_destroy(&tw->nonempty);
+	pthread_cond_destroy(&tw->nonfull);
+	delete tw;
+}
+
 static void quote(std::string &buf, std::string const &s) {
 	for (size_t i = 0; i < s.size(); i++) {
 		unsigned char ch = s[i];
@@ -35,9 +35,14 @@ struct layermap_entry {
 	}
 };
 
-sqlite3 *mbtiles_open(char *dbname, char **argv, int forcetable);
+sqlite3 *mbtiles_open(char *dbname, char **argv, int forcetable, bool deduplicate);
 
-void mbtiles_write_tile(sqlite3 *outdb, int z, int tx, int ty, const char *data, int size);
+struct tile_writer;
+
+tile_writer *tile_writer_start(sqlite3 *outdb, const char *outdir, bool deduplicate);
+void tile_writer_put(tile_writer *tw, int z, int tx, int ty, std::string &data);
+void tile_writer_discard_above(tile_writer *tw, int z);
+void tile_writer_finish(tile_writer *tw);
 
 void mbtiles_write_metadata(sqlite3 *outdb, const char *outdir, const char *fname, int minzoom, int maxzoom, double minlat, double minlon, double maxlat, double maxlon, double midlat, double midlon, int forcetable, const char *attribution, std::map<std::string, layermap_entry> const &layermap, bool vector, const char *description, bool do_tilestats);
 
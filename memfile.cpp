@@ -7,33 +7,63 @@
 #define INCREMENT 131072
 #define INITIAL 256
 
-struct memfile *memfile_open(int fd) {
-	if (ftruncate(fd, INITIAL) != 0) {
-		return NULL;
+// How much address space to map for each file up front, so that the file
+// can grow underneath the mapping without having to be remapped. Mapping
+// past the end of the file is allowed as long as nothing touches it.
+#define RESERVE (1LL << 36)
+
+static char *memfile_map(struct memfile *file, long long want) {
+	// Address space may be limited, so settle for less than the
+	// full reservation if necessary
+	for (long long reserve = RESERVE; reserve >= want; reserve /= 2) {
+		char *map = (char *) mmap(NULL, reserve, PROT_READ | PROT_WRITE, MAP_SHARED, file->fd, 0);
+		if (map != MAP_FAILED) {
+			file->reserved = reserve;
+
+#ifdef MADV_HUGEPAGE
+			if (file->hugepages) {
+				madvise(map, reserve, MADV_HUGEPAGE);  // only a hint, so failure doesn't matter
+			}
+#endif
+
+			return map;
+		}
+	}
+
+	// Bigger than the reservation: map exactly what is needed
+	char *map = (char *) mmap(NULL, want, PROT_READ | PROT_WRITE, MAP_SHARED, file->fd, 0);
+	if (map != MAP_FAILED) {
+		file->reserved = want;
 	}
+	return map;
+}
 
-	char *map = (char *) mmap(NULL, INITIAL, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
-	if (map == MAP_FAILED) {
+struct memfile *memfile_open(int fd, bool hugepages) {
+	if (ftruncate(fd, INITIAL) != 0) {
 		return NULL;
 	}
 
 	struct memfile *mf = new memfile;
 	if (mf == NULL) {
-		munmap(map, INITIAL);
 		return NULL;
 	}
 
 	mf->fd = fd;
-	mf->map = map;
+	mf->hugepages = hugepages;
 	mf->len = INITIAL;
 	mf->off = 0;
-	mf->tree = 0;
+
+	mf->map = memfile_map(mf, INITIAL);
+	if (mf->map == MAP_FAILED) {
+		delete mf;
+		return NULL;
+	}
 
 	return mf;
 }
 
 int memfile_close(struct memfile *file) {
-	if (munmap(file->map, file->len) != 0) {
+	if (munmap(file->map, file->reserved) != 0) {
 		return -1;
 	}
 
@@ -49,20 +79,30 @@ int memfile_close(struct memfile *file) {
 
 int memfile_write(struct memfile *file, void *s, long long len) {
 	if (file->off + len > file->len) {
-		if (munmap(file->map, file->len) != 0) {
-			return -1;
+		// Grow geometrically so that the number of times the file is
+		// extended is logarithmic in its final size
+		long long newlen = file->len * 2;
+		if (newlen < file->off + len) {
+			newlen = file->off + len;
 		}
+		newlen = (newlen + INCREMENT - 1) / INCREMENT * INCREMENT;
 
-		file->len += (len + INCREMENT + 1) / INCREMENT * INCREMENT;
-
-		if (ftruncate(file->fd, file->len) != 0) {
+		if (ftruncate(file->fd, newlen) != 0) {
 			return -1;
 		}
 
-		file->map = (char *) mmap(NULL, file->len, PROT_READ | PROT_WRITE, MAP_SHARED, file->fd, 0);
-		if (file->map == MAP_FAILED) {
-			return -1;
+		if (newlen > file->reserved) {
+			if (munmap(file->map, file->reserved) != 0) {
+				return -1;
+			}
+
+			file->map = memfile_map(file, newlen);
+			if (file->map == MAP_FAILED) {
+				return -1;
+			}
 		}
+
+		file->len = newlen;
 	}
 
 	memcpy(file->map + file->off, s, len);
@@ -4,12 +4,13 @@
 struct memfile {
 	int fd;
 	char *map;
-	long long len;
-	long long off;
-	unsigned long tree;
+	long long len;	     // size of the file
+	long long off;	     // how much of it has been written
+	long long reserved;  // size of the mapping, which may extend past the end of the file
+	bool hugepages;
 };
 
-struct memfile *memfile_open(int fd);
+struct memfile *memfile_open(int fd, bool hugepages);
 int memfile_close(struct memfile *file);
 int memfile_write(struct memfile *file, void *s, long long len);
 
@@ -1,12 +1,16 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
 #include <string>
 #include <vector>
 #include <map>
 #include <zlib.h>
 #include <errno.h>
 #include <limits.h>
+#include <cmath>
 #include "mvt.hpp"
+#include "threadpool.hpp"
 #include "geometry.hpp"
 #include "protozero/varint.hpp"
 #include "protozero/pbf_reader.hpp"
@@ -83,17 +87,361 @@ int compress(std::string const &input, std::string &output) {
 	return 0;
 }
 
-bool mvt_tile::decode(std::string &message, bool &was_compressed) {
+// Blocks of the tile that compress_blocks() deflates independently of each other
+#define COMPRESS_BLOCK (128 * 1024)
+
+struct compress_block_arg {
+	std::string const *input;
+	size_t start;  // where this block begins within the input
+	size_t end;    // and ends
+	std::string output;
+	unsigned long crc;
+};
+
+static void *run_compress_block(void *v) {
+	compress_block_arg *a = (compress_block_arg *) v;
+
+	z_stream deflate_s;
+	deflate_s.zalloc = Z_NULL;
+	deflate_s.zfree = Z_NULL;
+	deflate_s.opaque = Z_NULL;
+	deflate_s.avail_in = 0;
+	deflate_s.next_in = Z_NULL;
+	if (deflateInit2(&deflate_s, Z_BEST_COMPRESSION, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+		fprintf(stderr, "Deflate error: %s\n", deflate_s.msg);
+		exit(EXIT_FAILURE);
+	}
+
+	// Prime the block with the end of the previous one so that it compresses
+	// as if it were continuing from it
+	if (a->start > 0) {
+		size_t window = 32768;
+		if (window > a->start) {
+			window = a->start;
+		}
+		if (deflateSetDictionary(&deflate_s, (const Bytef *) a->input->data() + a->start - window, window) != Z_OK) {
+			fprintf(stderr, "Deflate error: %s\n", deflate_s.msg);
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	// Every block but the last ends with a sync flush, which ends it on a
+	// byte boundary without ending the deflate stream, so the next block can
+	// simply be appended.
+	int flush = Z_SYNC_FLUSH;
+	if (a->end == a->input->size()) {
+		flush = Z_FINISH;
+	}
+
+	deflate_s.next_in = (Bytef *) a->input->data() + a->start;
+	deflate_s.avail_in = a->end - a->start;
+	size_t length = 0;
+	do {
+		size_t increase = (a->end - a->start) / 2 + 1024;
+		a->output.resize(length + increase);
+		deflate_s.avail_out = increase;
+		deflate_s.next_out = (Bytef *) (a->output.data() + length);
+		int ret = deflate(&deflate_s, flush);
+		if (ret != Z_STREAM_END && ret != Z_OK && ret != Z_BUF_ERROR) {
+			fprintf(stderr, "Deflate error %d\n", ret);
+			exit(EXIT_FAILURE);
+		}
+		length += (increase - deflate_s.avail_out);
+	} while (deflate_s.avail_out == 0);
+	deflateEnd(&deflate_s);
+	a->output.resize(length);
+
+	a->crc = crc32(0, (const Bytef *) a->input->data() + a->start, a->end - a->start);
+	return NULL;
+}
+
+static void put_le32(std::string &output, unsigned long n) {
+	for (size_t i = 0; i < 4; i++) {
+		output.push_back((char) ((n >> (8 * i)) & 0xFF));
+	}
+}
+
+bool compress_blocks(std::string const &input, std::string &output, size_t limit, size_t threads) {
+	if (threads < 1) {
+		threads = 1;
+	}
+
+	// The same header that deflate() writes for gzip at this compression level
+	static const char header[10] = {0x1F, (char) 0x8B, 8, 0, 0, 0, 0, 0, 2, 3};
+	output.assign(header, sizeof(header));
+
+	size_t blocks = (input.size() + COMPRESS_BLOCK - 1) / COMPRESS_BLOCK;
+	if (blocks == 0) {
+		blocks = 1;
+	}
+
+	unsigned long crc = crc32(0, Z_NULL, 0);
+	for (size_t b = 0; b < blocks; b += threads) {
+		size_t n = threads;
+		if (n > blocks - b) {
+			n = blocks - b;
+		}
+
+		std::vector<compress_block_arg> args(n);
+		std::vector<struct pool_task *> workers(n);
+		for (size_t i = 0; i < n; i++) {
+			args[i].input = &input;
+			args[i].start = (b + i) * COMPRESS_BLOCK;
+			args[i].end = (b + i + 1) * COMPRESS_BLOCK;
+			if (args[i].end > input.size()) {
+				args[i].end = input.size();
+			}
+
+			if (n > 1) {
+				workers[i] = task_start(run_compress_block, &args[i]);
+			} else {
+				run_compress_block(&args[i]);
+			}
+		}
+
+		for (size_t i = 0; i < n; i++) {
+			if (n > 1) {
+				task_join(workers[i]);
+			}
+
+			output.append(args[i].output);
+			crc = crc32_combine(crc, args[i].crc, args[i].end - args[i].start);
+		}
+
+		if (output.size() > limit) {
+			return false;
+		}
+	}
+
+	put_le32(output, crc);
+	put_le32(output, input.size());
+	return output.size() <= limit;
+}
+
+static void decode_value(protozero::data_view message, mvt_value &value) {
+	protozero::pbf_reader value_reader(message);
+
+	while (value_reader.next()) {
+		switch (value_reader.tag()) {
+		case 1: /* string */
+			value.type = mvt_string;
+			value.string_value = value_reader.get_string();
+			break;
+
+		case 2: /* float */
+			value.type = mvt_float;
+			value.numeric_value.float_value = value_reader.get_float();
+			break;
+
+		case 3: /* double */
+			value.type = mvt_double;
+			value.numeric_value.double_value = value_reader.get_double();
+			break;
+
+		case 4: /* int */
+			value.type = mvt_int;
+			value.numeric_value.int_value = value_reader.get_int64();
+			break;
+
+		case 5: /* uint */
+			value.type = mvt_uint;
+			value.numeric_value.uint_value = value_reader.get_uint64();
+			break;
+
+		case 6: /* sint */
+			value.type = mvt_sint;
+			value.numeric_value.sint_value = value_reader.get_sint64();
+			break;
+
+		case 7: /* bool */
+			value.type = mvt_bool;
+			value.numeric_value.bool_value = value_reader.get_bool();
+			break;
+
+		default:
+			value_reader.skip();
+			break;
+		}
+	}
+}
+
+bool mvt_feature_view::decode(protozero::data_view message) {
+	type = 0;
+	id = 0;
+	has_id = false;
+	tags = protozero::data_view();
+	geometry = protozero::data_view();
+
+	protozero::pbf_reader feature_reader(message);
+
+	while (feature_reader.next()) {
+		switch (feature_reader.tag()) {
+		case 1: /* id */
+			id = feature_reader.get_uint64();
+			has_id = true;
+			break;
+
+		case 2: /* tag */
+			tags = feature_reader.get_view();
+			break;
+
+		case 3: /* feature type */
+			type = feature_reader.get_enum();
+			break;
+
+		case 4: /* geometry */
+			geometry = feature_reader.get_view();
+			break;
+
+		default:
+			feature_reader.skip();
+			break;
+		}
+	}
+
+	return true;
+}
+
+void mvt_feature_view::decode_tags(std::vector<unsigned> &out) const {
+	out.clear();
+
+	const char *data = tags.data();
+	const char *end = data + tags.size();
+	while (data < end) {
+		out.push_back(protozero::decode_varint(&data, end));
+	}
+}
+
+void mvt_feature_view::decode_geometry(std::vector<mvt_geometry> &out) const {
+	out.clear();
+
+	std::vector<uint32_t> geoms;
+	const char *data = geometry.data();
+	const char *end = data + geometry.size();
+	while (data < end) {
+		geoms.push_back(protozero::decode_varint(&data, end));
+	}
+
+	long long px = 0, py = 0;
+	for (size_t g = 0; g < geoms.size(); g++) {
+		uint32_t geom = geoms[g];
+		uint32_t op = geom & 7;
+		uint32_t count = geom >> 3;
+
+		if (op == mvt_moveto || op == mvt_lineto) {
+			for (size_t k = 0; k < count && g + 2 < geoms.size(); k++) {
+				px += protozero::decode_zigzag32(geoms[g + 1]);
+				py += protozero::decode_zigzag32(geoms[g + 2]);
+				g += 2;
+
+				out.push_back(mvt_geometry(op, px, py));
+			}
+		} else {
+			out.push_back(mvt_geometry(op, 0, 0));
+		}
+	}
+}
+
+bool mvt_layer_view::decode(protozero::data_view message) {
+	version = 1;
+	extent = 4096;
+	data = message;
+
+	protozero::pbf_reader layer_reader(message);
+
+	while (layer_reader.next()) {
+		switch (layer_reader.tag()) {
+		case 1: /* name */
+			name = layer_reader.get_string();
+			break;
+
+		case 3: /* key */
+			keys.push_back(layer_reader.get_view());
+			break;
+
+		case 4: /* value */
+			values.push_back(layer_reader.get_view());
+			break;
+
+		case 5: /* extent */
+			extent = layer_reader.get_uint32();
+			break;
+
+		case 15: /* version */
+			version = layer_reader.get_uint32();
+			break;
+
+		case 2: /* feature */
+			features.push_back(layer_reader.get_view());
+			break;
+
+		default:
+			layer_reader.skip();
+			break;
+		}
+	}
+
+	return true;
+}
+
+mvt_value const &mvt_layer_view::value(size_t i) {
+	if (decoded_values.size() != values.size()) {
+		decoded_values.resize(values.size());
+		have_value.resize(values.size(), false);
+	}
+
+	if (!have_value[i]) {
+		decode_value(values[i], decoded_values[i]);
+		have_value[i] = true;
+	}
+
+	return decoded_values[i];
+}
+
+void mvt_layer_view::to_layer(mvt_layer &layer) {
+	layer.name = name;
+	layer.version = version;
+	layer.extent = extent;
+
+	for (size_t i = 0; i < keys.size(); i++) {
+		layer.keys.push_back(std::string(keys[i]));
+	}
+	for (size_t i = 0; i < values.size(); i++) {
+		layer.values.push_back(value(i));
+	}
+
+	for (size_t i = 0; i < features.size(); i++) {
+		mvt_feature_view fv;
+		fv.decode(features[i]);
+
+		mvt_feature feature;
+		feature.type = fv.type;
+		feature.id = fv.id;
+		feature.has_id = fv.has_id;
+		fv.decode_tags(feature.tags);
+		fv.decode_geometry(feature.geometry);
+		layer.features.push_back(feature);
+	}
+
+	for (size_t i = 0; i < layer.keys.size(); i++) {
+		layer.key_map.insert(std::pair<std::string, size_t>(layer.keys[i], i));
+	}
+	for (size_t i = 0; i < layer.values.size(); i++) {
+		layer.value_map.insert(std::pair<mvt_value, size_t>(layer.values[i], i));
+	}
+}
+
+bool mvt_tile_view::decode(std::string const &message, bool &was_compressed) {
 	layers.clear();
-	std::string src;
+	uncompressed.clear();
 
+	protozero::data_view src;
 	if (is_compressed(message)) {
-		std::string uncompressed;
 		decompress(message, uncompressed);
-		src = uncompressed;
+		src = protozero::data_view(uncompressed.data(), uncompressed.size());
 		was_compressed = true;
 	} else {
-		src = message;
+		src = protozero::data_view(message.data(), message.size());
 		was_compressed = false;
 	}
 
@@ -102,278 +450,323 @@ bool mvt_tile::decode(std::string &message, bool &was_compressed) {
 	while (reader.next()) {
 		switch (reader.tag()) {
 		case 3: /* layer */
-		{
-			protozero::pbf_reader layer_reader(reader.get_message());
-			mvt_layer layer;
-
-			while (layer_reader.next()) {
-				switch (layer_reader.tag()) {
-				case 1: /* name */
-					layer.name = layer_reader.get_string();
-					break;
+			layers.push_back(mvt_layer_view());
+			layers.back().decode(reader.get_view());
+			break;
 
-				case 3: /* key */
-					layer.keys.push_back(layer_reader.get_string());
-					break;
+		default:
+			reader.skip();
+			break;
+		}
+	}
 
-				case 4: /* value */
-				{
-					protozero::pbf_reader value_reader(layer_reader.get_message());
-					mvt_value value;
-
-					while (value_reader.next()) {
-						switch (value_reader.tag()) {
-						case 1: /* string */
-							value.type = mvt_string;
-							value.string_value = value_reader.get_string();
-							break;
-
-						case 2: /* float */
-							value.type = mvt_float;
-							value.numeric_value.float_value = value_reader.get_float();
-							break;
-
-						case 3: /* double */
-							value.type = mvt_double;
-							value.numeric_value.double_value = value_reader.get_double();
-							break;
-
-						case 4: /* int */
-							value.type = mvt_int;
-							value.numeric_value.int_value = value_reader.get_int64();
-							break;
-
-						case 5: /* uint */
-							value.type = mvt_uint;
-							value.numeric_value.uint_value = value_reader.get_uint64();
-							break;
-
-						case 6: /* sint */
-							value.type = mvt_sint;
-							value.numeric_value.sint_value = value_reader.get_sint64();
-							break;
-
-						case 7: /* bool */
-							value.type = mvt_bool;
-							value.numeric_value.bool_value = value_reader.get_bool();
-							break;
-
-						default:
-							value_reader.skip();
-							break;
-						}
-					}
-
-					layer.values.push_back(value);
-					break;
-				}
+	return true;
+}
 
-				case 5: /* extent */
-					layer.extent = layer_reader.get_uint32();
-					break;
+bool mvt_tile::decode(std::string &message, bool &was_compressed) {
+	layers.clear();
 
-				case 15: /* version */
-					layer.version = layer_reader.get_uint32();
-					break;
+	mvt_tile_view view;
+	if (!view.decode(message, was_compressed)) {
+		return false;
+	}
 
-				case 2: /* feature */
-				{
-					protozero::pbf_reader feature_reader(layer_reader.get_message());
-					mvt_feature feature;
-					std::vector<uint32_t> geoms;
-
-					while (feature_reader.next()) {
-						switch (feature_reader.tag()) {
-						case 1: /* id */
-							feature.id = feature_reader.get_uint64();
-							feature.has_id = true;
-							break;
-
-						case 2: /* tag */
-						{
-							auto pi = feature_reader.get_packed_uint32();
-							for (auto it = pi.first; it != pi.second; ++it) {
-								feature.tags.push_back(*it);
-							}
-							break;
-						}
-
-						case 3: /* feature type */
-							feature.type = feature_reader.get_enum();
-							break;
-
-						case 4: /* geometry */
-						{
-							auto pi = feature_reader.get_packed_uint32();
-							for (auto it = pi.first; it != pi.second; ++it) {
-								geoms.push_back(*it);
-							}
-							break;
-						}
-
-						default:
-							feature_reader.skip();
-							break;
-						}
-					}
-
-					long long px = 0, py = 0;
-					for (size_t g = 0; g < geoms.size(); g++) {
-						uint32_t geom = geoms[g];
-						uint32_t op = geom & 7;
-						uint32_t count = geom >> 3;
-
-						if (op == mvt_moveto || op == mvt_lineto) {
-							for (size_t k = 0; k < count && g + 2 < geoms.size(); k++) {
-								px += protozero::decode_zigzag32(geoms[g + 1]);
-								py += protozero::decode_zigzag32(geoms[g + 2]);
-								g += 2;
-
-								feature.geometry.push_back(mvt_geometry(op, px, py));
-							}
-						} else {
-							feature.geometry.push_back(mvt_geometry(op, 0, 0));
-						}
-					}
-
-					layer.features.push_back(feature);
-					break;
-				}
+	for (size_t i = 0; i < view.layers.size(); i++) {
+		layers.push_back(mvt_layer());
+		view.layers[i].to_layer(layers.back());
+	}
 
-				default:
-					layer_reader.skip();
-					break;
+	return true;
+}
+
+// Encode one layer, giving up if the encoded layer gets to be more than limit bytes
+static bool encode_layer(mvt_layer &layer, std::string &layer_string, size_t limit) {
+	if (layer.raw.size() > 0) {
+		layer_string = layer.raw;
+		return layer_string.size() <= limit;
+	}
+
+	protozero::pbf_writer layer_writer(layer_string);
+
+	layer_writer.add_uint32(15, layer.version); /* version */
+	layer_writer.add_string(1, layer.name);     /* name */
+	layer_writer.add_uint32(5, layer.extent);   /* extent */
+
+	for (size_t j = 0; j < layer.keys.size(); j++) {
+		layer_writer.add_string(3, layer.keys[j]); /* key */
+	}
+
+	for (size_t v = 0; v < layer.values.size(); v++) {
+		std::string value_string;
+		protozero::pbf_writer value_writer(value_string);
+		mvt_value &pbv = layer.values[v];
+
+		if (pbv.type == mvt_string) {
+			value_writer.add_string(1, pbv.string_value);
+		} else if (pbv.type == mvt_float) {
+			value_writer.add_float(2, pbv.numeric_value.float_value);
+		} else if (pbv.type == mvt_double) {
+			value_writer.add_double(3, pbv.numeric_value.double_value);
+		} else if (pbv.type == mvt_int) {
+			value_writer.add_int64(4, pbv.numeric_value.int_value);
+		} else if (pbv.type == mvt_uint) {
+			value_writer.add_uint64(5, pbv.numeric_value.uint_value);
+		} else if (pbv.type == mvt_sint) {
+			value_writer.add_sint64(6, pbv.numeric_value.sint_value);
+		} else if (pbv.type == mvt_bool) {
+			value_writer.add_bool(7, pbv.numeric_value.bool_value);
+		}
+
+		layer_writer.add_message(4, value_string);
+	}
+
+	for (size_t f = 0; f < layer.features.size(); f++) {
+		std::string feature_string;
+		protozero::pbf_writer feature_writer(feature_string);
+
+		feature_writer.add_enum(3, layer.features[f].type);
+		feature_writer.add_packed_uint32(2, std::begin(layer.features[f].tags), std::end(layer.features[f].tags));
+
+		if (layer.features[f].has_id) {
+			feature_writer.add_uint64(1, layer.features[f].id);
+		}
+
+		std::vector<uint32_t> geometry;
+
+		int px = 0, py = 0;
+		int cmd_idx = -1;
+		int cmd = -1;
+		int length = 0;
+
+		std::vector<mvt_geometry> &geom = layer.features[f].geometry;
+
+		for (size_t g = 0; g < geom.size(); g++) {
+			int op = geom[g].op;
+
+			if (op != cmd) {
+				if (cmd_idx >= 0) {
+					geometry[cmd_idx] = (length << 3) | (cmd & ((1 << 3) - 1));
 				}
-			}
 
-			for (size_t i = 0; i < layer.keys.size(); i++) {
-				layer.key_map.insert(std::pair<std::string, size_t>(layer.keys[i], i));
+				cmd = op;
+				length = 0;
+				cmd_idx = geometry.size();
+				geometry.push_back(0);
 			}
-			for (size_t i = 0; i < layer.values.size(); i++) {
-				layer.value_map.insert(std::pair<mvt_value, size_t>(layer.values[i], i));
+
+			if (op == mvt_moveto || op == mvt_lineto) {
+				long long wwx = geom[g].x;
+				long long wwy = geom[g].y;
+
+				int dx = wwx - px;
+				int dy = wwy - py;
+
+				geometry.push_back(protozero::encode_zigzag32(dx));
+				geometry.push_back(protozero::encode_zigzag32(dy));
+
+				px = wwx;
+				py = wwy;
+				length++;
+			} else if (op == mvt_closepath) {
+				length++;
+			} else {
+				fprintf(stderr, "\nInternal error: corrupted geometry\n");
+				exit(EXIT_FAILURE);
 			}
+		}
 
-			layers.push_back(layer);
-			break;
+		if (cmd_idx >= 0) {
+			geometry[cmd_idx] = (length << 3) | (cmd & ((1 << 3) - 1));
 		}
 
-		default:
-			reader.skip();
-			break;
+		feature_writer.add_packed_uint32(4, std::begin(geometry), std::end(geometry));
+		layer_writer.add_message(2, feature_string);
+
+		if (layer_string.size() > limit) {
+			return false;
 		}
 	}
 
 	return true;
 }
 
-std::string mvt_tile::encode() {
-	std::string data;
+struct encode_layers_arg {
+	std::vector<mvt_layer> *layers;
+	std::vector<std::string> *layer_strings;
+	size_t last;
+	size_t limit;
+	volatile size_t *next;
+	volatile bool *fits;
+};
+
+static void *run_encode_layers(void *v) {
+	encode_layers_arg *a = (encode_layers_arg *) v;
+
+	while (*a->fits) {
+		size_t i = __sync_fetch_and_add(a->next, 1);
+		if (i >= a->last) {
+			break;
+		}
 
-	protozero::pbf_writer writer(data);
+		if (!encode_layer((*a->layers)[i], (*a->layer_strings)[i], a->limit)) {
+			*a->fits = false;
+		}
+	}
 
-	for (size_t i = 0; i < layers.size(); i++) {
-		std::string layer_string;
-		protozero::pbf_writer layer_writer(layer_string);
-
-		layer_writer.add_uint32(15, layers[i].version); /* version */
-		layer_writer.add_string(1, layers[i].name);     /* name */
-		layer_writer.add_uint32(5, layers[i].extent);   /* extent */
-
-		for (size_t j = 0; j < layers[i].keys.size(); j++) {
-			layer_writer.add_string(3, layers[i].keys[j]); /* key */
-		}
-
-		for (size_t v = 0; v < layers[i].values.size(); v++) {
-			std::string value_string;
-			protozero::pbf_writer value_writer(value_string);
-			mvt_value &pbv = layers[i].values[v];
-
-			if (pbv.type == mvt_string) {
-				value_writer.add_string(1, pbv.string_value);
-			} else if (pbv.type == mvt_float) {
-				value_writer.add_float(2, pbv.numeric_value.float_value);
-			} else if (pbv.type == mvt_double) {
-				value_writer.add_double(3, pbv.numeric_value.double_value);
-			} else if (pbv.type == mvt_int) {
-				value_writer.add_int64(4, pbv.numeric_value.int_value);
-			} else if (pbv.type == mvt_uint) {
-				value_writer.add_uint64(5, pbv.numeric_value.uint_value);
-			} else if (pbv.type == mvt_sint) {
-				value_writer.add_sint64(6, pbv.numeric_value.sint_value);
-			} else if (pbv.type == mvt_bool) {
-				value_writer.add_bool(7, pbv.numeric_value.bool_value);
-			}
+	return NULL;
+}
+
+// Encode layers first through last - 1 each into its own string. The layers are independent
+// of each other, so with more than one thread, each thread takes the next layer that nobody has started.
+static bool encode_layers(std::vector<mvt_layer> &layers, std::vector<std::string> &layer_strings, size_t first, size_t last, size_t limit, size_t threads) {
+	layer_strings.resize(layers.size());
+	if (threads > last - first) {
+		threads = last - first;
+	}
 
-			layer_writer.add_message(4, value_string);
+	volatile size_t next = first;
+	volatile bool fits = true;
+	encode_layers_arg arg;
+	arg.layers = &layers;
+	arg.layer_strings = &layer_strings;
+	arg.last = last;
+	arg.limit = limit;
+	arg.next = &next;
+	arg.fits = &fits;
+
+	if (threads > 1) {
+		std::vector<struct pool_task *> workers;
+		for (size_t t = 0; t < threads; t++) {
+			workers.push_back(task_start(run_encode_layers, &arg));
+		}
+		for (size_t t = 0; t < threads; t++) {
+			task_join(workers[t]);
 		}
+	} else {
+		run_encode_layers(&arg);
+	}
 
-		for (size_t f = 0; f < layers[i].features.size(); f++) {
-			std::string feature_string;
-			protozero::pbf_writer feature_writer(feature_string);
+	return fits;
+}
 
-			feature_writer.add_enum(3, layers[i].features[f].type);
-			feature_writer.add_packed_uint32(2, std::begin(layers[i].features[f].tags), std::end(layers[i].features[f].tags));
+std::string mvt_tile::encode(size_t threads) {
+	std::string data;
 
-			if (layers[i].features[f].has_id) {
-				feature_writer.add_uint64(1, layers[i].features[f].id);
-			}
+	protozero::pbf_writer writer(data);
 
-			std::vector<uint32_t> geometry;
+	std::vector<std::string> layer_strings;
+	encode_layers(layers, layer_strings, 0, layers.size(), SIZE_MAX, threads);
+	for (size_t i = 0; i < layers.size(); i++) {
+		writer.add_message(3, layer_strings[i]);
+	}
 
-			int px = 0, py = 0;
-			int cmd_idx = -1;
-			int cmd = -1;
-			int length = 0;
+	return data;
+}
 
-			std::vector<mvt_geometry> &geom = layers[i].features[f].geometry;
+// Deflate len bytes onto the end of output a piece at a time, giving up once
+// the output is more than limit bytes, since it can only get longer from there
+static bool deflate_limited(z_stream *deflate_s, const char *data, size_t len, std::string &output, size_t limit, int flush) {
+	const size_t piece = 65536;
 
-			for (size_t g = 0; g < geom.size(); g++) {
-				int op = geom[g].op;
+	do {
+		size_t n = len;
+		if (n > piece) {
+			n = piece;
+		}
+		deflate_s->next_in = (Bytef *) data;
+		deflate_s->avail_in = n;
+		data += n;
+		len -= n;
+
+		int ret;
+		do {
+			size_t length = output.size();
+			size_t increase = n / 2 + 1024;
+			output.resize(length + increase);
+			deflate_s->avail_out = increase;
+			deflate_s->next_out = (Bytef *) (output.data() + length);
+			ret = deflate(deflate_s, len == 0 ? flush : Z_NO_FLUSH);
+			if (ret != Z_STREAM_END && ret != Z_OK && ret != Z_BUF_ERROR) {
+				fprintf(stderr, "Deflate error %d\n", ret);
+				exit(EXIT_FAILURE);
+			}
+			output.resize(length + (increase - deflate_s->avail_out));
+		} while (deflate_s->avail_out == 0);
 
-				if (op != cmd) {
-					if (cmd_idx >= 0) {
-						geometry[cmd_idx] = (length << 3) | (cmd & ((1 << 3) - 1));
-					}
+		if (output.size() > limit) {
+			return false;
+		}
+	} while (len > 0);
 
-					cmd = op;
-					length = 0;
-					cmd_idx = geometry.size();
-					geometry.push_back(0);
-				}
+	return true;
+}
 
-				if (op == mvt_moveto || op == mvt_lineto) {
-					long long wwx = geom[g].x;
-					long long wwy = geom[g].y;
+bool mvt_tile::encode(std::string &out, size_t limit, bool gzip, size_t threads) {
+	out.clear();
+	if (threads < 1) {
+		threads = 1;
+	}
 
-					int dx = wwx - px;
-					int dy = wwy - py;
+	z_stream deflate_s;
+	if (gzip) {
+		deflate_s.zalloc = Z_NULL;
+		deflate_s.zfree = Z_NULL;
+		deflate_s.opaque = Z_NULL;
+		deflate_s.avail_in = 0;
+		deflate_s.next_in = Z_NULL;
+		if (deflateInit2(&deflate_s, Z_BEST_COMPRESSION, Z_DEFLATED, 31, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+			fprintf(stderr, "Deflate error: %s\n", deflate_s.msg);
+			exit(EXIT_FAILURE);
+		}
+	}
 
-					geometry.push_back(protozero::encode_zigzag32(dx));
-					geometry.push_back(protozero::encode_zigzag32(dy));
+	// Only as many layers are encoded at a time as there are threads to encode
+	// them, and each of those is added to the output before any more are encoded,
+	// so that a tile that is already too big stops without encoding the rest.
+	bool fits = true;
+	std::vector<std::string> layer_strings;
+	for (size_t b = 0; fits && b < layers.size(); b += threads) {
+		size_t last = b + threads;
+		if (last > layers.size()) {
+			last = layers.size();
+		}
 
-					px = wwx;
-					py = wwy;
-					length++;
-				} else if (op == mvt_closepath) {
-					length++;
-				} else {
-					fprintf(stderr, "\nInternal error: corrupted geometry\n");
-					exit(EXIT_FAILURE);
-				}
-			}
+		if (!encode_layers(layers, layer_strings, b, last, gzip ? SIZE_MAX : limit - out.size(), threads)) {
+			fits = false;
+			break;
+		}
 
-			if (cmd_idx >= 0) {
-				geometry[cmd_idx] = (length << 3) | (cmd & ((1 << 3) - 1));
+		for (size_t i = b; i < last; i++) {
+			std::string message;
+			protozero::pbf_writer writer(message);
+			writer.add_message(3, layer_strings[i]);
+			layer_strings[i].clear();
+
+			if (gzip) {
+				// The compressed bytes that have come out so far are all going to be
+				// in the final tile, so if there are already too many, stop here.
+				if (!deflate_limited(&deflate_s, message.data(), message.size(), out, limit, i + 1 == layers.size() ? Z_FINISH : Z_NO_FLUSH)) {
+					fits = false;
+					break;
+				}
+			} else {
+				out.append(message);
+				if (out.size() > limit) {
+					fits = false;
+					break;
+				}
 			}
-
-			feature_writer.add_packed_uint32(4, std::begin(geometry), std::end(geometry));
-			layer_writer.add_message(2, feature_string);
 		}
+	}
 
-		writer.add_message(3, layer_string);
+	if (gzip) {
+		if (fits && layers.size() == 0) {
+			fits = deflate_limited(&deflate_s, "", 0, out, limit, Z_FINISH);
+		}
+		deflateEnd(&deflate_s);
 	}
 
-	return data;
+	return fits;
 }
 
 bool mvt_value::operator<(const mvt_value &o) const {
@@ -395,6 +788,77 @@ bool mvt_value::operator<(const mvt_value &o) const {
 	return false;
 }
 
+// The same values that the sorted pools used to treat as one, except that
+// a NaN only matches another NaN, instead of anything it wasn't less than
+bool mvt_value::operator==(const mvt_value &o) const {
+	if (type != o.type) {
+		return false;
+	}
+
+	switch (type) {
+	case mvt_string:
+		return string_value == o.string_value;
+	case mvt_float:
+		return numeric_value.float_value == o.numeric_value.float_value ||
+		       (std::isnan(numeric_value.float_value) && std::isnan(o.numeric_value.float_value));
+	case mvt_double:
+		return numeric_value.double_value == o.numeric_value.double_value ||
+		       (std::isnan(numeric_value.double_value) && std::isnan(o.numeric_value.double_value));
+	case mvt_int:
+		return numeric_value.int_value == o.numeric_value.int_value;
+	case mvt_uint:
+		return numeric_value.uint_value == o.numeric_value.uint_value;
+	case mvt_sint:
+		return numeric_value.sint_value == o.numeric_value.sint_value;
+	case mvt_bool:
+		return numeric_value.bool_value == o.numeric_value.bool_value;
+	default:
+		return true;
+	}
+}
+
+size_t mvt_value_hash::operator()(const mvt_value &v) const {
+	size_t h;
+
+	switch (v.type) {
+	case mvt_string:
+		h = std::hash<std::string>()(v.string_value);
+		break;
+	case mvt_float:
+		// 0 and -0 are equal, and so are all NaNs, so they have to hash the same
+		if (std::isnan(v.numeric_value.float_value)) {
+			h = 1;
+		} else {
+			h = v.numeric_value.float_value == 0 ? 0 : std::hash<float>()(v.numeric_value.float_value);
+		}
+		break;
+	case mvt_double:
+		if (std::isnan(v.numeric_value.double_value)) {
+			h = 1;
+		} else {
+			h = v.numeric_value.double_value == 0 ? 0 : std::hash<double>()(v.numeric_value.double_value);
+		}
+		break;
+	case mvt_int:
+		h = std::hash<long long>()(v.numeric_value.int_value);
+		break;
+	case mvt_uint:
+		h = std::hash<unsigned long long>()(v.numeric_value.uint_value);
+		break;
+	case mvt_sint:
+		h = std::hash<long long>()(v.numeric_value.sint_value);
+		break;
+	case mvt_bool:
+		h = v.numeric_value.bool_value;
+		break;
+	default:
+		h = 0;
+		break;
+	}
+
+	return h ^ ((size_t) v.type * 0x9E3779B97F4A7C15ULL);
+}
+
 static std::string quote(std::string const &s) {
 	std::string buf;
 
@@ -446,12 +910,12 @@ std::string mvt_value::toString() {
 	}
 }
 
-void mvt_layer::tag(mvt_feature &feature, std::string key, mvt_value value) {
+void mvt_layer::tag(mvt_feature &feature, std::string const &key, mvt_value const &value) {
 	size_t ko, vo;
 
-	std::map<std::string, size_t>::iterator ki = key_map.find(key);
-	std::map<mvt_value, size_t>::iterator vi = value_map.find(value);
-
+	// Most keys and values are already in the pools, so look before
+	// inserting, which would copy them even if they were there
+	auto ki = key_map.find(key);
 	if (ki == key_map.end()) {
 		ko = keys.size();
 		keys.push_back(key);
@@ -460,6 +924,7 @@ void mvt_layer::tag(mvt_feature &feature, std::string key, mvt_value value) {
 		ko = ki->second;
 	}
 
+	auto vi = value_map.find(value);
 	if (vi == value_map.end()) {
 		vo = values.size();
 		values.push_back(value);
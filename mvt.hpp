@@ -5,7 +5,9 @@
 #include <string>
 #include <map>
 #include <set>
+#include <unordered_map>
 #include <vector>
+#include "protozero/types.hpp"
 
 struct mvt_value;
 struct mvt_layer;
@@ -79,9 +81,15 @@ struct mvt_value {
 	} numeric_value;
 
 	bool operator<(const mvt_value &o) const;
+	bool operator==(const mvt_value &o) const;
 	std::string toString();
 };
 
+// Hashes the same parts of a value that == compares
+struct mvt_value_hash {
+	size_t operator()(const mvt_value &v) const;
+};
+
 struct mvt_layer {
 	int version;
 	std::string name;
@@ -91,23 +99,91 @@ struct mvt_layer {
 	long long extent;
 
 	// Add a key-value pair to a feature, using this layer's constant pool
-	void tag(mvt_feature &feature, std::string key, mvt_value value);
+	void tag(mvt_feature &feature, std::string const &key, mvt_value const &value);
 
 	// For tracking the key-value constants already used in this layer
-	std::map<std::string, size_t> key_map;
-	std::map<mvt_value, size_t> value_map;
+	std::unordered_map<std::string, size_t> key_map;
+	std::unordered_map<mvt_value, size_t, mvt_value_hash> value_map;
+
+	// If not empty, the whole layer already encoded, which encode()
+	// copies out as it is instead of encoding the fields above
+	std::string raw;
 };
 
 struct mvt_tile {
 	std::vector<mvt_layer> layers;
 
-	std::string encode();
+	// Layers are encoded on up to this many threads at once
+	std::string encode(size_t threads = 1);
+
+	// Encode into out, gzipped if gzip is set, and stop as soon as the result
+	// is sure to be more than limit bytes. Returns false if it stopped, in which
+	// case out holds only the part of the tile that was finished.
+	bool encode(std::string &out, size_t limit, bool gzip, size_t threads = 1);
+
 	bool decode(std::string &message, bool &was_compressed);
 };
 
+// Views of an encoded tile that point into its bytes instead of copying them
+// out, so that a caller that only wants some of the layers, features, or
+// attributes only pays for decoding those. They stay valid only as long as
+// the mvt_tile_view does, and, if the tile wasn't compressed, the message
+// that it was decoded from.
+
+struct mvt_feature_view {
+	int /* mvt_geometry_type */ type;
+	unsigned long long id;
+	bool has_id;
+	protozero::data_view tags;      // packed key and value indices
+	protozero::data_view geometry;  // packed commands and coordinates
+
+	bool decode(protozero::data_view message);
+
+	// Copy out the tags or the geometry, replacing what was in the vector
+	void decode_tags(std::vector<unsigned> &out) const;
+	void decode_geometry(std::vector<mvt_geometry> &out) const;
+};
+
+struct mvt_layer_view {
+	int version;
+	std::string name;
+	long long extent;
+	std::vector<protozero::data_view> keys;
+	std::vector<protozero::data_view> values;    // each still an encoded value
+	std::vector<protozero::data_view> features;  // each still an encoded feature
+	protozero::data_view data;                   // the whole encoded layer
+
+	bool decode(protozero::data_view message);
+
+	// Decode one of the values, remembering it in case it is asked for again
+	mvt_value const &value(size_t i);
+
+	// Copy the whole layer
+	void to_layer(mvt_layer &layer);
+
+	std::vector<mvt_value> decoded_values;  // for value()
+	std::vector<bool> have_value;
+};
+
+struct mvt_tile_view {
+	std::vector<mvt_layer_view> layers;
+
+	mvt_tile_view() = default;
+	mvt_tile_view(mvt_tile_view const &) = delete;  // the layers may point into uncompressed
+	mvt_tile_view &operator=(mvt_tile_view const &) = delete;
+
+	bool decode(std::string const &message, bool &was_compressed);
+
+	std::string uncompressed;  // what the layers point into, if the message was compressed
+};
+
 bool is_compressed(std::string const &data);
 int decompress(std::string const &input, std::string &output);
 int compress(std::string const &input, std::string &output);
+
+// Gzip in separately deflated blocks, up to threads of them at once, and stop
+// once the output is more than limit bytes. Returns false if it stopped.
+bool compress_blocks(std::string const &input, std::string &output, size_t limit, size_t threads);
 int dezig(unsigned n);
 
 mvt_value stringified_to_mvt_value(int type, const char *s);
@@ -19,6 +19,13 @@
 #define A_GRID_LOW_ZOOMS ((int) 'L')
 #define A_DETECT_WRAPAROUND ((int) 'w')
 #define A_EXTEND_ZOOMS ((int) 'e')
+#define A_REPORT_UTILIZATION ((int) 'u')
+#define A_DEDUPLICATE_TILES ((int) 'T')
+#define A_HUGEPAGES ((int) 'H')
+#define A_COMPRESS_TEMPORARY ((int) 'Z')
+#define A_PREDICT_TILE_SIZE ((int) 'P')
+#define A_PARALLEL_COMPRESSION ((int) 'B')
+#define A_GEOMETRY_ARRAYS ((int) 'A')
 
 #define P_SIMPLIFY ((int) 's')
 #define P_SIMPLIFY_LOW ((int) 'S')
@@ -32,6 +39,7 @@
 #define P_TINY_POLYGON_REDUCTION ((int) 't')
 #define P_TILE_COMPRESSION ((int) 'C')
 #define P_TILE_STATS ((int) 'g')
+#define P_ZOOM_PIPELINE ((int) 'P')
 
 extern int prevent[256];
 extern int additional[256];
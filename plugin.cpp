@@ -32,6 +32,7 @@ extern "C" {
 #include "plugin.hpp"
 #include "write_json.hpp"
 #include "read_json.hpp"
+#include "threadpool.hpp"
 
 struct writer_arg {
 	int write_to;
@@ -619,11 +620,7 @@ std::vector<mvt_layer> filter_layers(const char *filter, std::vector<mvt_layer>
 	wa.y = y;
 	wa.extent = extent;
 
-	pthread_t writer;
-	if (pthread_create(&writer, NULL, run_writer, &wa) != 0) {
-		perror("pthread_create (filter writer)");
-		exit(EXIT_FAILURE);
-	}
+	struct pool_task *writer = task_start_concurrent(run_writer, &wa);
 
 	std::vector<mvt_layer> nlayers = parse_layers(read_from, z, x, y, layermaps, tiling_seg, layer_unmaps, extent);
 
@@ -638,11 +635,7 @@ std::vector<mvt_layer> filter_layers(const char *filter, std::vector<mvt_layer>
 		}
 	}
 
-	void *ret;
-	if (pthread_join(writer, &ret) != 0) {
-		perror("pthread_join filter writer");
-		exit(EXIT_FAILURE);
-	}
+	task_join(writer);
 
 	return nlayers;
 }
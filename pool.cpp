@@ -1,84 +1,110 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <limits.h>
-#include <math.h>
 #include "memfile.hpp"
 #include "pool.hpp"
 
-int swizzlecmp(const char *a, const char *b) {
-	ssize_t alen = strlen(a);
-	ssize_t blen = strlen(b);
+// The tree file is a pool_header followed by an open-addressing hash
+// table of stringpool slots, using linear probing. It lives in a
+// memory-mapped temporary file like the pool itself, so a very large
+// table can spill to disk instead of having to fit in memory.
 
-	if (strcmp(a, b) == 0) {
-		return 0;
-	}
+#define INITIAL_SLOTS 1024
 
-	long long hash1 = 0, hash2 = 0;
-	for (ssize_t i = alen - 1; i >= 0; i--) {
-		hash1 = (hash1 * 37 + a[i]) & INT_MAX;
-	}
-	for (ssize_t i = blen - 1; i >= 0; i--) {
-		hash2 = (hash2 * 37 + b[i]) & INT_MAX;
-	}
+static struct pool_header *header(struct memfile *treefile) {
+	return (struct pool_header *) treefile->map;
+}
 
-	int h1 = hash1, h2 = hash2;
-	if (h1 == h2) {
-		return strcmp(a, b);
+static struct stringpool *slots(struct memfile *treefile) {
+	return (struct stringpool *) (treefile->map + sizeof(struct pool_header));
+}
+
+// 64-bit FNV-1a of the type and the string
+static unsigned long long pool_hash(const char *s, char type) {
+	unsigned long long h = 14695981039346656037ULL;
+	h ^= (unsigned char) type;
+	h *= 1099511628211ULL;
+	for (; *s != '\0'; s++) {
+		h ^= (unsigned char) *s;
+		h *= 1099511628211ULL;
 	}
+	return h;
+}
 
-	return h1 - h2;
+// Appends len zero bytes to the file
+static void write_zeroes(struct memfile *treefile, long long len) {
+	static char zeroes[4096];
+
+	while (len > 0) {
+		long long n = len;
+		if (n > (long long) sizeof(zeroes)) {
+			n = sizeof(zeroes);
+		}
+		if (memfile_write(treefile, zeroes, n) < 0) {
+			perror("memfile write");
+			exit(EXIT_FAILURE);
+		}
+		len -= n;
+	}
 }
 
-long long addpool(struct memfile *poolfile, struct memfile *treefile, const char *s, char type) {
-	unsigned long *sp = &treefile->tree;
-	size_t depth = 0;
+void pool_init(struct memfile *treefile) {
+	struct pool_header h;
+	memset(&h, 0, sizeof(h));
+	h.slots = INITIAL_SLOTS;
 
-	// In typical data, traversal depth generally stays under 2.5x
-	size_t max = 3 * log(treefile->off / sizeof(struct stringpool)) / log(2);
-	if (max < 30) {
-		max = 30;
+	if (memfile_write(treefile, &h, sizeof(h)) < 0) {
+		perror("memfile write");
+		exit(EXIT_FAILURE);
 	}
+	write_zeroes(treefile, INITIAL_SLOTS * sizeof(struct stringpool));
+}
 
-	while (*sp != 0) {
-		int cmp = swizzlecmp(s, poolfile->map + ((struct stringpool *) (treefile->map + *sp))->off + 1);
+// Doubles the table. The new table is built after the end of the old
+// one and then moved down to replace it, so the file never needs more
+// than three times the space of the old table.
+static void grow(struct memfile *treefile) {
+	unsigned long long old_slots = header(treefile)->slots;
+	unsigned long long new_slots = old_slots * 2;
+	long long new_start = treefile->off;
 
-		if (cmp == 0) {
-			cmp = type - (poolfile->map + ((struct stringpool *) (treefile->map + *sp))->off)[0];
-		}
+	write_zeroes(treefile, new_slots * sizeof(struct stringpool));
 
-		if (cmp < 0) {
-			sp = &(((struct stringpool *) (treefile->map + *sp))->left);
-		} else if (cmp > 0) {
-			sp = &(((struct stringpool *) (treefile->map + *sp))->right);
-		} else {
-			return ((struct stringpool *) (treefile->map + *sp))->off;
+	struct stringpool *old_table = slots(treefile);
+	struct stringpool *new_table = (struct stringpool *) (treefile->map + new_start);
+
+	for (unsigned long long i = 0; i < old_slots; i++) {
+		if (old_table[i].off != 0) {
+			unsigned long long j = old_table[i].hash & (new_slots - 1);
+			while (new_table[j].off != 0) {
+				j = (j + 1) & (new_slots - 1);
+			}
+			new_table[j] = old_table[i];
 		}
+	}
 
-		depth++;
-		if (depth > max) {
-			// Search is very deep, so string is probably unique.
-			// Add it to the pool without adding it to the search tree.
+	memmove(old_table, new_table, new_slots * sizeof(struct stringpool));
+	treefile->off = sizeof(struct pool_header) + new_slots * sizeof(struct stringpool);
+	header(treefile)->slots = new_slots;
+}
 
-			long long off = poolfile->off;
-			if (memfile_write(poolfile, &type, 1) < 0) {
-				perror("memfile write");
-				exit(EXIT_FAILURE);
-			}
-			if (memfile_write(poolfile, (void *) s, strlen(s) + 1) < 0) {
-				perror("memfile write");
-				exit(EXIT_FAILURE);
+long long addpool(struct memfile *poolfile, struct memfile *treefile, const char *s, char type) {
+	unsigned long long h = pool_hash(s, type);
+	unsigned long long mask = header(treefile)->slots - 1;
+	struct stringpool *table = slots(treefile);
+
+	unsigned long long i = h & mask;
+	while (table[i].off != 0) {
+		if (table[i].hash == h) {
+			const char *found = poolfile->map + table[i].off - 1;
+			if (found[0] == type && strcmp(found + 1, s) == 0) {
+				header(treefile)->hits++;
+				header(treefile)->bytes_saved += strlen(s) + 2;
+				return table[i].off - 1;
 			}
-			return off;
 		}
-	}
 
-	// *sp is probably in the memory-mapped file, and will move if the file grows.
-	long long ssp;
-	if (sp == &treefile->tree) {
-		ssp = -1;
-	} else {
-		ssp = ((char *) sp) - treefile->map;
+		i = (i + 1) & mask;
 	}
 
 	long long off = poolfile->off;
@@ -91,31 +117,17 @@ long long addpool(struct memfile *poolfile, struct memfile *treefile, const char
 		exit(EXIT_FAILURE);
 	}
 
-	if (off >= LONG_MAX || treefile->off >= LONG_MAX) {
-		// Tree or pool is bigger than 2GB
-		static bool warned = false;
-		if (!warned) {
-			fprintf(stderr, "Warning: string pool is very large.\n");
-			warned = true;
-		}
-		return off;
-	}
+	table[i].hash = h;
+	table[i].off = off + 1;
 
-	struct stringpool tsp;
-	tsp.left = 0;
-	tsp.right = 0;
-	tsp.off = off;
+	struct pool_header *ph = header(treefile);
+	ph->misses++;
+	ph->used++;
 
-	long long p = treefile->off;
-	if (memfile_write(treefile, &tsp, sizeof(struct stringpool)) < 0) {
-		perror("memfile write");
-		exit(EXIT_FAILURE);
+	// Keep the table at most half full so that probe sequences stay short
+	if (ph->used * 2 > ph->slots) {
+		grow(treefile);
 	}
 
-	if (ssp == -1) {
-		treefile->tree = p;
-	} else {
-		*((long long *) (treefile->map + ssp)) = p;
-	}
 	return off;
 }
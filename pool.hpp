@@ -2,11 +2,22 @@
 #define POOL_HPP
 
 struct stringpool {
-	unsigned long left;
-	unsigned long right;
-	unsigned long off;
+	unsigned long long hash;
+	unsigned long long off;  // 1 + offset of the string in the pool, or 0 if the slot is empty
 };
 
+struct pool_header {
+	unsigned long long slots;  // always a power of 2
+	unsigned long long used;
+
+	// Strings that were already in the pool, strings that had to be
+	// added to it, and the pool space that reusing the former saved
+	long long hits;
+	long long misses;
+	long long bytes_saved;
+};
+
+void pool_init(struct memfile *treefile);
 long long addpool(struct memfile *poolfile, struct memfile *treefile, const char *s, char type);
 
 #endif
@@ -627,13 +627,14 @@ int serialize_feature(struct serialization_state *sst, serial_feature &sf) {
 		}
 	}
 
-	if (*(sst->progress_seq) % 10000 == 0) {
+	// Shared by all the reading threads
+	long long seq = __sync_fetch_and_add(sst->progress_seq, 1);
+	if (seq % 10000 == 0) {
 		checkdisk(sst->readers, CPUS);
 		if (!quiet) {
-			fprintf(stderr, "Read %.2f million features\r", *sst->progress_seq / 1000000.0);
+			fprintf(stderr, "Read %.2f million features\r", seq / 1000000.0);
 		}
 	}
-	(*(sst->progress_seq))++;
 	(*(sst->layer_seq))++;
 
 	return 1;
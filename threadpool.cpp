@@ -0,0 +1,210 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <vector>
+#include <deque>
+#include <algorithm>
+#include "threadpool.hpp"
+
+struct pool_task {
+	void *(*func)(void *);
+	void *arg;
+	void *ret;
+	bool started;  // taken by a worker or by the thread joining it
+	bool done;
+};
+
+struct worker {
+	pthread_t thread;
+	pthread_cond_t cond;     // signaled when the worker is given a task
+	struct pool_task *task;  // or NULL if idle
+	bool persistent;         // false for a thread that exits after its one task
+};
+
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t done_cond = PTHREAD_COND_INITIALIZER;  // signaled when any task finishes
+static std::vector<struct worker *> idle;
+static std::deque<struct pool_task *> queued;
+
+static void lock() {
+	if (pthread_mutex_lock(&pool_lock) != 0) {
+		perror("pthread_mutex_lock (thread pool)");
+		exit(EXIT_FAILURE);
+	}
+}
+
+static void unlock() {
+	if (pthread_mutex_unlock(&pool_lock) != 0) {
+		perror("pthread_mutex_unlock (thread pool)");
+		exit(EXIT_FAILURE);
+	}
+}
+
+static void wait(pthread_cond_t *cond) {
+	if (pthread_cond_wait(cond, &pool_lock) != 0) {
+		perror("pthread_cond_wait (thread pool)");
+		exit(EXIT_FAILURE);
+	}
+}
+
+// Called with the lock held
+static struct pool_task *next_queued() {
+	if (queued.size() == 0) {
+		return NULL;
+	}
+
+	struct pool_task *t = queued.front();
+	queued.pop_front();
+	t->started = true;
+	return t;
+}
+
+static void *run_worker(void *v) {
+	struct worker *w = (struct worker *) v;
+
+	lock();
+	while (true) {
+		while (w->task == NULL) {
+			wait(&w->cond);
+		}
+
+		struct pool_task *t = w->task;
+		unlock();
+
+		void *ret = t->func(t->arg);
+
+		lock();
+		t->ret = ret;
+		t->done = true;
+		if (pthread_cond_broadcast(&done_cond) != 0) {
+			perror("pthread_cond_broadcast (thread pool)");
+			exit(EXIT_FAILURE);
+		}
+
+		if (!w->persistent) {
+			break;
+		}
+
+		w->task = next_queued();
+		if (w->task == NULL) {
+			idle.push_back(w);
+		}
+	}
+	unlock();
+
+	if (pthread_cond_destroy(&w->cond) != 0) {
+		perror("pthread_cond_destroy (thread pool)");
+		exit(EXIT_FAILURE);
+	}
+	delete w;
+	return NULL;
+}
+
+// Called with the lock held
+static void start_worker(struct pool_task *t, bool persistent) {
+	struct worker *w = new worker;
+	w->task = t;
+	w->persistent = persistent;
+	if (pthread_cond_init(&w->cond, NULL) != 0) {
+		perror("pthread_cond_init (thread pool)");
+		exit(EXIT_FAILURE);
+	}
+
+	if (pthread_create(&w->thread, NULL, run_worker, w) != 0) {
+		perror("pthread_create");
+		exit(EXIT_FAILURE);
+	}
+	if (pthread_detach(w->thread) != 0) {
+		perror("pthread_detach");
+		exit(EXIT_FAILURE);
+	}
+
+	if (t == NULL) {
+		idle.push_back(w);
+	}
+}
+
+void threadpool_init(size_t threads) {
+	lock();
+	for (size_t i = idle.size(); i < threads; i++) {
+		start_worker(NULL, true);
+	}
+	unlock();
+}
+
+static struct pool_task *new_task(void *(*func)(void *), void *arg) {
+	struct pool_task *t = new pool_task;
+	t->func = func;
+	t->arg = arg;
+	t->ret = NULL;
+	t->started = false;
+	t->done = false;
+	return t;
+}
+
+// Called with the lock held. Returns false if no worker is idle.
+static bool give_idle(struct pool_task *t) {
+	if (idle.size() == 0) {
+		return false;
+	}
+
+	struct worker *w = idle.back();
+	idle.pop_back();
+
+	t->started = true;
+	w->task = t;
+	if (pthread_cond_signal(&w->cond) != 0) {
+		perror("pthread_cond_signal (thread pool)");
+		exit(EXIT_FAILURE);
+	}
+
+	return true;
+}
+
+struct pool_task *task_start(void *(*func)(void *), void *arg) {
+	struct pool_task *t = new_task(func, arg);
+
+	lock();
+	if (!give_idle(t)) {
+		queued.push_back(t);
+	}
+	unlock();
+
+	return t;
+}
+
+struct pool_task *task_start_concurrent(void *(*func)(void *), void *arg) {
+	struct pool_task *t = new_task(func, arg);
+
+	lock();
+	if (!give_idle(t)) {
+		t->started = true;
+		start_worker(t, false);
+	}
+	unlock();
+
+	return t;
+}
+
+void *task_join(struct pool_task *t) {
+	lock();
+	if (!t->started) {
+		// Nobody has gotten to it yet, so do it here instead of waiting
+		queued.erase(std::find(queued.begin(), queued.end(), t));
+		t->started = true;
+		unlock();
+
+		t->ret = t->func(t->arg);
+
+		lock();
+		t->done = true;
+	}
+	while (!t->done) {
+		wait(&done_cond);
+	}
+	unlock();
+
+	void *ret = t->ret;
+	delete t;
+	return ret;
+}
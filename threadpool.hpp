@@ -0,0 +1,30 @@
+#ifndef THREADPOOL_HPP
+#define THREADPOOL_HPP
+
+#include <stddef.h>
+
+// A fixed number of worker threads, started once, that the stages of
+// tiling share instead of each creating and joining their own threads.
+//
+// Tasks beyond what the workers can take right away wait in a queue. If
+// no worker has taken a task by the time it is joined, the joining thread
+// runs it itself, so a task may start and join others of its own without
+// the pool running out of workers.
+//
+// A task that has to run at the same time as the thread that started it,
+// because they wait on each other through a pipe or a queue and not only
+// by joining, is started with task_start_concurrent() instead. It takes an
+// idle worker if there is one, or otherwise a thread of its own, which
+// exits instead of joining the pool once the task is done.
+
+struct pool_task;
+
+// Start as many workers as there are CPUs, ahead of time
+void threadpool_init(size_t threads);
+
+// Like pthread_create() and pthread_join(), except the thread comes from the pool
+struct pool_task *task_start(void *(*func)(void *), void *arg);
+struct pool_task *task_start_concurrent(void *(*func)(void *), void *arg);
+void *task_join(struct pool_task *t);
+
+#endif
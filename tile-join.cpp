@@ -2,6 +2,7 @@
 #include <dirent.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/time.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -13,6 +14,8 @@
 #include <string>
 #include <map>
 #include <set>
+#include <queue>
+#include <deque>
 #include <zlib.h>
 #include <math.h>
 #include <pthread.h>
@@ -35,7 +38,13 @@ std::string dequote(std::string s);
 int pk = false;
 int pC = false;
 int pg = false;
+int deduplicate = false;
+int report_thread_utilization = false;
+size_t memory_limit = 1024 * 1024 * 1024;
 size_t CPUS;
+size_t decompress_threads = 0;  // for each stage of joining, or 0 for as many as there are CPUs
+size_t join_threads = 0;
+size_t compress_threads = 0;
 int quiet = false;
 int maxzoom = 32;
 int minzoom = 0;
@@ -47,18 +56,110 @@ struct stats {
 	double minlat, minlon, maxlat, maxlon;
 };
 
-void handle(std::string message, int z, unsigned x, unsigned y, std::map<std::string, layermap_entry> &layermap, std::vector<std::string> &header, std::map<std::string, std::vector<std::string>> &mapping, std::set<std::string> &exclude, std::set<std::string> &keep_layers, std::set<std::string> &remove_layers, int ifmatched, mvt_tile &outtile, json_object *filter) {
-	mvt_tile tile;
+// The attribute value as a string, and the type it is counted as in the
+// layer's statistics, or -1 if it is of a type that isn't copied
+static int attribute_string(mvt_value const &val, std::string &value) {
+	if (val.type == mvt_string) {
+		value = val.string_value;
+		return mvt_string;
+	} else if (val.type == mvt_int) {
+		aprintf(&value, "%lld", (long long) val.numeric_value.int_value);
+		return mvt_double;
+	} else if (val.type == mvt_double) {
+		aprintf(&value, "%s", milo::dtoa_milo(val.numeric_value.double_value).c_str());
+		return mvt_double;
+	} else if (val.type == mvt_float) {
+		aprintf(&value, "%s", milo::dtoa_milo(val.numeric_value.float_value).c_str());
+		return mvt_double;
+	} else if (val.type == mvt_bool) {
+		aprintf(&value, "%s", val.numeric_value.bool_value ? "true" : "false");
+		return mvt_bool;
+	} else if (val.type == mvt_sint) {
+		aprintf(&value, "%lld", (long long) val.numeric_value.sint_value);
+		return mvt_double;
+	} else if (val.type == mvt_uint) {
+		aprintf(&value, "%llu", (long long) val.numeric_value.uint_value);
+		return mvt_double;
+	} else {
+		return -1;
+	}
+}
+
+// Count a layer that is being copied to the output as it is into the
+// layer statistics, as if its features had been added one by one
+static void add_raw_layer(mvt_layer_view &layer, int z, std::map<std::string, layermap_entry> &layermap) {
+	auto file_keys = layermap.find(layer.name);
+	if (file_keys == layermap.end()) {
+		layermap.insert(std::pair<std::string, layermap_entry>(layer.name, layermap_entry(layermap.size())));
+		file_keys = layermap.find(layer.name);
+		file_keys->second.minzoom = z;
+		file_keys->second.maxzoom = z;
+	}
+
+	if (z < file_keys->second.minzoom) {
+		file_keys->second.minzoom = z;
+	}
+	if (z > file_keys->second.maxzoom) {
+		file_keys->second.maxzoom = z;
+	}
+
+	std::vector<std::string> keys;
+	keys.reserve(layer.keys.size());
+	for (size_t i = 0; i < layer.keys.size(); i++) {
+		keys.push_back(std::string(layer.keys[i]));
+	}
+
+	mvt_feature_view feat;
+	std::vector<unsigned> tags;
+
+	for (size_t f = 0; f < layer.features.size(); f++) {
+		feat.decode(layer.features[f]);
+		feat.decode_tags(tags);
+
+		for (size_t t = 0; t + 1 < tags.size(); t += 2) {
+			type_and_string tas;
+			tas.type = attribute_string(layer.value(tags[t + 1]), tas.string);
+
+			if (tas.type >= 0) {
+				add_to_file_keys(file_keys->second.file_keys, keys[tags[t]], tas);
+			}
+		}
+
+		if (feat.type == mvt_point) {
+			file_keys->second.points++;
+		} else if (feat.type == mvt_linestring) {
+			file_keys->second.lines++;
+		} else if (feat.type == mvt_polygon) {
+			file_keys->second.polygons++;
+		}
+	}
+}
+
+// Returns true if every layer of the tile was copied as it is and the
+// tile was compressed the way the output should be, so that the tile
+// itself could be copied instead. If it was decompressed before it
+// got here, compressed says so.
+bool handle(std::string const &message, bool compressed, int z, unsigned x, unsigned y, std::map<std::string, layermap_entry> &layermap, std::vector<std::string> &header, std::map<std::string, std::vector<std::string>> &mapping, std::set<std::string> &exclude, std::set<std::string> &keep_layers, std::set<std::string> &remove_layers, int ifmatched, mvt_tile &outtile, json_object *filter) {
+	// Layers, features, and values are only decoded from the view as they
+	// are needed, so dropped layers and features cost almost nothing.
+	mvt_tile_view tile;
 	int features_added = 0;
+	size_t layers_copied = 0;
 	bool was_compressed;
 
+	// With nothing to join, exclude, or filter, a layer that no other
+	// input has in this tile can be copied to the output as it is,
+	// without decoding its geometry or encoding it again.
+	bool passthrough = header.size() == 0 && exclude.size() == 0 && filter == NULL && !ifmatched;
+
 	if (!tile.decode(message, was_compressed)) {
 		fprintf(stderr, "Couldn't decompress tile %d/%u/%u\n", z, x, y);
 		exit(EXIT_FAILURE);
 	}
+	was_compressed = was_compressed || compressed;
 
 	for (size_t l = 0; l < tile.layers.size(); l++) {
-		mvt_layer &layer = tile.layers[l];
+		mvt_layer_view &layer = tile.layers[l];
 
 		if (keep_layers.size() > 0 && keep_layers.count(layer.name) == 0) {
 			continue;
@@ -69,7 +170,7 @@ void handle(std::string message, int z, unsigned x, unsigned y, std::map<std::st
 
 		size_t ol;
 		for (ol = 0; ol < outtile.layers.size(); ol++) {
-			if (tile.layers[l].name == outtile.layers[ol].name) {
+			if (layer.name == outtile.layers[ol].name) {
 				break;
 			}
 		}
@@ -80,6 +181,23 @@ void handle(std::string message, int z, unsigned x, unsigned y, std::map<std::st
 			outtile.layers[ol].name = layer.name;
 			outtile.layers[ol].version = layer.version;
 			outtile.layers[ol].extent = layer.extent;
+
+			if (passthrough && layer.features.size() > 0) {
+				outtile.layers[ol].raw = std::string(layer.data);
+				add_raw_layer(layer, z, layermap);
+				features_added += layer.features.size();
+				layers_copied++;
+				continue;
+			}
+		} else if (outtile.layers[ol].raw.size() > 0) {
+			// Another input has this layer too, so the features of
+			// the copy already made have to be merged with these
+			mvt_layer_view copied;
+			copied.decode(protozero::data_view(outtile.layers[ol].raw.data(), outtile.layers[ol].raw.size()));
+
+			mvt_layer decoded;
+			copied.to_layer(decoded);
+			outtile.layers[ol] = decoded;
 		}
 
 		mvt_layer &outlayer = outtile.layers[ol];
@@ -99,15 +217,25 @@ void handle(std::string message, int z, unsigned x, unsigned y, std::map<std::st
 
 		auto file_keys = layermap.find(layer.name);
 
+		std::vector<std::string> keys;
+		keys.reserve(layer.keys.size());
+		for (size_t i = 0; i < layer.keys.size(); i++) {
+			keys.push_back(std::string(layer.keys[i]));
+		}
+
+		mvt_feature_view feat;
+		std::vector<unsigned> tags;
+
 		for (size_t f = 0; f < layer.features.size(); f++) {
-			mvt_feature feat = layer.features[f];
+			feat.decode(layer.features[f]);
+			feat.decode_tags(tags);
 
 			if (filter != NULL) {
 				std::map<std::string, mvt_value> attributes;
 
-				for (size_t t = 0; t + 1 < feat.tags.size(); t += 2) {
-					std::string key = layer.keys[feat.tags[t]];
-					mvt_value &val = layer.values[feat.tags[t + 1]];
+				for (size_t t = 0; t + 1 < tags.size(); t += 2) {
+					std::string const &key = keys[tags[t]];
+					mvt_value const &val = layer.value(tags[t + 1]);
 
 					attributes.insert(std::pair<std::string, mvt_value>(key, val));
 				}
@@ -149,36 +277,11 @@ void handle(std::string message, int z, unsigned x, unsigned y, std::map<std::st
 			std::map<std::string, std::pair<mvt_value, type_and_string>> attributes;
 			std::vector<std::string> key_order;
 
-			for (size_t t = 0; t + 1 < feat.tags.size(); t += 2) {
-				const char *key = layer.keys[feat.tags[t]].c_str();
-				mvt_value &val = layer.values[feat.tags[t + 1]];
+			for (size_t t = 0; t + 1 < tags.size(); t += 2) {
+				const char *key = keys[tags[t]].c_str();
+				mvt_value const &val = layer.value(tags[t + 1]);
 				std::string value;
-				int type = -1;
-
-				if (val.type == mvt_string) {
-					value = val.string_value;
-					type = mvt_string;
-				} else if (val.type == mvt_int) {
-					aprintf(&value, "%lld", (long long) val.numeric_value.int_value);
-					type = mvt_double;
-				} else if (val.type == mvt_double) {
-					aprintf(&value, "%s", milo::dtoa_milo(val.numeric_value.double_value).c_str());
-					type = mvt_double;
-				} else if (val.type == mvt_float) {
-					aprintf(&value, "%s", milo::dtoa_milo(val.numeric_value.float_value).c_str());
-					type = mvt_double;
-				} else if (val.type == mvt_bool) {
-					aprintf(&value, "%s", val.numeric_value.bool_value ? "true" : "false");
-					type = mvt_bool;
-				} else if (val.type == mvt_sint) {
-					aprintf(&value, "%lld", (long long) val.numeric_value.sint_value);
-					type = mvt_double;
-				} else if (val.type == mvt_uint) {
-					aprintf(&value, "%llu", (long long) val.numeric_value.uint_value);
-					type = mvt_double;
-				} else {
-					continue;
-				}
+				int type = attribute_string(val, value);
 
 				if (type < 0) {
 					continue;
@@ -262,7 +365,7 @@ void handle(std::string message, int z, unsigned x, unsigned y, std::map<std::st
 				}
 
 				outfeature.type = feat.type;
-				outfeature.geometry = feat.geometry;
+				feat.decode_geometry(outfeature.geometry);
 
 				if (layer.extent != outlayer.extent) {
 					for (size_t i = 0; i < outfeature.geometry.size(); i++) {
@@ -293,8 +396,10 @@ void handle(std::string message, int z, unsigned x, unsigned y, std::map<std::st
 	}
 
 	if (features_added == 0) {
-		return;
+		return false;
 	}
+
+	return layers_copied == tile.layers.size() && was_compressed == !pC;
 }
 
 double min(double a, double b) {
@@ -320,6 +425,7 @@ struct reader {
 	long long y;
 	int pbf_count;
 	int z_flag;
+	unsigned long long seq;
 
 	std::string data;
 	std::vector<std::string> pbf_path;
@@ -529,6 +635,16 @@ struct reader *begin_reading(char *fname) {
 		const char *sql = "SELECT zoom_level, tile_column, tile_row, tile_data from tiles order by zoom_level, tile_column, tile_row;";
 		sqlite3_stmt *stmt;
 
+		// Deduplicated tilesets store each distinct tile once in images
+		// and point to them from map. Join them directly rather than
+		// depending on the tiles view being there.
+		if (sqlite3_prepare_v2(db, "SELECT count(*) from sqlite_master where type = 'table' and name in ('map', 'images');", -1, &stmt, NULL) == SQLITE_OK) {
+			if (sqlite3_step(stmt) == SQLITE_ROW && sqlite3_column_int(stmt, 0) == 2) {
+				sql = "SELECT map.zoom_level, map.tile_column, map.tile_row, images.tile_data from map join images on images.tile_id = map.tile_id order by map.zoom_level, map.tile_column, map.tile_row;";
+			}
+			sqlite3_finalize(stmt);
+		}
+
 		if (sqlite3_prepare_v2(db, sql, -1, &stmt, NULL) != SQLITE_OK) {
 			fprintf(stderr, "%s: select failed: %s\n", fname, sqlite3_errmsg(db));
 			exit(EXIT_FAILURE);
@@ -590,11 +706,195 @@ struct zxy {
 	}
 };
 
-struct arg {
-	std::map<zxy, std::vector<std::string>> inputs;
-	std::map<zxy, std::string> outputs;
+// The tiles from all the inputs that have the same zoom/x/y, as they
+// move through the stages of joining them
+struct join_task {
+	zxy tile;
+
+	std::vector<std::string> inputs;  // still compressed until the decompression stage
+	std::vector<bool> compressed;     // whether each input had been compressed
+	std::string original;             // the only input, still compressed, in case it can be copied as it is
+	mvt_tile joined;
+	std::string output;
+
+	join_task(zxy const &_tile)
+	    : tile(_tile) {
+	}
+};
+
+// Tiles go from one stage to the next in batches of consecutive tiles,
+// so that passing them between threads costs little next to working
+// on them, even when the tiles are small.
+#define BATCH_TILES 100
+#define BATCH_BYTES (1024 * 1024)
+
+struct join_batch {
+	unsigned long long seq;  // the order it was read in, and has to be written in
+	size_t bytes;            // as it was read, for the memory limit
+	std::vector<join_task> tasks;
+};
+
+// A queue of batches between two stages of the pipeline. Putting a batch into
+// a full queue waits until there is room, and taking one from an empty
+// queue waits until there is one or until the stage before has finished.
+struct batch_queue {
+	std::deque<join_batch *> batches;
+	size_t capacity;   // or 0 for no limit
+	size_t producers;  // threads that may still put batches into it
+	pthread_mutex_t lock;
+	pthread_cond_t changed;
+
+	batch_queue(size_t _capacity, size_t _producers)
+	    : capacity(_capacity), producers(_producers) {
+		if (pthread_mutex_init(&lock, NULL) != 0) {
+			perror("pthread_mutex_init");
+			exit(EXIT_FAILURE);
+		}
+		if (pthread_cond_init(&changed, NULL) != 0) {
+			perror("pthread_cond_init");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	~batch_queue() {
+		pthread_cond_destroy(&changed);
+		pthread_mutex_destroy(&lock);
+	}
+};
 
-	std::map<std::string, layermap_entry> *layermap;
+double wall_time() {
+	struct timeval tv;
+	if (gettimeofday(&tv, NULL) != 0) {
+		perror("gettimeofday");
+		exit(EXIT_FAILURE);
+	}
+	return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+static void queue_lock(batch_queue *q) {
+	if (pthread_mutex_lock(&q->lock) != 0) {
+		perror("pthread_mutex_lock");
+		exit(EXIT_FAILURE);
+	}
+}
+
+static void queue_unlock(batch_queue *q) {
+	if (pthread_mutex_unlock(&q->lock) != 0) {
+		perror("pthread_mutex_unlock");
+		exit(EXIT_FAILURE);
+	}
+}
+
+static void queue_wait(batch_queue *q) {
+	if (pthread_cond_wait(&q->changed, &q->lock) != 0) {
+		perror("pthread_cond_wait");
+		exit(EXIT_FAILURE);
+	}
+}
+
+static void queue_changed(batch_queue *q) {
+	if (pthread_cond_broadcast(&q->changed) != 0) {
+		perror("pthread_cond_broadcast");
+		exit(EXIT_FAILURE);
+	}
+}
+
+// Adds how long it had to wait for room to *waited
+static void queue_put(batch_queue *q, join_batch *b, double *waited) {
+	queue_lock(q);
+	if (q->capacity != 0 && q->batches.size() >= q->capacity) {
+		double start = wall_time();
+		while (q->batches.size() >= q->capacity) {
+			queue_wait(q);
+		}
+		*waited += wall_time() - start;
+	}
+	q->batches.push_back(b);
+	queue_changed(q);
+	queue_unlock(q);
+}
+
+// Returns NULL once the queue is empty and nothing more will be put into it
+static join_batch *queue_get(batch_queue *q, double *waited) {
+	queue_lock(q);
+	if (q->batches.size() == 0 && q->producers > 0) {
+		double start = wall_time();
+		while (q->batches.size() == 0 && q->producers > 0) {
+			queue_wait(q);
+		}
+		*waited += wall_time() - start;
+	}
+
+	join_batch *b = NULL;
+	if (q->batches.size() > 0) {
+		b = q->batches.front();
+		q->batches.pop_front();
+		queue_changed(q);
+	}
+	queue_unlock(q);
+	return b;
+}
+
+// Called by each producer when it has nothing more to put into the queue
+static void queue_finished(batch_queue *q) {
+	queue_lock(q);
+	q->producers--;
+	queue_changed(q);
+	queue_unlock(q);
+}
+
+// What one thread of a stage did, for --report-thread-utilization
+struct stage_stats {
+	double busy = 0;
+	double starved = 0;  // waiting for a batch from the stage before
+	double blocked = 0;  // waiting for room in the queue to the stage after
+	long long tiles = 0;
+	unsigned long long bytes_in = 0;
+	unsigned long long bytes_out = 0;
+
+	void add(stage_stats const &s) {
+		busy += s.busy;
+		starved += s.starved;
+		blocked += s.blocked;
+		tiles += s.tiles;
+		bytes_in += s.bytes_in;
+		bytes_out += s.bytes_out;
+	}
+};
+
+struct stage_report {
+	std::string name;
+	size_t threads;
+	stage_stats stats;
+};
+
+std::vector<stage_report> stage_reports;
+double join_wall = 0;
+
+void report_utilization() {
+	for (size_t i = 0; i < stage_reports.size(); i++) {
+		stage_report const &r = stage_reports[i];
+
+		double used = 0;
+		double rate = 0;
+		if (join_wall > 0) {
+			used = r.stats.busy / (join_wall * r.threads);
+		}
+		if (r.stats.busy > 0) {
+			rate = r.stats.tiles * r.threads / r.stats.busy;
+		}
+
+		fprintf(stderr, "%s: %zu thread%s, %.3f seconds busy, %.1f%% utilization, %lld tiles, %.1f MB in, %.1f MB out, %.0f tiles/second if always busy; %.3f seconds waiting for tiles, %.3f waiting to pass them on\n",
+			r.name.c_str(), r.threads, r.threads == 1 ? "" : "s", r.stats.busy, used * 100, r.stats.tiles,
+			r.stats.bytes_in / 1048576.0, r.stats.bytes_out / 1048576.0, rate, r.stats.starved, r.stats.blocked);
+	}
+
+	fprintf(stderr, "%.3f seconds joining\n", join_wall);
+}
+
+// Everything the stages share
+struct pipeline {
+	std::vector<std::map<std::string, layermap_entry>> layermaps;  // one for each joining thread
 
 	std::vector<std::string> *header;
 	std::map<std::string, std::vector<std::string>> *mapping;
@@ -603,123 +903,326 @@ struct arg {
 	std::set<std::string> *remove_layers;
 	int ifmatched;
 	json_object *filter;
+
+	tile_writer *writer;
+	std::map<unsigned long long, join_batch *> unwritten;  // finished out of order
+	unsigned long long next_write = 0;
+
+	// Bytes read but not yet written, which the reader waits on
+	// to keep within the memory limit
+	size_t in_flight = 0;
+	pthread_mutex_t flight_lock;
+	pthread_cond_t flight_changed;
 };
 
-void *join_worker(void *v) {
-	arg *a = (arg *) v;
+struct stage_thread;
 
-	for (auto ai = a->inputs.begin(); ai != a->inputs.end(); ++ai) {
-		mvt_tile tile;
+struct stage {
+	std::string name;
+	void (*work)(join_task *t, stage_thread *st);  // for each tile
+	batch_queue *in;
+	batch_queue *out;  // or NULL for the last stage, which writes
+	std::vector<stage_thread> threads;
+};
 
-		for (size_t i = 0; i < ai->second.size(); i++) {
-			handle(ai->second[i], ai->first.z, ai->first.x, ai->first.y, *(a->layermap), *(a->header), *(a->mapping), *(a->exclude), *(a->keep_layers), *(a->remove_layers), a->ifmatched, tile, a->filter);
-		}
+struct stage_thread {
+	stage *s;
+	pipeline *p;
+	size_t index;  // among the threads of its stage
+	pthread_t thread;
+	stage_stats stats;
+};
 
-		ai->second.clear();
+// Write in the order the tiles were read, which is also the
+// order of the tileset's index
+void write_batch(join_batch *b, stage_thread *st) {
+	pipeline *p = st->p;
+	p->unwritten.insert(std::pair<unsigned long long, join_batch *>(b->seq, b));
 
-		bool anything = false;
-		mvt_tile outtile;
-		for (size_t i = 0; i < tile.layers.size(); i++) {
-			if (tile.layers[i].features.size() > 0) {
-				outtile.layers.push_back(tile.layers[i]);
-				anything = true;
+	while (p->unwritten.size() > 0 && p->unwritten.begin()->first == p->next_write) {
+		join_batch *w = p->unwritten.begin()->second;
+		p->unwritten.erase(p->unwritten.begin());
+		p->next_write++;
+
+		double start = wall_time();
+		for (size_t i = 0; i < w->tasks.size(); i++) {
+			join_task &t = w->tasks[i];
+
+			if (t.output.size() > 0) {
+				st->stats.bytes_in += t.output.size();
+				tile_writer_put(p->writer, t.tile.z, t.tile.x, t.tile.y, t.output);
 			}
 		}
+		st->stats.busy += wall_time() - start;
+
+		if (pthread_mutex_lock(&p->flight_lock) != 0) {
+			perror("pthread_mutex_lock");
+			exit(EXIT_FAILURE);
+		}
+		p->in_flight -= w->bytes;
+		if (pthread_cond_broadcast(&p->flight_changed) != 0) {
+			perror("pthread_cond_broadcast");
+			exit(EXIT_FAILURE);
+		}
+		if (pthread_mutex_unlock(&p->flight_lock) != 0) {
+			perror("pthread_mutex_unlock");
+			exit(EXIT_FAILURE);
+		}
 
-		if (anything) {
-			std::string pbf = outtile.encode();
-			std::string compressed;
+		delete w;
+	}
+}
 
-			if (!pC) {
-				compress(pbf, compressed);
-			} else {
-				compressed = pbf;
-			}
+void *run_stage(void *v) {
+	stage_thread *st = (stage_thread *) v;
 
-			if (!pk && compressed.size() > 500000) {
-				fprintf(stderr, "Tile %lld/%lld/%lld size is %lld, >500000. Skipping this tile\n.", ai->first.z, ai->first.x, ai->first.y, (long long) compressed.size());
-			} else {
-				a->outputs.insert(std::pair<zxy, std::string>(ai->first, compressed));
-			}
+	join_batch *b;
+	while ((b = queue_get(st->s->in, &st->stats.starved)) != NULL) {
+		st->stats.tiles += b->tasks.size();
+
+		// The last stage writes the batches out instead
+		if (st->s->out == NULL) {
+			write_batch(b, st);
+			continue;
+		}
+
+		double start = wall_time();
+		for (size_t i = 0; i < b->tasks.size(); i++) {
+			st->s->work(&b->tasks[i], st);
 		}
+		st->stats.busy += wall_time() - start;
+
+		queue_put(st->s->out, b, &st->stats.blocked);
 	}
 
+	if (st->s->out != NULL) {
+		queue_finished(st->s->out);
+	}
 	return NULL;
 }
 
-void handle_tasks(std::map<zxy, std::vector<std::string>> &tasks, std::vector<std::map<std::string, layermap_entry>> &layermaps, sqlite3 *outdb, const char *outdir, std::vector<std::string> &header, std::map<std::string, std::vector<std::string>> &mapping, std::set<std::string> &exclude, int ifmatched, std::set<std::string> &keep_layers, std::set<std::string> &remove_layers, json_object *filter) {
-	pthread_t pthreads[CPUS];
-	std::vector<arg> args;
-
-	for (size_t i = 0; i < CPUS; i++) {
-		args.push_back(arg());
-
-		args[i].layermap = &layermaps[i];
-		args[i].header = &header;
-		args[i].mapping = &mapping;
-		args[i].exclude = &exclude;
-		args[i].keep_layers = &keep_layers;
-		args[i].remove_layers = &remove_layers;
-		args[i].ifmatched = ifmatched;
-		args[i].filter = filter;
-	}
-
-	size_t count = 0;
-	// This isn't careful about distributing tasks evenly across CPUs,
-	// but, from testing, it actually takes a little longer to do
-	// the proper allocation than is saved by perfectly balanced threads.
-	for (auto ai = tasks.begin(); ai != tasks.end(); ++ai) {
-		args[count].inputs.insert(*ai);
-		count = (count + 1) % CPUS;
-
-		if (ai == tasks.begin()) {
-			if (!quiet) {
-				fprintf(stderr, "%lld/%lld/%lld  \r", ai->first.z, ai->first.x, ai->first.y);
+void decompress_task(join_task *t, stage_thread *st) {
+	t->compressed.resize(t->inputs.size());
+
+	for (size_t i = 0; i < t->inputs.size(); i++) {
+		st->stats.bytes_in += t->inputs[i].size();
+
+		if (is_compressed(t->inputs[i])) {
+			std::string uncompressed;
+			decompress(t->inputs[i], uncompressed);
+
+			if (t->inputs.size() == 1) {
+				t->original.swap(t->inputs[i]);
 			}
+			t->inputs[i].swap(uncompressed);
+			t->compressed[i] = true;
 		}
+
+		st->stats.bytes_out += t->inputs[i].size();
 	}
+}
 
-	for (size_t i = 0; i < CPUS; i++) {
-		if (pthread_create(&pthreads[i], NULL, join_worker, &args[i]) != 0) {
-			perror("pthread_create");
-			exit(EXIT_FAILURE);
+void join_task_layers(join_task *t, stage_thread *st) {
+	pipeline *p = st->p;
+	mvt_tile tile;
+
+	bool copied = false;
+	for (size_t i = 0; i < t->inputs.size(); i++) {
+		st->stats.bytes_in += t->inputs[i].size();
+		copied = handle(t->inputs[i], t->compressed[i], t->tile.z, t->tile.x, t->tile.y, p->layermaps[st->index], *p->header, *p->mapping, *p->exclude, *p->keep_layers, *p->remove_layers, p->ifmatched, tile, p->filter);
+	}
+
+	// If the only input tile was copied unchanged, its bytes are
+	// already what the output tile would be
+	if (copied && t->inputs.size() == 1) {
+		if (t->compressed[0]) {
+			t->output.swap(t->original);
+		} else {
+			t->output.swap(t->inputs[0]);
 		}
 	}
 
-	for (size_t i = 0; i < CPUS; i++) {
-		void *retval;
+	std::vector<std::string>().swap(t->inputs);
+	std::string().swap(t->original);
 
-		if (pthread_join(pthreads[i], &retval) != 0) {
-			perror("pthread_join");
+	if (t->output.size() == 0) {
+		for (size_t i = 0; i < tile.layers.size(); i++) {
+			if (tile.layers[i].features.size() > 0 || tile.layers[i].raw.size() > 0) {
+				t->joined.layers.push_back(tile.layers[i]);
+			}
 		}
+	}
 
-		for (auto ai = args[i].outputs.begin(); ai != args[i].outputs.end(); ++ai) {
-			if (outdb != NULL) {
-				mbtiles_write_tile(outdb, ai->first.z, ai->first.x, ai->first.y, ai->second.data(), ai->second.size());
-			} else if (outdir != NULL) {
-				dir_write_tile(outdir, ai->first.z, ai->first.x, ai->first.y, ai->second);
+	st->stats.bytes_out += t->output.size();
+}
+
+void compress_task(join_task *t, stage_thread *st) {
+	if (t->output.size() == 0 && t->joined.layers.size() > 0) {
+		std::string pbf = t->joined.encode();
+		st->stats.bytes_in += pbf.size();
+
+		if (!pC) {
+			compress(pbf, t->output);
+		} else {
+			t->output.swap(pbf);
+		}
+	} else {
+		st->stats.bytes_in += t->output.size();
+	}
+	mvt_tile().layers.swap(t->joined.layers);
+
+	if (!pk && t->output.size() > 500000) {
+		fprintf(stderr, "Tile %lld/%lld/%lld size is %lld, >500000. Skipping this tile\n.", t->tile.z, t->tile.x, t->tile.y, (long long) t->output.size());
+		std::string().swap(t->output);
+	}
+
+	st->stats.bytes_out += t->output.size();
+}
+
+
+// Hand a batch that has been read to the first stage, once the tiles that
+// have been read and not yet written leave room for it in their share of
+// the memory limit. Their output can take as much memory again.
+static void send_batch(pipeline *p, join_batch *b, batch_queue *q, stage_stats *stats) {
+	if (!quiet && b->seq % CPUS == 0) {
+		fprintf(stderr, "%lld/%lld/%lld  \r", b->tasks[0].tile.z, b->tasks[0].tile.x, b->tasks[0].tile.y);
+	}
+
+	if (pthread_mutex_lock(&p->flight_lock) != 0) {
+		perror("pthread_mutex_lock");
+		exit(EXIT_FAILURE);
+	}
+	if (p->in_flight > 0 && p->in_flight + b->bytes > memory_limit / 2) {
+		double start = wall_time();
+		while (p->in_flight > 0 && p->in_flight + b->bytes > memory_limit / 2) {
+			if (pthread_cond_wait(&p->flight_changed, &p->flight_lock) != 0) {
+				perror("pthread_cond_wait");
+				exit(EXIT_FAILURE);
 			}
 		}
+		stats->blocked += wall_time() - start;
 	}
+	p->in_flight += b->bytes;
+	if (pthread_mutex_unlock(&p->flight_lock) != 0) {
+		perror("pthread_mutex_unlock");
+		exit(EXIT_FAILURE);
+	}
+
+	stats->tiles += b->tasks.size();
+	queue_put(q, b, &stats->blocked);
 }
 
-void decode(struct reader *readers, char *map, std::map<std::string, layermap_entry> &layermap, sqlite3 *outdb, const char *outdir, struct stats *st, std::vector<std::string> &header, std::map<std::string, std::vector<std::string>> &mapping, std::set<std::string> &exclude, int ifmatched, std::string &attribution, std::string &description, std::set<std::string> &keep_layers, std::set<std::string> &remove_layers, std::string &name, json_object *filter) {
-	std::vector<std::map<std::string, layermap_entry>> layermaps;
-	for (size_t i = 0; i < CPUS; i++) {
-		layermaps.push_back(std::map<std::string, layermap_entry>());
+// Orders the heap of readers so that the one with the lowest tile is on
+// top, and readers with the same tile come off in the order they were
+// put on, the same order as the sorted list of readers that decode()
+// is given and returns.
+struct reader_after {
+	bool operator()(reader const *a, reader const *b) const {
+		if (*b < *a) {
+			return true;
+		}
+		if (*a < *b) {
+			return false;
+		}
+		return a->seq > b->seq;
 	}
+};
+
+void decode(struct reader *readers, char *map, std::map<std::string, layermap_entry> &layermap, tile_writer *writer, struct stats *st, std::vector<std::string> &header, std::map<std::string, std::vector<std::string>> &mapping, std::set<std::string> &exclude, int ifmatched, std::string &attribution, std::string &description, std::set<std::string> &keep_layers, std::set<std::string> &remove_layers, std::string &name, json_object *filter) {
+	pipeline pl;
+	pl.header = &header;
+	pl.mapping = &mapping;
+	pl.exclude = &exclude;
+	pl.keep_layers = &keep_layers;
+	pl.remove_layers = &remove_layers;
+	pl.ifmatched = ifmatched;
+	pl.filter = filter;
+	pl.writer = writer;
+	pl.layermaps.resize(join_threads);
+
+	if (pthread_mutex_init(&pl.flight_lock, NULL) != 0) {
+		perror("pthread_mutex_init");
+		exit(EXIT_FAILURE);
+	}
+	if (pthread_cond_init(&pl.flight_changed, NULL) != 0) {
+		perror("pthread_cond_init");
+		exit(EXIT_FAILURE);
+	}
+
+	// The tiles are read here, in tile order, and then each goes through
+	// being decompressed, joined, compressed, and written, on as many
+	// threads as each of those stages has been given. The queues between
+	// stages are short enough that a stage that can't keep up holds back
+	// the ones before it instead of letting tiles pile up.
+	size_t queue_length = 4 * CPUS;
+	batch_queue read_queue(queue_length, 1);
+	batch_queue decompressed_queue(queue_length, decompress_threads);
+	batch_queue joined_queue(queue_length, join_threads);
+	batch_queue compressed_queue(queue_length, compress_threads);
+
+	std::vector<stage> stages(4);
+	stages[0].name = "decompress";
+	stages[0].work = decompress_task;
+	stages[0].in = &read_queue;
+	stages[0].out = &decompressed_queue;
+	stages[0].threads.resize(decompress_threads);
+
+	stages[1].name = "join";
+	stages[1].work = join_task_layers;
+	stages[1].in = &decompressed_queue;
+	stages[1].out = &joined_queue;
+	stages[1].threads.resize(join_threads);
+
+	stages[2].name = "compress";
+	stages[2].work = compress_task;
+	stages[2].in = &joined_queue;
+	stages[2].out = &compressed_queue;
+	stages[2].threads.resize(compress_threads);
+
+	stages[3].name = "write";
+	stages[3].work = NULL;
+	stages[3].in = &compressed_queue;
+	stages[3].out = NULL;
+	stages[3].threads.resize(1);
+
+	double start = wall_time();
+
+	for (size_t i = 0; i < stages.size(); i++) {
+		for (size_t j = 0; j < stages[i].threads.size(); j++) {
+			stage_thread &thread = stages[i].threads[j];
+			thread.s = &stages[i];
+			thread.p = &pl;
+			thread.index = j;
+
+			if (pthread_create(&thread.thread, NULL, run_stage, &thread) != 0) {
+				perror("pthread_create");
+				exit(EXIT_FAILURE);
+			}
+		}
+	}
+
+	stage_stats read_stats;
+	join_batch *batch = NULL;
+	unsigned long long batches_read = 0;
 
-	std::map<zxy, std::vector<std::string>> tasks;
 	double minlat = INT_MAX;
 	double minlon = INT_MAX;
 	double maxlat = INT_MIN;
 	double maxlon = INT_MIN;
 	int zoom_for_bbox = -1;
 
-	while (readers != NULL && readers->zoom < 32) {
-		reader *r = readers;
-		readers = readers->next;
-		r->next = NULL;
+	// k-way merge of the inputs, which are each sorted by tile
+	unsigned long long seq = 0;
+	std::priority_queue<reader *, std::vector<reader *>, reader_after> heap;
+	for (reader *r = readers; r != NULL; r = r->next) {
+		r->seq = seq++;
+		heap.push(r);
+	}
+
+	while (!heap.empty() && heap.top()->zoom < 32) {
+		reader *r = heap.top();
+		heap.pop();
+
 		if (r->zoom != zoom_for_bbox) {
 			// Only use highest zoom for bbox calculation
 			// to avoid z0 always covering the world
@@ -737,21 +1240,9 @@ void decode(struct reader *readers, char *map, std::map<std::string, layermap_en
 		maxlat = max(lat1, maxlat);
 		maxlon = max(lon2, maxlon);
 
-		if (r->zoom >= minzoom && r->zoom <= maxzoom) {
-			zxy tile = zxy(r->zoom, r->x, r->y);
-			if (tasks.count(tile) == 0) {
-				tasks.insert(std::pair<zxy, std::vector<std::string>>(tile, std::vector<std::string>()));
-			}
-			auto f = tasks.find(tile);
-			f->second.push_back(r->data);
-		}
-
-		if (readers == NULL || readers->zoom != r->zoom || readers->x != r->x || readers->y != r->y) {
-			if (tasks.size() > 100 * CPUS) {
-				handle_tasks(tasks, layermaps, outdb, outdir, header, mapping, exclude, ifmatched, keep_layers, remove_layers, filter);
-				tasks.clear();
-			}
-		}
+		zxy tile = zxy(r->zoom, r->x, r->y);
+		std::string data;
+		data.swap(r->data);
 
 		if (r->db != NULL) {
 			if (sqlite3_step(r->stmt) == SQLITE_ROW) {
@@ -759,10 +1250,10 @@ void decode(struct reader *readers, char *map, std::map<std::string, layermap_en
 				r->x = sqlite3_column_int(r->stmt, 1);
 				r->sorty = sqlite3_column_int(r->stmt, 2);
 				r->y = (1LL << r->zoom) - 1 - r->sorty;
-				const char *data = (const char *) sqlite3_column_blob(r->stmt, 3);
+				const char *blob = (const char *) sqlite3_column_blob(r->stmt, 3);
 				size_t len = sqlite3_column_bytes(r->stmt, 3);
 
-				r->data = std::string(data, len);
+				r->data = std::string(blob, len);
 			} else {
 				r->zoom = 32;
 			}
@@ -784,16 +1275,50 @@ void decode(struct reader *readers, char *map, std::map<std::string, layermap_en
 			}
 		}
 
-		struct reader **rr;
+		if (r->zoom == 32) {
+			// Finished readers are still ordered by their last tile
+			r->data = data;
+		}
 
-		for (rr = &readers; *rr != NULL; rr = &((*rr)->next)) {
-			if (*r < **rr) {
-				break;
+		r->seq = seq++;
+		heap.push(r);
+
+		if (tile.z >= minzoom && tile.z <= maxzoom) {
+			if (batch == NULL) {
+				batch = new join_batch;
+				batch->seq = batches_read++;
+				batch->bytes = 0;
 			}
+			if (batch->tasks.size() == 0 || batch->tasks.back().tile < tile || tile < batch->tasks.back().tile) {
+				batch->tasks.push_back(join_task(tile));
+			}
+			batch->bytes += data.size();
+			read_stats.bytes_out += data.size();
+			batch->tasks.back().inputs.push_back(std::move(data));
 		}
 
-		r->next = *rr;
-		*rr = r;
+		// Once all the inputs for this tile have been gathered, see if
+		// the batch is big enough to go on to be joined
+		reader *next = heap.top();
+		if (batch != NULL && (next->zoom != tile.z || next->x != tile.x || next->y != tile.y)) {
+			if (batch->tasks.size() >= BATCH_TILES || batch->bytes >= BATCH_BYTES || batch->bytes >= memory_limit / 2) {
+				send_batch(&pl, batch, &read_queue, &read_stats);
+				batch = NULL;
+			}
+		}
+	}
+
+	if (batch != NULL) {
+		send_batch(&pl, batch, &read_queue, &read_stats);
+	}
+
+	readers = NULL;
+	struct reader **rr = &readers;
+	while (!heap.empty()) {
+		*rr = heap.top();
+		heap.pop();
+		(*rr)->next = NULL;
+		rr = &((*rr)->next);
 	}
 
 	st->minlon = min(minlon, st->minlon);
@@ -801,8 +1326,41 @@ void decode(struct reader *readers, char *map, std::map<std::string, layermap_en
 	st->minlat = min(minlat, st->minlat);
 	st->maxlat = max(maxlat, st->maxlat);
 
-	handle_tasks(tasks, layermaps, outdb, outdir, header, mapping, exclude, ifmatched, keep_layers, remove_layers, filter);
-	layermap = merge_layermaps(layermaps);
+	queue_finished(&read_queue);
+	read_stats.busy = wall_time() - start - read_stats.blocked;
+
+	for (size_t i = 0; i < stages.size(); i++) {
+		for (size_t j = 0; j < stages[i].threads.size(); j++) {
+			void *retval;
+
+			if (pthread_join(stages[i].threads[j].thread, &retval) != 0) {
+				perror("pthread_join");
+			}
+		}
+	}
+
+	join_wall += wall_time() - start;
+
+	stage_report read_report;
+	read_report.name = "read";
+	read_report.threads = 1;
+	read_report.stats = read_stats;
+	stage_reports.push_back(read_report);
+
+	for (size_t i = 0; i < stages.size(); i++) {
+		stage_report sr;
+		sr.name = stages[i].name;
+		sr.threads = stages[i].threads.size();
+		for (size_t j = 0; j < stages[i].threads.size(); j++) {
+			sr.stats.add(stages[i].threads[j].stats);
+		}
+		stage_reports.push_back(sr);
+	}
+
+	pthread_cond_destroy(&pl.flight_changed);
+	pthread_mutex_destroy(&pl.flight_lock);
+
+	layermap = merge_layermaps(pl.layermaps);
 
 	struct reader *next;
 	for (struct reader *r = readers; r != NULL; r = next) {
@@ -1088,6 +1646,10 @@ int main(int argc, char **argv) {
 		{"no-tile-size-limit", no_argument, &pk, 1},
 		{"no-tile-compression", no_argument, &pC, 1},
 		{"no-tile-stats", no_argument, &pg, 1},
+		{"deduplicate-tiles", no_argument, &deduplicate, 1},
+		{"memory-limit", required_argument, 0, 'm'},
+		{"report-thread-utilization", no_argument, &report_thread_utilization, 1},
+		{"stage-threads", required_argument, 0, 'T'},
 
 		{0, 0, 0, 0},
 	};
@@ -1144,6 +1706,17 @@ int main(int argc, char **argv) {
 			maxzoom = atoi(optarg);
 			break;
 
+		case 'm':
+			memory_limit = atoll(optarg) * 1024 * 1024;
+			break;
+
+		case 'T':
+			if (sscanf(optarg, "%zu,%zu,%zu", &decompress_threads, &join_threads, &compress_threads) != 3) {
+				fprintf(stderr, "%s: --stage-threads needs three thread counts, for decompressing, joining, and compressing: %s\n", argv[0], optarg);
+				exit(EXIT_FAILURE);
+			}
+			break;
+
 		case 'Z':
 			minzoom = atoi(optarg);
 			break;
@@ -1204,6 +1777,16 @@ int main(int argc, char **argv) {
 		usage(argv);
 	}
 
+	if (decompress_threads == 0) {
+		decompress_threads = CPUS;
+	}
+	if (join_threads == 0) {
+		join_threads = CPUS;
+	}
+	if (compress_threads == 0) {
+		compress_threads = CPUS;
+	}
+
 	if (out_mbtiles == NULL && out_dir == NULL) {
 		fprintf(stderr, "%s: must specify -o out.mbtiles or -e directory\n", argv[0]);
 		usage(argv);
@@ -1218,7 +1801,7 @@ int main(int argc, char **argv) {
 		if (force) {
 			unlink(out_mbtiles);
 		}
-		outdb = mbtiles_open(out_mbtiles, argv, 0);
+		outdb = mbtiles_open(out_mbtiles, argv, 0, deduplicate);
 	}
 	if (out_dir != NULL) {
 		if (force) {
@@ -1253,7 +1836,13 @@ int main(int argc, char **argv) {
 		*rr = r;
 	}
 
-	decode(readers, csv, layermap, outdb, out_dir, &st, header, mapping, exclude, ifmatched, attribution, description, keep_layers, remove_layers, name, filter);
+	tile_writer *writer = tile_writer_start(outdb, out_dir, deduplicate);
+	decode(readers, csv, layermap, writer, &st, header, mapping, exclude, ifmatched, attribution, description, keep_layers, remove_layers, name, filter);
+	tile_writer_finish(writer);
+
+	if (report_thread_utilization) {
+		report_utilization();
+	}
 
 	if (set_attribution.size() != 0) {
 		attribution = set_attribution;
@@ -10,6 +10,7 @@
 #include <map>
 #include <set>
 #include <algorithm>
+#include <functional>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -24,6 +25,7 @@
 #include <pthread.h>
 #include <errno.h>
 #include <time.h>
+#include <sys/time.h>
 #include <fcntl.h>
 #include <sys/wait.h>
 #include "mvt.hpp"
@@ -37,6 +39,8 @@
 #include "options.hpp"
 #include "main.hpp"
 #include "write_json.hpp"
+#include "blockio.hpp"
+#include "threadpool.hpp"
 
 extern "C" {
 #include "jsonpull/jsonpull.h"
@@ -49,8 +53,24 @@ extern "C" {
 #define XSTRINGIFY(s) STRINGIFY(s)
 #define STRINGIFY(s) #s
 
-pthread_mutex_t db_lock = PTHREAD_MUTEX_INITIALIZER;
-pthread_mutex_t var_lock = PTHREAD_MUTEX_INITIALIZER;
+// The progress last shown by any tiling thread, in tenths of a percent.
+// Only the thread that advances it prints, so there is no need to lock.
+static volatile long long reported_progress = -1;
+
+static void report_progress(double progress, int z, unsigned tx, unsigned ty) {
+	long long tenths = llround(progress * 10);
+	long long prev = reported_progress;
+
+	while (tenths > prev) {
+		if (__sync_bool_compare_and_swap(&reported_progress, prev, tenths)) {
+			if (!quiet) {
+				fprintf(stderr, "  %3.1f%%  %d/%u/%u  \r", progress, z, tx, ty);
+			}
+			break;
+		}
+		prev = reported_progress;
+	}
+}
 
 std::vector<mvt_geometry> to_feature(drawvec &geom) {
 	std::vector<mvt_geometry> out;
@@ -205,7 +225,7 @@ int metacmp(int m1, const std::vector<long long> &keys1, const std::vector<long
 	}
 }
 
-void rewrite(drawvec &geom, int z, int nextzoom, int maxzoom, long long *bbox, unsigned tx, unsigned ty, int buffer, int line_detail, int *within, long long *geompos, FILE **geomfile, const char *fname, signed char t, int layer, long long metastart, signed char feature_minzoom, int child_shards, int max_zoom_increment, long long seq, int tippecanoe_minzoom, int tippecanoe_maxzoom, int segment, unsigned *initial_x, unsigned *initial_y, int m, std::vector<long long> &metakeys, std::vector<long long> &metavals, bool has_id, unsigned long long id, unsigned long long index, long long extent) {
+void rewrite(drawvec &geom, int z, int nextzoom, int maxzoom, long long *bbox, unsigned tx, unsigned ty, int buffer, int line_detail, int *within, long long *geompos, FILE **geomfile, struct block_writer **geomwriters, const char *fname, signed char t, int layer, long long metastart, signed char feature_minzoom, int child_shards, int max_zoom_increment, long long seq, int tippecanoe_minzoom, int tippecanoe_maxzoom, int segment, unsigned *initial_x, unsigned *initial_y, int m, std::vector<long long> &metakeys, std::vector<long long> &metavals, bool has_id, unsigned long long id, unsigned long long index, long long extent) {
 	if (geom.size() > 0 && (nextzoom <= maxzoom || additional[A_EXTEND_ZOOMS])) {
 		int xo, yo;
 		int span = 1 << (nextzoom - z);
@@ -274,6 +294,8 @@ void rewrite(drawvec &geom, int z, int nextzoom, int maxzoom, long long *bbox, u
 					(child_shards - 1);
 
 				{
+					long long start = geompos[j];
+
 					if (!within[j]) {
 						serialize_int(geomfile[j], nextzoom, &geompos[j], fname);
 						serialize_uint(geomfile[j], tx * span + xo, &geompos[j], fname);
@@ -307,6 +329,9 @@ void rewrite(drawvec &geom, int z, int nextzoom, int maxzoom, long long *bbox, u
 					}
 
 					serialize_feature(geomfile[j], &sf, &geompos[j], fname, initial_x[segment] >> geometry_scale, initial_y[segment] >> geometry_scale, true);
+					if (geomwriters != NULL) {
+						block_writer_feature(geomwriters[j], geompos[j] - start);
+					}
 				}
 			}
 		}
@@ -406,6 +431,9 @@ void *partial_feature_worker(void *v) {
 			area = get_mp_area(geom);
 		}
 
+		drawarrays arrays;
+		bool in_arrays = false;
+
 		if ((t == VT_LINE || t == VT_POLYGON) && !(prevent[P_SIMPLIFY] || (z == maxzoom && prevent[P_SIMPLIFY_LOW]) || (z < maxzoom && additional[A_GRID_LOW_ZOOMS]))) {
 			if (1 /* !reduced */) {  // XXX why did this not simplify if reduced?
 				if (t == VT_LINE) {
@@ -417,7 +445,16 @@ void *partial_feature_worker(void *v) {
 					already_marked = true;
 				}
 
-				if (!already_marked) {
+				if (!already_marked && additional[A_GEOMETRY_ARRAYS]) {
+					// Kept as arrays through scaling, unless reordering needs them back
+					arrays = drawarrays(geom);
+					drawarrays ngeom = simplify_lines(arrays, z, line_detail, !(prevent[P_CLIPPING] || prevent[P_DUPLICATION]), (*partials)[i].simplification, t == VT_POLYGON ? 4 : 0);
+
+					if (t != VT_POLYGON || ngeom.size() >= 3) {
+						arrays = std::move(ngeom);
+					}
+					in_arrays = true;
+				} else if (!already_marked) {
 					drawvec ngeom = simplify_lines(geom, z, line_detail, !(prevent[P_CLIPPING] || prevent[P_DUPLICATION]), (*partials)[i].simplification, t == VT_POLYGON ? 4 : 0);
 
 					if (t != VT_POLYGON || ngeom.size() >= 3) {
@@ -434,10 +471,19 @@ void *partial_feature_worker(void *v) {
 #endif
 
 		if (t == VT_LINE && additional[A_REVERSE]) {
+			if (in_arrays) {
+				geom = arrays.to_drawvec();
+				in_arrays = false;
+			}
 			geom = reorder_lines(geom);
 		}
 
-		to_tile_scale(geom, z, line_detail);
+		if (in_arrays) {
+			to_tile_scale(arrays, z, line_detail);
+			geom = arrays.to_drawvec();
+		} else {
+			to_tile_scale(geom, z, line_detail);
+		}
 
 		std::vector<drawvec> geoms;
 		geoms.push_back(geom);
@@ -1131,18 +1177,121 @@ long long choose_minextent(std::vector<long long> &extents, double f) {
 	return extents[(extents.size() - 1) * (1 - f)];
 }
 
+// A rough guess at how many bytes a feature will take up in the tile.
+// It only has to be proportional to the real size, because it gets scaled
+// by how the guesses for the previous attempt compared to the encoded tile.
+static long long feature_cost(serial_feature const &sf) {
+	return 4 + 3 * sf.geometry.size() + 2 * (sf.keys.size() + sf.full_keys.size());
+}
+
+// How many bytes the uncompressed tile can probably be and still fit once it is
+// compressed. Smaller tiles don't compress as well, so this assumes the
+// compressed size goes as a power of the uncompressed size, guessing the power
+// the first time and then fitting it to the attempts that have been made.
+static double predict_budget(double raw, double compressed, double prev_raw, double prev_compressed) {
+	double power = 0.95;
+	if (prevent[P_TILE_COMPRESSION]) {
+		power = 1;
+	} else if (prev_raw > raw && prev_compressed > compressed) {
+		power = log(prev_compressed / compressed) / log(prev_raw / raw);
+		if (power < 0.5) {
+			power = 0.5;
+		} else if (power > 1) {
+			power = 1;
+		}
+	}
+
+	return raw * pow(max_tile_size * 0.95 / compressed, 1 / power);
+}
+
+// Like choose_mingap(), but instead of a fraction of the features,
+// find the gap that keeps the sparsest features whose costs add up to the budget
+unsigned long long choose_mingap(std::vector<unsigned long long> const &indices, std::vector<long long> const &costs, double budget, size_t *kept) {
+	unsigned long long bot = ULLONG_MAX;
+	unsigned long long top = 0;
+
+	for (size_t i = 0; i < indices.size(); i++) {
+		if (i > 0 && indices[i] >= indices[i - 1]) {
+			if (indices[i] - indices[i - 1] > top) {
+				top = indices[i] - indices[i - 1];
+			}
+			if (indices[i] - indices[i - 1] < bot) {
+				bot = indices[i] - indices[i - 1];
+			}
+		}
+	}
+
+	while (top - bot > 2) {
+		unsigned long long guess = bot / 2 + top / 2;
+		double cost = 0;
+		unsigned long long prev = 0;
+
+		for (size_t i = 0; i < indices.size(); i++) {
+			if (indices[i] - prev >= guess) {
+				cost += costs[i];
+				prev = indices[i];
+			}
+		}
+
+		if (cost > budget) {
+			bot = guess;
+		} else if (cost < budget) {
+			top = guess;
+		} else {
+			top = guess;
+			break;
+		}
+	}
+
+	*kept = 0;
+	unsigned long long prev = 0;
+	for (size_t i = 0; i < indices.size(); i++) {
+		if (indices[i] - prev >= top) {
+			(*kept)++;
+			prev = indices[i];
+		}
+	}
+
+	return top;
+}
+
+// Like choose_minextent(), but keep the biggest features whose costs add up to the budget
+long long choose_minextent(std::vector<long long> const &extents, std::vector<long long> const &costs, double budget, size_t *kept) {
+	std::vector<std::pair<long long, long long>> sized;
+	for (size_t i = 0; i < extents.size(); i++) {
+		sized.push_back(std::pair<long long, long long>(extents[i], costs[i]));
+	}
+	std::sort(sized.begin(), sized.end(), std::greater<std::pair<long long, long long>>());
+
+	double cost = 0;
+	for (size_t i = 0; i < sized.size(); i++) {
+		cost += sized[i].second;
+		if (cost > budget) {
+			*kept = i;
+			return sized[i].first;
+		}
+	}
+
+	*kept = sized.size() - 1;
+	return sized[sized.size() - 1].first;
+}
+
+struct tile_scheduler;
+
 struct write_tile_args {
 	struct task *tasks;
+	struct tile_scheduler *scheduler;
 	char *metabase;
 	char *stringpool;
 	int min_detail;
 	int basezoom;
-	sqlite3 *outdb;
-	const char *outdir;
+	struct tile_writer *writer;
 	double droprate;
 	int buffer;
 	const char *fname;
 	FILE **geomfile;
+	struct block_writer **geomwriters;  // compressing into geomfile, or NULL if it is plain
+	std::vector<block_entry> *geom_index;  // where each of geomfd's compressed blocks are, or NULL if plain
 	double todo;
 	volatile long long *along;
 	double gamma;
@@ -1150,14 +1299,14 @@ struct write_tile_args {
 	int child_shards;
 	int *geomfd;
 	off_t *geom_size;
-	volatile unsigned *midx;
-	volatile unsigned *midy;
+	long long most;	 // the largest maxzoom tile this thread has written, or -1,
+	unsigned midx;	 // and where it was
+	unsigned midy;
 	int maxzoom;
 	int minzoom;
 	int full_detail;
 	int low_detail;
 	double simplification;
-	volatile long long *most;
 	long long *meta_off;
 	long long *pool_off;
 	unsigned *initial_x;
@@ -1179,8 +1328,33 @@ struct write_tile_args {
 	bool still_dropping;
 	int wrote_zoom;
 	size_t tiling_seg;
+	std::vector<long long> *child_starts;  // where each child tile begins within each of geomfile
+	long long *child_pos;		       // the current length of each of geomfile
+	const char *tmpdir;
+	FILE *stolen_geom;  // scratch copy of tiles taken from other threads' shards
+	long long tiles;
+	long long stolen;
+	long long retried;  // how many tiles had to be made again to fit,
+	long long retries;  // and how many extra attempts they took
+	double busy;
+	double first;
+	double last;
+	struct pipeline *pipeline;
+	size_t generation;
+	size_t thread;
 };
 
+static void note_retries(write_tile_args *arg, int z, unsigned tx, unsigned ty, long long attempts) {
+	if (attempts > 1) {
+		arg->retried++;
+		arg->retries += attempts - 1;
+
+		if (!quiet && (additional[A_PREDICT_TILE_SIZE] || additional[A_REPORT_UTILIZATION])) {
+			fprintf(stderr, "tile %d/%u/%u fit after %lld attempts    \n", z, tx, ty, attempts);
+		}
+	}
+}
+
 bool clip_to_tile(serial_feature &sf, int z, long long buffer) {
 	int quick = quick_check(sf.bbox, z, buffer);
 	if (quick == 0) {
@@ -1257,7 +1431,7 @@ bool clip_to_tile(serial_feature &sf, int z, long long buffer) {
 	return false;
 }
 
-serial_feature next_feature(FILE *geoms, long long *geompos_in, char *metabase, long long *meta_off, int z, unsigned tx, unsigned ty, unsigned *initial_x, unsigned *initial_y, long long *original_features, long long *unclipped_features, int nextzoom, int maxzoom, int minzoom, int max_zoom_increment, size_t pass, size_t passes, volatile long long *along, long long alongminus, int buffer, int *within, bool *first_time, int line_detail, FILE **geomfile, long long *geompos, volatile double *oprogress, double todo, const char *fname, int child_shards) {
+serial_feature next_feature(FILE *geoms, long long *geompos_in, char *metabase, long long *meta_off, int z, unsigned tx, unsigned ty, unsigned *initial_x, unsigned *initial_y, long long *original_features, long long *unclipped_features, int nextzoom, int maxzoom, int minzoom, int max_zoom_increment, size_t pass, size_t passes, volatile long long *along, long long alongminus, int buffer, int *within, bool *first_time, int line_detail, FILE **geomfile, struct block_writer **geomwriters, long long *geompos, double todo, const char *fname, int child_shards) {
 	while (1) {
 		serial_feature sf = deserialize_feature(geoms, geompos_in, metabase, meta_off, z, tx, ty, initial_x, initial_y);
 		if (sf.t < 0) {
@@ -1265,12 +1439,7 @@ serial_feature next_feature(FILE *geoms, long long *geompos_in, char *metabase,
 		}
 
 		double progress = floor(((((*geompos_in + *along - alongminus) / (double) todo) + (pass - (2 - passes))) / passes + z) / (maxzoom + 1) * 1000) / 10;
-		if (progress >= *oprogress + 0.1) {
-			if (!quiet) {
-				fprintf(stderr, "  %3.1f%%  %d/%u/%u  \r", progress, z, tx, ty);
-			}
-			*oprogress = progress;
-		}
+		report_progress(progress, z, tx, ty);
 
 		(*original_features)++;
 
@@ -1284,7 +1453,7 @@ serial_feature next_feature(FILE *geoms, long long *geompos_in, char *metabase,
 
 		if (*first_time && pass == 1) { /* only write out the next zoom once, even if we retry */
 			if (sf.tippecanoe_maxzoom == -1 || sf.tippecanoe_maxzoom >= nextzoom) {
-				rewrite(sf.geometry, z, nextzoom, maxzoom, sf.bbox, tx, ty, buffer, line_detail, within, geompos, geomfile, fname, sf.t, sf.layer, sf.metapos, sf.feature_minzoom, child_shards, max_zoom_increment, sf.seq, sf.tippecanoe_minzoom, sf.tippecanoe_maxzoom, sf.segment, initial_x, initial_y, sf.m, sf.keys, sf.values, sf.has_id, sf.id, sf.index, sf.extent);
+				rewrite(sf.geometry, z, nextzoom, maxzoom, sf.bbox, tx, ty, buffer, line_detail, within, geompos, geomfile, geomwriters, fname, sf.t, sf.layer, sf.metapos, sf.feature_minzoom, child_shards, max_zoom_increment, sf.seq, sf.tippecanoe_minzoom, sf.tippecanoe_maxzoom, sf.segment, initial_x, initial_y, sf.m, sf.keys, sf.values, sf.has_id, sf.id, sf.index, sf.extent);
 			}
 		}
 
@@ -1331,8 +1500,8 @@ struct run_prefilter_args {
 	bool *first_time;
 	int line_detail;
 	FILE **geomfile;
+	struct block_writer **geomwriters;
 	long long *geompos;
-	volatile double *oprogress;
 	double todo;
 	const char *fname;
 	int child_shards;
@@ -1346,7 +1515,7 @@ void *run_prefilter(void *v) {
 	run_prefilter_args *rpa = (run_prefilter_args *) v;
 
 	while (1) {
-		serial_feature sf = next_feature(rpa->geoms, rpa->geompos_in, rpa->metabase, rpa->meta_off, rpa->z, rpa->tx, rpa->ty, rpa->initial_x, rpa->initial_y, rpa->original_features, rpa->unclipped_features, rpa->nextzoom, rpa->maxzoom, rpa->minzoom, rpa->max_zoom_increment, rpa->pass, rpa->passes, rpa->along, rpa->alongminus, rpa->buffer, rpa->within, rpa->first_time, rpa->line_detail, rpa->geomfile, rpa->geompos, rpa->oprogress, rpa->todo, rpa->fname, rpa->child_shards);
+		serial_feature sf = next_feature(rpa->geoms, rpa->geompos_in, rpa->metabase, rpa->meta_off, rpa->z, rpa->tx, rpa->ty, rpa->initial_x, rpa->initial_y, rpa->original_features, rpa->unclipped_features, rpa->nextzoom, rpa->maxzoom, rpa->minzoom, rpa->max_zoom_increment, rpa->pass, rpa->passes, rpa->along, rpa->alongminus, rpa->buffer, rpa->within, rpa->first_time, rpa->line_detail, rpa->geomfile, rpa->geomwriters, rpa->geompos, rpa->todo, rpa->fname, rpa->child_shards);
 		if (sf.t < 0) {
 			break;
 		}
@@ -1397,13 +1566,12 @@ void *run_prefilter(void *v) {
 	return NULL;
 }
 
-long long write_tile(FILE *geoms, long long *geompos_in, char *metabase, char *stringpool, int z, unsigned tx, unsigned ty, int detail, int min_detail, int basezoom, sqlite3 *outdb, const char *outdir, double droprate, int buffer, const char *fname, FILE **geomfile, int minzoom, int maxzoom, double todo, volatile long long *along, long long alongminus, double gamma, int child_shards, long long *meta_off, long long *pool_off, unsigned *initial_x, unsigned *initial_y, volatile int *running, double simplification, std::vector<std::map<std::string, layermap_entry>> *layermaps, std::vector<std::vector<std::string>> *layer_unmaps, size_t tiling_seg, size_t pass, size_t passes, unsigned long long mingap, long long minextent, double fraction, const char *prefilter, const char *postfilter, write_tile_args *arg) {
+long long write_tile(FILE *geoms, long long *geompos_in, char *metabase, char *stringpool, int z, unsigned tx, unsigned ty, int detail, int min_detail, int basezoom, tile_writer *writer, double droprate, int buffer, const char *fname, FILE **geomfile, int minzoom, int maxzoom, double todo, volatile long long *along, long long alongminus, double gamma, int child_shards, long long *meta_off, long long *pool_off, unsigned *initial_x, unsigned *initial_y, volatile int *running, double simplification, std::vector<std::map<std::string, layermap_entry>> *layermaps, std::vector<std::vector<std::string>> *layer_unmaps, size_t tiling_seg, size_t pass, size_t passes, unsigned long long mingap, long long minextent, double fraction, const char *prefilter, const char *postfilter, write_tile_args *arg) {
 	int line_detail;
 	double merge_fraction = 1;
 	double mingap_fraction = 1;
 	double minextent_fraction = 1;
 
-	static volatile double oprogress = 0;
 	long long og = *geompos_in;
 
 	// XXX is there a way to do this without floating point?
@@ -1428,12 +1596,28 @@ long long write_tile(FILE *geoms, long long *geompos_in, char *metabase, char *s
 
 	bool has_polygons = false;
 
+	// The features that survive clipping, as the first retry read them.
+	// They don't depend on the detail or on which features get dropped,
+	// so if the tile has to be tried yet again, they don't have to be read,
+	// clipped, or passed through the prefilter again. Most tiles fit the
+	// first time, so that attempt streams the features and keeps none.
+	std::vector<serial_feature> cached_features;
+	bool cached = false;
+	long long cached_original_features = 0;
+	long long cached_unclipped_features = 0;
+
 	bool first_time = true;
+	long long attempts = 0;
+	double prev_raw = 0, prev_compressed = 0;  // the sizes of the last attempt, for predicting the next
 	// This only loops if the tile data didn't fit, in which case the detail
-	// goes down and the progress indicator goes backward for the next try.
-	for (line_detail = detail; line_detail >= min_detail || line_detail == detail; line_detail--, oprogress = 0) {
+	// goes down for the next try. The shared progress indicator stays where
+	// it is until the retry reads further into the tile than any thread has
+	// already reported.
+	for (line_detail = detail; line_detail >= min_detail || line_detail == detail; line_detail--) {
 		long long count = 0;
 		double accum_area = 0;
+		attempts++;
+		bool caching = !cached && attempts > 1;
 
 		double fraction_accum = 0;
 
@@ -1449,6 +1633,9 @@ long long write_tile(FILE *geoms, long long *geompos_in, char *metabase, char *s
 		std::map<std::string, std::vector<coalesce>> layers;
 		std::vector<unsigned long long> indices;
 		std::vector<long long> extents;
+		std::vector<long long> index_costs;   // feature_cost() of each of the indices
+		std::vector<long long> extent_costs;  // and of each of the extents
+		long long kept_cost = 0;	      // of the features that made it into the tile
 		std::vector<serial_feature> coalesced_geometry;
 
 		int within[child_shards];
@@ -1456,7 +1643,7 @@ long long write_tile(FILE *geoms, long long *geompos_in, char *metabase, char *s
 		memset(within, '\0', child_shards * sizeof(int));
 		memset(geompos, '\0', child_shards * sizeof(long long));
 
-		if (*geompos_in != og) {
+		if (!cached && *geompos_in != og) {
 			if (fseek(geoms, og, SEEK_SET) != 0) {
 				perror("fseek geom");
 				exit(EXIT_FAILURE);
@@ -1467,12 +1654,12 @@ long long write_tile(FILE *geoms, long long *geompos_in, char *metabase, char *s
 		int prefilter_write = -1, prefilter_read = -1;
 		pid_t prefilter_pid = 0;
 		FILE *prefilter_fp = NULL;
-		pthread_t prefilter_writer;
+		struct pool_task *prefilter_writer = NULL;
 		run_prefilter_args rpa;  // here so it stays in scope until joined
 		FILE *prefilter_read_fp = NULL;
 		json_pull *prefilter_jp = NULL;
 
-		if (prefilter != NULL) {
+		if (prefilter != NULL && !cached) {
 			setup_filter(prefilter, &prefilter_write, &prefilter_read, &prefilter_pid, z, tx, ty);
 			prefilter_fp = fdopen(prefilter_write, "w");
 			if (prefilter_fp == NULL) {
@@ -1504,8 +1691,8 @@ long long write_tile(FILE *geoms, long long *geompos_in, char *metabase, char *s
 			rpa.first_time = &first_time;
 			rpa.line_detail = line_detail;
 			rpa.geomfile = geomfile;
+			rpa.geomwriters = arg->geomwriters;
 			rpa.geompos = geompos;
-			rpa.oprogress = &oprogress;
 			rpa.todo = todo;
 			rpa.fname = fname;
 			rpa.child_shards = child_shards;
@@ -1514,10 +1701,7 @@ long long write_tile(FILE *geoms, long long *geompos_in, char *metabase, char *s
 			rpa.stringpool = stringpool;
 			rpa.pool_off = pool_off;
 
-			if (pthread_create(&prefilter_writer, NULL, run_prefilter, &rpa) != 0) {
-				perror("pthread_create (prefilter writer)");
-				exit(EXIT_FAILURE);
-			}
+			prefilter_writer = task_start_concurrent(run_prefilter, &rpa);
 
 			prefilter_read_fp = fdopen(prefilter_read, "r");
 			if (prefilter_read_fp == NULL) {
@@ -1527,25 +1711,47 @@ long long write_tile(FILE *geoms, long long *geompos_in, char *metabase, char *s
 			prefilter_jp = json_begin_file(prefilter_read_fp);
 		}
 
+		size_t cache_next = 0;
 		while (1) {
-			serial_feature sf;
+			serial_feature fresh;
+			serial_feature *sfp = &fresh;
 
-			if (prefilter == NULL) {
-				sf = next_feature(geoms, geompos_in, metabase, meta_off, z, tx, ty, initial_x, initial_y, &original_features, &unclipped_features, nextzoom, maxzoom, minzoom, max_zoom_increment, pass, passes, along, alongminus, buffer, within, &first_time, line_detail, geomfile, geompos, &oprogress, todo, fname, child_shards);
+			if (cached) {
+				if (cache_next >= cached_features.size()) {
+					break;
+				}
+				sfp = &cached_features[cache_next++];
 			} else {
-				sf = parse_feature(prefilter_jp, z, tx, ty, layermaps, tiling_seg, layer_unmaps, postfilter != NULL);
-			}
+				if (prefilter == NULL) {
+					fresh = next_feature(geoms, geompos_in, metabase, meta_off, z, tx, ty, initial_x, initial_y, &original_features, &unclipped_features, nextzoom, maxzoom, minzoom, max_zoom_increment, pass, passes, along, alongminus, buffer, within, &first_time, line_detail, geomfile, arg->geomwriters, geompos, todo, fname, child_shards);
+				} else {
+					fresh = parse_feature(prefilter_jp, z, tx, ty, layermaps, tiling_seg, layer_unmaps, postfilter != NULL);
+				}
 
-			if (sf.t < 0) {
-				break;
+				if (fresh.t < 0) {
+					break;
+				}
+
+				if (caching) {
+					cached_features.push_back(std::move(fresh));
+					sfp = &cached_features.back();
+				}
 			}
 
+			// Left as it is, in case the cache needs it for another attempt
+			const serial_feature &sf = *sfp;
+
 			if (gamma > 0) {
 				if (manage_gap(sf.index, &previndex, scale, gamma, &gap)) {
 					continue;
 				}
 			}
 
+			long long cost = 0;
+			if (additional[A_PREDICT_TILE_SIZE]) {
+				cost = feature_cost(sf);
+			}
+
 			double coalesced_area = 0;
 			for (size_t i = 0; i < coalesced_geometry.size(); i++) {
 				if (coalesced_geometry[i].t == sf.t) {
@@ -1555,29 +1761,33 @@ long long write_tile(FILE *geoms, long long *geompos_in, char *metabase, char *s
 
 			if (additional[A_DROP_DENSEST_AS_NEEDED]) {
 				indices.push_back(sf.index);
+				index_costs.push_back(cost);
 				if (sf.index - merge_previndex < mingap) {
 					continue;
 				}
 			}
 			if (additional[A_DROP_SMALLEST_AS_NEEDED]) {
 				extents.push_back(sf.extent);
+				extent_costs.push_back(cost);
 				if (sf.extent + coalesced_area <= minextent && sf.t != VT_POINT) {
 					continue;
 				}
 			}
 			if (additional[A_COALESCE_SMALLEST_AS_NEEDED]) {
 				extents.push_back(sf.extent);
+				extent_costs.push_back(cost);
 				if (sf.extent + coalesced_area <= minextent) {
 					coalesced_geometry.push_back(sf);
 					continue;
 				}
 			}
 
+			drawvec geometry = sf.geometry;
 			if (coalesced_geometry.size() != 0) {
 				for (ssize_t i = coalesced_geometry.size() - 1; i >= 0; i--) {
 					if (coalesced_geometry[i].t == sf.t && coalesced_geometry[i].layer == sf.layer) {
 						for (size_t j = 0; j < coalesced_geometry[i].geometry.size(); j++) {
-							sf.geometry.push_back(coalesced_geometry[i].geometry[j]);
+							geometry.push_back(coalesced_geometry[i].geometry[j]);
 						}
 						coalesced_geometry.erase(coalesced_geometry.begin() + i);
 					}
@@ -1605,14 +1815,14 @@ long long write_tile(FILE *geoms, long long *geompos_in, char *metabase, char *s
 			bool reduced = false;
 			if (sf.t == VT_POLYGON) {
 				if (!prevent[P_TINY_POLYGON_REDUCTION] && !additional[A_GRID_LOW_ZOOMS]) {
-					sf.geometry = reduce_tiny_poly(sf.geometry, z, line_detail, &reduced, &accum_area);
+					geometry = reduce_tiny_poly(geometry, z, line_detail, &reduced, &accum_area);
 				}
 				has_polygons = true;
 			}
 
-			if (sf.geometry.size() > 0) {
+			if (geometry.size() > 0) {
 				partial p;
-				p.geoms.push_back(sf.geometry);
+				p.geoms.push_back(std::move(geometry));
 				p.layer = sf.layer;
 				p.m = sf.m;
 				p.t = sf.t;
@@ -1634,6 +1844,7 @@ long long write_tile(FILE *geoms, long long *geompos_in, char *metabase, char *s
 				p.index = sf.index;
 				p.renamed = -1;
 				partials.push_back(p);
+				kept_cost += cost;
 			}
 
 			merge_previndex = sf.index;
@@ -1653,7 +1864,7 @@ long long write_tile(FILE *geoms, long long *geompos_in, char *metabase, char *s
 			}
 		}
 
-		if (prefilter != NULL) {
+		if (prefilter != NULL && !cached) {
 			json_end(prefilter_jp);
 			if (fclose(prefilter_read_fp) != 0) {
 				perror("close output from prefilter");
@@ -1669,11 +1880,16 @@ long long write_tile(FILE *geoms, long long *geompos_in, char *metabase, char *s
 					break;
 				}
 			}
-			void *ret;
-			if (pthread_join(prefilter_writer, &ret) != 0) {
-				perror("pthread_join prefilter writer");
-				exit(EXIT_FAILURE);
-			}
+			task_join(prefilter_writer);
+		}
+
+		if (cached) {
+			original_features = cached_original_features;
+			unclipped_features = cached_unclipped_features;
+		} else if (caching) {
+			cached_original_features = original_features;
+			cached_unclipped_features = unclipped_features;
+			cached = true;
 		}
 
 		first_time = false;
@@ -1688,7 +1904,7 @@ long long write_tile(FILE *geoms, long long *geompos_in, char *metabase, char *s
 			tasks = 1;
 		}
 
-		pthread_t pthreads[tasks];
+		struct pool_task *workers[tasks];
 		partial_arg args[tasks];
 		for (int i = 0; i < tasks; i++) {
 			args[i].task = i;
@@ -1696,10 +1912,7 @@ long long write_tile(FILE *geoms, long long *geompos_in, char *metabase, char *s
 			args[i].partials = &partials;
 
 			if (tasks > 1) {
-				if (pthread_create(&pthreads[i], NULL, partial_feature_worker, &args[i]) != 0) {
-					perror("pthread_create");
-					exit(EXIT_FAILURE);
-				}
+				workers[i] = task_start(partial_feature_worker, &args[i]);
 			} else {
 				partial_feature_worker(&args[i]);
 			}
@@ -1707,11 +1920,7 @@ long long write_tile(FILE *geoms, long long *geompos_in, char *metabase, char *s
 
 		if (tasks > 1) {
 			for (int i = 0; i < tasks; i++) {
-				void *retval;
-
-				if (pthread_join(pthreads[i], &retval) != 0) {
-					perror("pthread_join");
-				}
+				task_join(workers[i]);
 			}
 		}
 
@@ -1769,6 +1978,11 @@ long long write_tile(FILE *geoms, long long *geompos_in, char *metabase, char *s
 			if (within[j]) {
 				serialize_byte(geomfile[j], -2, &geompos[j], fname);
 				within[j] = 0;
+
+				// Remember where the child tile is so that the next zoom level
+				// can schedule it independently of the rest of the shard
+				arg->child_starts[j].push_back(arg->child_pos[j]);
+				arg->child_pos[j] += geompos[j];
 			}
 		}
 
@@ -1905,12 +2119,7 @@ long long write_tile(FILE *geoms, long long *geompos_in, char *metabase, char *s
 		}
 
 		double progress = floor(((((*geompos_in + *along - alongminus) / (double) todo) + (pass - (2 - passes))) / passes + z) / (maxzoom + 1) * 1000) / 10;
-		if (progress >= oprogress + 0.1) {
-			if (!quiet) {
-				fprintf(stderr, "  %3.1f%%  %d/%u/%u  \r", progress, z, tx, ty);
-			}
-			oprogress = progress;
-		}
+		report_progress(progress, z, tx, ty);
 
 		if (totalsize > 0 && tile.layers.size() > 0) {
 			if (totalsize > 200000 && !prevent[P_FEATURE_LIMIT]) {
@@ -1989,17 +2198,42 @@ long long write_tile(FILE *geoms, long long *geompos_in, char *metabase, char *s
 			}
 
 			std::string compressed;
-			std::string pbf = tile.encode();
+			std::string pbf;
+			bool too_big;
+
+			// Dropping features to fit needs to know how much too big the tile is,
+			// but otherwise it doesn't matter, so encoding and compressing can stop
+			// as soon as the tile is sure not to fit.
+			bool exact = prevent[P_KILOBYTE_LIMIT] || additional[A_MERGE_POLYGONS_AS_NEEDED] || additional[A_DROP_DENSEST_AS_NEEDED] || additional[A_DROP_SMALLEST_AS_NEEDED] || additional[A_COALESCE_SMALLEST_AS_NEEDED] || additional[A_DROP_FRACTION_AS_NEEDED] || prevent[P_DYNAMIC_DROP];
+
+			// If there are fewer tiles being made than there are CPUs, as at low zooms,
+			// the layers, and optionally the blocks of the compressed tile, are done in parallel
+			if (exact) {
+				pbf = tile.encode(tasks);
+
+				if (prevent[P_TILE_COMPRESSION]) {
+					compressed = pbf;
+				} else if (additional[A_PARALLEL_COMPRESSION]) {
+					compress_blocks(pbf, compressed, SIZE_MAX, tasks);
+				} else {
+					compress(pbf, compressed);
+				}
 
-			if (!prevent[P_TILE_COMPRESSION]) {
-				compress(pbf, compressed);
+				too_big = compressed.size() > max_tile_size && !prevent[P_KILOBYTE_LIMIT];
+			} else if (additional[A_PARALLEL_COMPRESSION] && !prevent[P_TILE_COMPRESSION]) {
+				pbf = tile.encode(tasks);
+				too_big = !compress_blocks(pbf, compressed, max_tile_size, tasks);
 			} else {
-				compressed = pbf;
+				too_big = !tile.encode(compressed, max_tile_size, !prevent[P_TILE_COMPRESSION], tasks);
 			}
 
-			if (compressed.size() > max_tile_size && !prevent[P_KILOBYTE_LIMIT]) {
+			if (too_big) {
 				if (!quiet) {
-					fprintf(stderr, "tile %d/%u/%u size is %lld with detail %d, >%zu    \n", z, tx, ty, (long long) compressed.size(), line_detail, max_tile_size);
+					if (exact) {
+						fprintf(stderr, "tile %d/%u/%u size is %lld with detail %d, >%zu    \n", z, tx, ty, (long long) compressed.size(), line_detail, max_tile_size);
+					} else {
+						fprintf(stderr, "tile %d/%u/%u size is at least %lld with detail %d, >%zu    \n", z, tx, ty, (long long) compressed.size(), line_detail, max_tile_size);
+					}
 				}
 
 				if (has_polygons && additional[A_MERGE_POLYGONS_AS_NEEDED] && merge_fraction > .05 && merge_successful) {
@@ -2025,8 +2259,20 @@ long long write_tile(FILE *geoms, long long *geompos_in, char *metabase, char *s
 					}
 					line_detail++;  // to keep it the same when the loop decrements it
 				} else if (additional[A_DROP_DENSEST_AS_NEEDED]) {
-					mingap_fraction = mingap_fraction * max_tile_size / compressed.size() * 0.90;
-					unsigned long long mg = choose_mingap(indices, mingap_fraction);
+					unsigned long long mg;
+					if (additional[A_PREDICT_TILE_SIZE] && kept_cost > 0) {
+						// Scale the estimates so that they add up to the size this attempt
+						// actually was, and choose the spacing whose estimate fits
+						size_t kept;
+						double budget = predict_budget(pbf.size(), compressed.size(), prev_raw, prev_compressed);
+						prev_raw = pbf.size();
+						prev_compressed = compressed.size();
+						mg = choose_mingap(indices, index_costs, kept_cost * budget / pbf.size(), &kept);
+						mingap_fraction = kept / (double) indices.size();
+					} else {
+						mingap_fraction = mingap_fraction * max_tile_size / compressed.size() * 0.90;
+						mg = choose_mingap(indices, mingap_fraction);
+					}
 					if (mg <= mingap) {
 						mg = mingap * 1.5;
 					}
@@ -2040,8 +2286,21 @@ long long write_tile(FILE *geoms, long long *geompos_in, char *metabase, char *s
 					}
 					line_detail++;
 				} else if (additional[A_DROP_SMALLEST_AS_NEEDED] || additional[A_COALESCE_SMALLEST_AS_NEEDED]) {
-					minextent_fraction = minextent_fraction * max_tile_size / compressed.size() * 0.90;
-					long long m = choose_minextent(extents, minextent_fraction);
+					long long m = minextent;
+					// Coalesced features take their geometry with them, so dropping them
+					// doesn't save what their estimates say it will
+					if (additional[A_PREDICT_TILE_SIZE] && !additional[A_COALESCE_SMALLEST_AS_NEEDED] && kept_cost > 0) {
+						size_t kept;
+						double budget = predict_budget(pbf.size(), compressed.size(), prev_raw, prev_compressed);
+						prev_raw = pbf.size();
+						prev_compressed = compressed.size();
+						m = choose_minextent(extents, extent_costs, kept_cost * budget / pbf.size(), &kept);
+						minextent_fraction = kept / (double) extents.size();
+					}
+					if (m <= minextent) {
+						minextent_fraction = minextent_fraction * max_tile_size / compressed.size() * 0.90;
+						m = choose_minextent(extents, minextent_fraction);
+					}
 					if (m != minextent) {
 						minextent = m;
 						if (minextent > arg->minextent_out) {
@@ -2070,26 +2329,14 @@ long long write_tile(FILE *geoms, long long *geompos_in, char *metabase, char *s
 				}
 			} else {
 				if (pass == 1) {
-					if (pthread_mutex_lock(&db_lock) != 0) {
-						perror("pthread_mutex_lock");
-						exit(EXIT_FAILURE);
-					}
-
-					if (outdb != NULL) {
-						mbtiles_write_tile(outdb, z, tx, ty, compressed.data(), compressed.size());
-					} else if (outdir != NULL) {
-						dir_write_tile(outdir, z, tx, ty, compressed);
-					}
-
-					if (pthread_mutex_unlock(&db_lock) != 0) {
-						perror("pthread_mutex_unlock");
-						exit(EXIT_FAILURE);
-					}
+					tile_writer_put(writer, z, tx, ty, compressed);
 				}
 
+				note_retries(arg, z, tx, ty, attempts);
 				return count;
 			}
 		} else {
+			note_retries(arg, z, tx, ty, attempts);
 			return count;
 		}
 	}
@@ -2103,112 +2350,749 @@ struct task {
 	struct task *next;
 };
 
-void *run_thread(void *vargs) {
-	write_tile_args *arg = (write_tile_args *) vargs;
+// Each temporary file is a sequence of tiles, and the offset of each tile
+// within it was recorded as the previous zoom level wrote it. A thread works
+// forward from the front of the files it was assigned, and once it runs out,
+// takes tiles from the back of whichever file has the most left to do,
+// so that one dense file doesn't leave the other threads idle.
+
+struct tile_scheduler {
+	std::vector<std::vector<long long>> *starts;
+	off_t *geom_size;
+	std::vector<size_t> head;  // next tile in each file for the thread it was assigned to
+	std::vector<size_t> tail;  // one past the last tile in each file that nobody has claimed yet
+	pthread_mutex_t lock;
+};
+
+double wall_time() {
+	struct timeval tv;
+	if (gettimeofday(&tv, NULL) != 0) {
+		perror("gettimeofday");
+		exit(EXIT_FAILURE);
+	}
+	return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+long long tile_end(tile_scheduler *ts, size_t j, size_t k) {
+	if (k + 1 < (*ts->starts)[j].size()) {
+		return (*ts->starts)[j][k + 1];
+	} else {
+		return ts->geom_size[j];
+	}
+}
+
+bool claim_tile(tile_scheduler *ts, size_t j, size_t *k) {
+	if (pthread_mutex_lock(&ts->lock) != 0) {
+		perror("pthread_mutex_lock");
+		exit(EXIT_FAILURE);
+	}
+
+	bool found = false;
+	if (ts->head[j] < ts->tail[j]) {
+		*k = ts->head[j]++;
+		found = true;
+	}
+
+	if (pthread_mutex_unlock(&ts->lock) != 0) {
+		perror("pthread_mutex_unlock");
+		exit(EXIT_FAILURE);
+	}
+
+	return found;
+}
+
+bool steal_tile(tile_scheduler *ts, size_t *j, size_t *k) {
+	if (pthread_mutex_lock(&ts->lock) != 0) {
+		perror("pthread_mutex_lock");
+		exit(EXIT_FAILURE);
+	}
+
+	bool found = false;
+	long long most = 0;
+	for (size_t i = 0; i < ts->head.size(); i++) {
+		if (ts->head[i] < ts->tail[i]) {
+			long long left = tile_end(ts, i, ts->tail[i] - 1) - (*ts->starts)[i][ts->head[i]];
+			if (!found || left > most) {
+				most = left;
+				*j = i;
+				found = true;
+			}
+		}
+	}
+	if (found) {
+		*k = --ts->tail[*j];
+	}
+
+	if (pthread_mutex_unlock(&ts->lock) != 0) {
+		perror("pthread_mutex_unlock");
+		exit(EXIT_FAILURE);
+	}
+
+	return found;
+}
+
+// Keep track of the largest tile, preferring the first in x,y order if
+// several are the same size. Each thread keeps its own, and they are
+// combined the same way once the threads are finished.
+static void note_largest(long long len, unsigned x, unsigned y, long long *most, unsigned *midx, unsigned *midy) {
+	if (len > *most) {
+		*midx = x;
+		*midy = y;
+		*most = len;
+	} else if (len == *most) {
+		unsigned long long a = (((unsigned long long) x) << 32) | y;
+		unsigned long long b = (((unsigned long long) *midx) << 32) | *midy;
+
+		if (a < b) {
+			*midx = x;
+			*midy = y;
+			*most = len;
+		}
+	}
+}
+
+long long run_tile(write_tile_args *arg, FILE *geom, long long *geompos, long long tilesize) {
+	int z;
+	unsigned x, y;
+
+	if (!deserialize_int_io(geom, &z, geompos)) {
+		fprintf(stderr, "Internal error: missing tile header\n");
+		exit(EXIT_FAILURE);
+	}
+	deserialize_uint_io(geom, &x, geompos);
+	deserialize_uint_io(geom, &y, geompos);
+
+	arg->wrote_zoom = z;
+
+	// fprintf(stderr, "%d/%u/%u\n", z, x, y);
+
+	long long len = write_tile(geom, geompos, arg->metabase, arg->stringpool, z, x, y, z == arg->maxzoom ? arg->full_detail : arg->low_detail, arg->min_detail, arg->basezoom, arg->writer, arg->droprate, arg->buffer, arg->fname, arg->geomfile, arg->minzoom, arg->maxzoom, arg->todo, arg->along, *geompos, arg->gamma, arg->child_shards, arg->meta_off, arg->pool_off, arg->initial_x, arg->initial_y, arg->running, arg->simplification, arg->layermaps, arg->layer_unmaps, arg->tiling_seg, arg->pass, arg->passes, arg->mingap, arg->minextent, arg->fraction, arg->prefilter, arg->postfilter, arg);
+
+	if (len < 0) {
+		arg->err = z - 1;
+		return len;
+	}
+
+	if (z == arg->maxzoom) {
+		note_largest(len, x, y, &arg->most, &arg->midx, &arg->midy);
+	}
+
+	__sync_fetch_and_add(arg->along, tilesize);
+
+	arg->tiles++;
+	return len;
+}
+
+// Copy a tile from another thread's shard into this thread's scratch file.
+// pread() leaves the offset of the shard's own stream alone.
+
+FILE *copy_stolen_tile(write_tile_args *arg, size_t j, long long start, long long end) {
+	if (arg->stolen_geom == NULL) {
+		char fname[strlen(arg->tmpdir) + strlen("/stolen.XXXXXXXX") + 1];
+		sprintf(fname, "%s/stolen.XXXXXXXX", arg->tmpdir);
+		int fd = mkstemp_cloexec(fname);
+		if (fd < 0) {
+			perror(fname);
+			exit(EXIT_FAILURE);
+		}
+		arg->stolen_geom = fdopen(fd, "w+b");
+		if (arg->stolen_geom == NULL) {
+			perror(fname);
+			exit(EXIT_FAILURE);
+		}
+		unlink(fname);
+	}
+
+	if (fseek(arg->stolen_geom, 0, SEEK_SET) != 0) {
+		perror("fseek stolen tile");
+		exit(EXIT_FAILURE);
+	}
+
+	char buf[100000];
+	for (long long off = start; off < end;) {
+		size_t want = sizeof(buf);
+		if (end - off < (long long) want) {
+			want = end - off;
+		}
+
+		ssize_t n = pread(arg->geomfd[j], buf, want, off);
+		if (n <= 0) {
+			perror("pread stolen tile");
+			exit(EXIT_FAILURE);
+		}
+
+		fwrite_check(buf, sizeof(char), n, arg->stolen_geom, arg->fname);
+		off += n;
+	}
+
+	if (fflush(arg->stolen_geom) != 0) {
+		perror("fflush stolen tile");
+		exit(EXIT_FAILURE);
+	}
+	if (fseek(arg->stolen_geom, 0, SEEK_SET) != 0) {
+		perror("fseek stolen tile");
+		exit(EXIT_FAILURE);
+	}
+
+	return arg->stolen_geom;
+}
+
+// When no zoom level needs a preliminary pass to decide how much to drop,
+// there is no need to wait for a whole zoom level to finish before starting
+// on the next one. Each temporary file is written by a single thread, so its
+// tiles can be started as soon as that thread has run out of tiles to work on
+// at the previous level. Each of these rounds of temporary files is a
+// "generation" rather than a zoom level, because zoom levels can be skipped.
+
+struct generation {
+	std::vector<int> fd;
+	std::vector<FILE *> files;  // for writing, owned by the thread that writes each file
+	std::vector<off_t> size;
+	std::vector<std::vector<long long>> starts;
+	std::vector<std::vector<block_entry>> index;  // of compressed blocks
+	tile_scheduler ts;
+
+	size_t published;  // threads that have finished writing into this generation
+	size_t finished;   // threads that have finished reading from this generation
+	long long tiles;
+	volatile long long todo;
+	volatile long long along;
+
+	int z;
+	double first;
+	double last;
+	double busy;
+	long long tiled;
+	long long stolen;
+	long long retried;
+	long long retries;
+};
+
+struct pipeline {
+	std::vector<generation *> generations;
+	size_t threads;
+	size_t depth;       // generations whose temporary files may be open at once
+	size_t failed_gen;  // earliest generation where a tile could not be made to fit
+	int err;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+};
+
+void pipeline_lock(pipeline *pl) {
+	if (pthread_mutex_lock(&pl->lock) != 0) {
+		perror("pthread_mutex_lock");
+		exit(EXIT_FAILURE);
+	}
+}
+
+void pipeline_unlock(pipeline *pl) {
+	if (pthread_mutex_unlock(&pl->lock) != 0) {
+		perror("pthread_mutex_unlock");
+		exit(EXIT_FAILURE);
+	}
+}
+
+// Is there anything left to do in the thread's generation? If so, how many
+// threads had published into it, so it can tell whether any more have since
+// then when it looks for more work.
+bool pipeline_status(write_tile_args *arg, size_t *published) {
+	pipeline *pl = arg->pipeline;
+
+	pipeline_lock(pl);
+	bool going = arg->generation <= pl->failed_gen;
+	*published = pl->generations[arg->generation]->published;
+	arg->todo = pl->generations[arg->generation]->todo;
+	pipeline_unlock(pl);
+
+	return going;
+}
+
+// Wait until another thread publishes more tiles into this thread's
+// generation. Returns false if there will never be any more.
+bool pipeline_wait(write_tile_args *arg, size_t published) {
+	pipeline *pl = arg->pipeline;
+	generation *gen = pl->generations[arg->generation];
+
+	if (published == pl->threads) {
+		return false;
+	}
+
+	pipeline_lock(pl);
+	while (gen->published == published && arg->generation <= pl->failed_gen) {
+		if (pthread_cond_wait(&pl->cond, &pl->lock) != 0) {
+			perror("pthread_cond_wait");
+			exit(EXIT_FAILURE);
+		}
+	}
+	bool going = arg->generation <= pl->failed_gen;
+	pipeline_unlock(pl);
+
+	return going;
+}
+
+void pipeline_fail(write_tile_args *arg) {
+	pipeline *pl = arg->pipeline;
+
+	pipeline_lock(pl);
+	if (arg->generation < pl->failed_gen) {
+		pl->failed_gen = arg->generation;
+	}
+	if (arg->err < pl->err) {
+		pl->err = arg->err;
+	}
+	if (pthread_cond_broadcast(&pl->cond) != 0) {
+		perror("pthread_cond_broadcast");
+		exit(EXIT_FAILURE);
+	}
+	pipeline_unlock(pl);
+}
+
+// Work through the thread's own temporary files, then help with
+// everyone else's. Returns false if a tile could not be made to fit.
+bool run_tiles(write_tile_args *arg) {
+	tile_scheduler *ts = arg->scheduler;
 	struct task *task;
+	bool ok = true;
+	size_t published = 0;
+	block_cache cache;
 
-	for (task = arg->tasks; task != NULL; task = task->next) {
+	for (task = arg->tasks; task != NULL && ok; task = task->next) {
 		int j = task->fileno;
+		size_t k;
 
-		if (arg->geomfd[j] < 0) {
-			// only one source file for zoom level 0
-			continue;
+		if (arg->pipeline != NULL && !pipeline_status(arg, &published)) {
+			break;
 		}
-		if (arg->geom_size[j] == 0) {
+		if (!claim_tile(ts, j, &k)) {
+			// Other threads have already taken everything
 			continue;
 		}
 
-		// printf("%lld of geom_size\n", (long long) geom_size[j]);
-
-		FILE *geom = fdopen(arg->geomfd[j], "rb");
-		if (geom == NULL) {
-			perror("mmap geom");
-			exit(EXIT_FAILURE);
+		FILE *geom = NULL;
+		if (arg->geom_index == NULL) {
+			// The shard's own descriptor stays open for any other threads
+			// that are still copying tiles out of it.
+			int fd = dup(arg->geomfd[j]);
+			if (fd < 0) {
+				perror("dup geometry");
+				exit(EXIT_FAILURE);
+			}
+			geom = fdopen(fd, "rb");
+			if (geom == NULL) {
+				perror("fdopen geom");
+				exit(EXIT_FAILURE);
+			}
 		}
 
-		long long geompos = 0;
-		long long prevgeom = 0;
+		long long geompos = -1;
 
-		while (1) {
-			int z;
-			unsigned x, y;
+		do {
+			long long start = (*ts->starts)[j][k];
+			long long end = tile_end(ts, j, k);
+
+			if (arg->geom_index != NULL) {
+				geom = block_reader_open(arg->geomfd[j], &arg->geom_index[j], start, end, &cache);
+				geompos = start;
+			} else if (geompos != start) {
+				if (fseek(geom, start, SEEK_SET) != 0) {
+					perror("fseek geom");
+					exit(EXIT_FAILURE);
+				}
+				geompos = start;
+			}
+
+			double then = wall_time();
+			if (run_tile(arg, geom, &geompos, end - start) < 0) {
+				ok = false;
+			}
+			if (arg->geom_index != NULL) {
+				if (fclose(geom) != 0) {
+					perror("close geom");
+					exit(EXIT_FAILURE);
+				}
+			}
+			arg->last = wall_time();
+			if (arg->first == 0) {
+				arg->first = then;
+			}
+			arg->busy += arg->last - then;
 
-			if (!deserialize_int_io(geom, &z, &geompos)) {
+			if (arg->pipeline != NULL && ok && !pipeline_status(arg, &published)) {
 				break;
 			}
-			deserialize_uint_io(geom, &x, &geompos);
-			deserialize_uint_io(geom, &y, &geompos);
+		} while (ok && claim_tile(ts, j, &k));
 
-			arg->wrote_zoom = z;
+		if (arg->geom_index == NULL) {
+			if (fclose(geom) != 0) {
+				perror("close geom");
+				exit(EXIT_FAILURE);
+			}
+		}
+	}
 
-			// fprintf(stderr, "%d/%u/%u\n", z, x, y);
+	while (ok) {
+		size_t j, k;
 
-			long long len = write_tile(geom, &geompos, arg->metabase, arg->stringpool, z, x, y, z == arg->maxzoom ? arg->full_detail : arg->low_detail, arg->min_detail, arg->basezoom, arg->outdb, arg->outdir, arg->droprate, arg->buffer, arg->fname, arg->geomfile, arg->minzoom, arg->maxzoom, arg->todo, arg->along, geompos, arg->gamma, arg->child_shards, arg->meta_off, arg->pool_off, arg->initial_x, arg->initial_y, arg->running, arg->simplification, arg->layermaps, arg->layer_unmaps, arg->tiling_seg, arg->pass, arg->passes, arg->mingap, arg->minextent, arg->fraction, arg->prefilter, arg->postfilter, arg);
+		if (arg->pipeline != NULL && !pipeline_status(arg, &published)) {
+			break;
+		}
 
-			if (len < 0) {
-				int *err = &arg->err;
-				*err = z - 1;
-				return err;
+		if (!steal_tile(ts, &j, &k)) {
+			if (arg->pipeline == NULL || !pipeline_wait(arg, published)) {
+				break;
 			}
+			continue;
+		}
+
+		long long start = (*ts->starts)[j][k];
+		long long end = tile_end(ts, j, k);
 
-			if (pthread_mutex_lock(&var_lock) != 0) {
-				perror("pthread_mutex_lock");
+		double then = wall_time();
+		// Compressed blocks are read with pread(), so there is no need
+		// to copy them to keep out of the way of the shard's owner
+		FILE *geom;
+		long long geompos;
+		if (arg->geom_index != NULL) {
+			geom = block_reader_open(arg->geomfd[j], &arg->geom_index[j], start, end, &cache);
+			geompos = start;
+		} else {
+			geom = copy_stolen_tile(arg, j, start, end);
+			geompos = 0;
+		}
+		if (run_tile(arg, geom, &geompos, end - start) < 0) {
+			ok = false;
+		}
+		if (arg->geom_index != NULL) {
+			if (fclose(geom) != 0) {
+				perror("close geom");
 				exit(EXIT_FAILURE);
 			}
+		}
+		arg->last = wall_time();
+		if (arg->first == 0) {
+			arg->first = then;
+		}
+		arg->busy += arg->last - then;
+		arg->stolen++;
+	}
+
+	if (arg->stolen_geom != NULL) {
+		if (fclose(arg->stolen_geom) != 0) {
+			perror("close stolen tiles");
+			exit(EXIT_FAILURE);
+		}
+		arg->stolen_geom = NULL;
+	}
 
-			if (z == arg->maxzoom) {
-				if (len > *arg->most) {
-					*arg->midx = x;
-					*arg->midy = y;
-					*arg->most = len;
-				} else if (len == *arg->most) {
-					unsigned long long a = (((unsigned long long) x) << 32) | y;
-					unsigned long long b = (((unsigned long long) *arg->midx) << 32) | *arg->midy;
+	if (!ok && arg->pipeline != NULL) {
+		pipeline_fail(arg);
+	}
 
-					if (a < b) {
-						*arg->midx = x;
-						*arg->midy = y;
-						*arg->most = len;
-					}
+	return ok;
+}
+
+void *run_thread(void *vargs) {
+	write_tile_args *arg = (write_tile_args *) vargs;
+	void *ret = NULL;
+
+	if (!run_tiles(arg)) {
+		ret = &arg->err;
+	}
+
+	__sync_sub_and_fetch(arg->running, 1);
+
+	return ret;
+}
+
+// Make a temporary file for the next generation. The stream is only used
+// for writing, and the descriptor it shares is only read with pread() or
+// through a dup() once the writing is finished, so a single descriptor
+// is enough even with several generations open at once.
+FILE *open_shard(const char *tmpdir, size_t j, int *fd) {
+	char geomname[strlen(tmpdir) + strlen("/geom.XXXXXXXX" XSTRINGIFY(INT_MAX)) + 1];
+	sprintf(geomname, "%s/geom%zu.XXXXXXXX", tmpdir, j);
+	*fd = mkstemp_cloexec(geomname);
+	if (*fd < 0) {
+		perror(geomname);
+		exit(EXIT_FAILURE);
+	}
+	FILE *f = fdopen(*fd, "wb");
+	if (f == NULL) {
+		perror(geomname);
+		exit(EXIT_FAILURE);
+	}
+	unlink(geomname);
+	return f;
+}
+
+generation *get_generation(pipeline *pl, size_t g) {
+	pipeline_lock(pl);
+
+	while (pl->generations.size() <= g) {
+		generation *gen = new generation;
+
+		gen->fd.resize(TEMP_FILES, -1);
+		gen->files.resize(TEMP_FILES, NULL);
+		gen->size.resize(TEMP_FILES, 0);
+		gen->starts.resize(TEMP_FILES);
+		gen->index.resize(TEMP_FILES);
+		gen->ts.starts = &gen->starts;
+		gen->ts.geom_size = gen->size.data();
+		gen->ts.head.resize(TEMP_FILES, 0);
+		gen->ts.tail.resize(TEMP_FILES, 0);
+		if (pthread_mutex_init(&gen->ts.lock, NULL) != 0) {
+			perror("pthread_mutex_init");
+			exit(EXIT_FAILURE);
+		}
+
+		gen->published = 0;
+		gen->finished = 0;
+		gen->tiles = 0;
+		gen->todo = 0;
+		gen->along = 0;
+		gen->z = -1;
+		gen->first = 0;
+		gen->last = 0;
+		gen->busy = 0;
+		gen->tiled = 0;
+		gen->stolen = 0;
+		gen->retried = 0;
+		gen->retries = 0;
+
+		pl->generations.push_back(gen);
+	}
+
+	generation *gen = pl->generations[g];
+	pipeline_unlock(pl);
+	return gen;
+}
+
+void close_generation(generation *gen) {
+	for (size_t j = 0; j < gen->fd.size(); j++) {
+		if (gen->files[j] != NULL) {
+			// Also closes the descriptor
+			if (fclose(gen->files[j]) != 0) {
+				perror("close subfile");
+				exit(EXIT_FAILURE);
+			}
+			gen->files[j] = NULL;
+			gen->fd[j] = -1;
+		}
+		if (gen->fd[j] >= 0) {
+			if (close(gen->fd[j]) != 0) {
+				perror("close geom");
+				exit(EXIT_FAILURE);
+			}
+			gen->fd[j] = -1;
+		}
+	}
+}
+
+void *run_pipeline_thread(void *vargs) {
+	write_tile_args *arg = (write_tile_args *) vargs;
+	pipeline *pl = arg->pipeline;
+	size_t thread = arg->thread;
+	size_t shards = arg->child_shards;
+
+	for (size_t g = 0;; g++) {
+		generation *gen = get_generation(pl, g);
+		generation *next = get_generation(pl, g + 1);
+
+		// Opening the next generation's files must not put more of them
+		// open at once than the descriptor limit allows for
+		if (g + 1 >= pl->depth) {
+			pipeline_lock(pl);
+			generation *old = pl->generations[g + 1 - pl->depth];
+			while (old->finished < pl->threads) {
+				if (pthread_cond_wait(&pl->cond, &pl->lock) != 0) {
+					perror("pthread_cond_wait");
+					exit(EXIT_FAILURE);
 				}
 			}
+			pipeline_unlock(pl);
+		}
 
-			*arg->along += geompos - prevgeom;
-			prevgeom = geompos;
+		for (size_t c = 0; c < shards; c++) {
+			size_t j = thread * shards + c;
+			next->files[j] = open_shard(arg->tmpdir, j, &next->fd[j]);
+		}
 
-			if (pthread_mutex_unlock(&var_lock) != 0) {
-				perror("pthread_mutex_unlock");
-				exit(EXIT_FAILURE);
+		std::vector<std::vector<long long>> child_starts(shards);
+		std::vector<long long> child_pos(shards, 0);
+		struct task tasks[shards];
+
+		std::vector<std::vector<block_entry>> child_index(shards);
+		std::vector<long long> physical(shards, 0);
+		std::vector<block_writer *> writers;
+		std::vector<FILE *> outputs;
+		if (additional[A_COMPRESS_TEMPORARY]) {
+			for (size_t c = 0; c < shards; c++) {
+				writers.push_back(block_writer_open(next->files[thread * shards + c], arg->fname, &child_index[c]));
+				outputs.push_back(writers[c]->fp);
 			}
 		}
 
-		if (arg->pass == 1) {
-			// Since the fclose() has closed the underlying file descriptor
-			arg->geomfd[j] = -1;
+		arg->tasks = NULL;
+		for (size_t c = shards; c > 0; c--) {
+			tasks[c - 1].fileno = thread * shards + c - 1;
+			tasks[c - 1].next = arg->tasks;
+			arg->tasks = &tasks[c - 1];
+		}
+
+		arg->generation = g;
+		arg->scheduler = &gen->ts;
+		arg->geomfd = gen->fd.data();
+		arg->geom_size = gen->size.data();
+		if (additional[A_COMPRESS_TEMPORARY]) {
+			arg->geomfile = outputs.data();
+			arg->geomwriters = writers.data();
 		} else {
-			int newfd = dup(arg->geomfd[j]);
-			if (newfd < 0) {
-				perror("dup geometry");
+			arg->geomfile = &next->files[thread * shards];
+			arg->geomwriters = NULL;
+		}
+		if (additional[A_COMPRESS_TEMPORARY] && g > 0) {  // the first generation is the original geometry
+			arg->geom_index = gen->index.data();
+		} else {
+			arg->geom_index = NULL;
+		}
+		arg->child_starts = child_starts.data();
+		arg->child_pos = child_pos.data();
+		arg->along = &gen->along;
+		arg->todo = gen->todo;
+		arg->wrote_zoom = -1;
+		arg->first = 0;
+		arg->last = 0;
+		arg->busy = 0;
+		arg->tiles = 0;
+		arg->stolen = 0;
+		arg->retried = 0;
+		arg->retries = 0;
+
+		bool ok = run_tiles(arg);
+
+		for (size_t c = 0; c < writers.size(); c++) {
+			physical[c] = block_writer_close(writers[c]);
+		}
+
+		// Make this thread's share of the next generation available
+
+		long long written = 0;
+		for (size_t c = 0; c < shards; c++) {
+			size_t j = thread * shards + c;
+
+			if (fflush(next->files[j]) != 0) {
+				perror("flush subfile");
 				exit(EXIT_FAILURE);
 			}
-			if (lseek(newfd, 0, SEEK_SET) < 0) {
-				perror("lseek geometry");
+
+			struct stat geomst;
+			if (fstat(next->fd[j], &geomst) != 0) {
+				perror("stat geom\n");
 				exit(EXIT_FAILURE);
 			}
-			arg->geomfd[j] = newfd;
+			long long expected = child_pos[c];
+			if (additional[A_COMPRESS_TEMPORARY]) {
+				expected = physical[c];
+			}
+			if (geomst.st_size != expected) {
+				fprintf(stderr, "Internal error: temporary file %zu is %lld bytes, expected %lld\n", j, (long long) geomst.st_size, expected);
+				exit(EXIT_FAILURE);
+			}
+
+			written += child_pos[c];
+		}
+
+		if (pthread_mutex_lock(&next->ts.lock) != 0) {
+			perror("pthread_mutex_lock");
+			exit(EXIT_FAILURE);
+		}
+		for (size_t c = 0; c < shards; c++) {
+			size_t j = thread * shards + c;
+
+			next->size[j] = child_pos[c];
+			next->starts[j].swap(child_starts[c]);
+			next->index[j].swap(child_index[c]);
+			next->ts.tail[j] = next->starts[j].size();
+		}
+		if (pthread_mutex_unlock(&next->ts.lock) != 0) {
+			perror("pthread_mutex_unlock");
+			exit(EXIT_FAILURE);
+		}
+
+		pipeline_lock(pl);
+
+		for (size_t c = 0; c < shards; c++) {
+			next->tiles += next->starts[thread * shards + c].size();
+		}
+		next->todo += written;
+		next->published++;
+
+		if (arg->wrote_zoom > gen->z) {
+			gen->z = arg->wrote_zoom;
+		}
+		if (arg->first != 0 && (gen->first == 0 || arg->first < gen->first)) {
+			gen->first = arg->first;
+		}
+		if (arg->last > gen->last) {
+			gen->last = arg->last;
 		}
+		gen->busy += arg->busy;
+		gen->tiled += arg->tiles;
+		gen->stolen += arg->stolen;
+		gen->retried += arg->retried;
+		gen->retries += arg->retries;
 
-		if (fclose(geom) != 0) {
-			perror("close geom");
+		// Nobody else is still reading from this generation
+		gen->finished++;
+		if (gen->finished == pl->threads) {
+			close_generation(gen);
+		}
+
+		bool done = !ok || pl->failed_gen <= g || gen->tiles == 0;
+
+		if (pthread_cond_broadcast(&pl->cond) != 0) {
+			perror("pthread_cond_broadcast");
 			exit(EXIT_FAILURE);
 		}
+		pipeline_unlock(pl);
+
+		if (done) {
+			break;
+		}
 	}
 
-	arg->running--;
 	return NULL;
 }
 
-int traverse_zooms(int *geomfd, off_t *geom_size, char *metabase, char *stringpool, unsigned *midx, unsigned *midy, int &maxzoom, int minzoom, int basezoom, sqlite3 *outdb, const char *outdir, double droprate, int buffer, const char *fname, const char *tmpdir, double gamma, int full_detail, int low_detail, int min_detail, long long *meta_off, long long *pool_off, unsigned *initial_x, unsigned *initial_y, double simplification, std::vector<std::map<std::string, layermap_entry>> &layermaps, const char *prefilter, const char *postfilter) {
+struct zoom_utilization {
+	int z;
+	size_t threads;
+	double wall;
+	double busy;
+	long long tiles;
+	long long stolen;
+	long long retried;
+	long long retries;
+};
+
+void report_utilization(std::vector<zoom_utilization> const &utilization) {
+	if (!additional[A_REPORT_UTILIZATION]) {
+		return;
+	}
+
+	// With pipelined zooms, the times for adjacent zoom levels overlap
+	for (size_t u = 0; u < utilization.size(); u++) {
+		zoom_utilization const &zu = utilization[u];
+		double used = 0;
+		if (zu.wall > 0) {
+			used = zu.busy / (zu.wall * zu.threads);
+		}
+
+		fprintf(stderr, "zoom %d: %.3f seconds, %zu threads, %.1f%% utilization, %lld tiles, %lld stolen, %lld retried %lld times\n", zu.z, zu.wall, zu.threads, used * 100, zu.tiles, zu.stolen, zu.retried, zu.retries);
+	}
+}
+
+int traverse_zooms(int *geomfd, off_t *geom_size, char *metabase, char *stringpool, unsigned *midx, unsigned *midy, int &maxzoom, int minzoom, int basezoom, tile_writer *writer, double droprate, int buffer, const char *fname, const char *tmpdir, double gamma, int full_detail, int low_detail, int min_detail, long long *meta_off, long long *pool_off, unsigned *initial_x, unsigned *initial_y, double simplification, std::vector<std::map<std::string, layermap_entry>> &layermaps, const char *prefilter, const char *postfilter) {
 	// The existing layermaps are one table per input thread.
 	// We need to add another one per *tiling* thread so that it can be
 	// safely changed during tiling.
@@ -2230,10 +3114,175 @@ int traverse_zooms(int *geomfd, off_t *geom_size, char *metabase, char *stringpo
 		}
 	}
 
+	// Where each tile begins within each temporary file. The initial
+	// geometry file holds a single tile.
+	std::vector<std::vector<long long>> tile_starts(TEMP_FILES);
+	for (size_t j = 0; j < TEMP_FILES; j++) {
+		if (geom_size[j] > 0) {
+			tile_starts[j].push_back(0);
+		}
+	}
+
+	std::vector<zoom_utilization> utilization;
+
+	size_t pipeline_threads = CPUS;
+	if (pipeline_threads > TEMP_FILES / 4) {
+		pipeline_threads = TEMP_FILES / 4;
+	}
+	for (int e = 0; e < 30; e++) {
+		if (pipeline_threads >= (1U << e) && pipeline_threads < (1U << (e + 1))) {
+			pipeline_threads = 1U << e;
+			break;
+		}
+	}
+
+	bool needs_prepass = additional[A_INCREASE_GAMMA_AS_NEEDED] || additional[A_DROP_DENSEST_AS_NEEDED] || additional[A_DROP_FRACTION_AS_NEEDED] || additional[A_DROP_SMALLEST_AS_NEEDED] || additional[A_COALESCE_SMALLEST_AS_NEEDED];
+
+	if (pipeline_threads > 1 && !needs_prepass && !additional[A_EXTEND_ZOOMS] && !prevent[P_ZOOM_PIPELINE]) {
+		pipeline pl;
+		pl.threads = pipeline_threads;
+		pl.failed_gen = SIZE_MAX;
+
+		// The per-zoom files were budgeted at two descriptors for each:
+		// one generation being read and one being written. A thread that
+		// runs ahead can have a third open, if the limit leaves room for it.
+		pl.depth = (MAX_FILES - 10) / TEMP_FILES;
+		if (pl.depth > 3) {
+			pl.depth = 3;
+		}
+		pl.err = INT_MAX;
+		if (pthread_mutex_init(&pl.lock, NULL) != 0 || pthread_cond_init(&pl.cond, NULL) != 0) {
+			perror("pthread_mutex_init");
+			exit(EXIT_FAILURE);
+		}
+
+		generation *gen = get_generation(&pl, 0);
+		for (size_t j = 0; j < TEMP_FILES; j++) {
+			gen->fd[j] = geomfd[j];
+			gen->size[j] = geom_size[j];
+			gen->starts[j] = tile_starts[j];
+			gen->ts.tail[j] = tile_starts[j].size();
+			gen->tiles += tile_starts[j].size();
+			gen->todo += geom_size[j];
+		}
+		gen->published = pl.threads;
+
+		long long most = 0;
+		int running = pl.threads;
+		struct pool_task *workers[pl.threads];
+		write_tile_args args[pl.threads];
+
+		for (size_t thread = 0; thread < pl.threads; thread++) {
+			args[thread].metabase = metabase;
+			args[thread].stringpool = stringpool;
+			args[thread].min_detail = min_detail;
+			args[thread].basezoom = basezoom;
+			args[thread].writer = writer;
+			args[thread].droprate = droprate;
+			args[thread].buffer = buffer;
+			args[thread].fname = fname;
+			args[thread].gamma = gamma;
+			args[thread].gamma_out = gamma;
+			args[thread].mingap = 0;
+			args[thread].mingap_out = 0;
+			args[thread].minextent = 0;
+			args[thread].minextent_out = 0;
+			args[thread].fraction = 1;
+			args[thread].fraction_out = 1;
+			args[thread].child_shards = TEMP_FILES / pl.threads;
+			args[thread].simplification = simplification;
+
+			args[thread].most = -1;
+			args[thread].maxzoom = maxzoom;
+			args[thread].minzoom = minzoom;
+			args[thread].full_detail = full_detail;
+			args[thread].low_detail = low_detail;
+			args[thread].meta_off = meta_off;
+			args[thread].pool_off = pool_off;
+			args[thread].initial_x = initial_x;
+			args[thread].initial_y = initial_y;
+			args[thread].layermaps = &layermaps;
+			args[thread].layer_unmaps = &layer_unmaps;
+			args[thread].tiling_seg = thread + layermaps_off;
+			args[thread].prefilter = prefilter;
+			args[thread].postfilter = postfilter;
+
+			args[thread].tmpdir = tmpdir;
+			args[thread].stolen_geom = NULL;
+			args[thread].running = &running;  // atomic
+			args[thread].pass = 1;
+			args[thread].passes = 1;
+			args[thread].still_dropping = false;
+			args[thread].pipeline = &pl;
+			args[thread].thread = thread;
+
+			workers[thread] = task_start_concurrent(run_pipeline_thread, &args[thread]);
+		}
+
+		for (size_t thread = 0; thread < pl.threads; thread++) {
+			task_join(workers[thread]);
+
+			note_largest(args[thread].most, args[thread].midx, args[thread].midy, &most, midx, midy);
+		}
+
+		for (size_t g = 0; g < pl.generations.size(); g++) {
+			generation *pgen = pl.generations[g];
+
+			if (pgen->tiled > 0) {
+				zoom_utilization zu;
+				zu.z = pgen->z;
+				zu.threads = pl.threads;
+				zu.wall = pgen->last - pgen->first;
+				zu.busy = pgen->busy;
+				zu.tiles = pgen->tiled;
+				zu.stolen = pgen->stolen;
+				zu.retried = pgen->retried;
+				zu.retries = pgen->retries;
+				utilization.push_back(zu);
+			}
+
+			close_generation(pgen);
+			if (pthread_mutex_destroy(&pgen->ts.lock) != 0) {
+				perror("pthread_mutex_destroy");
+				exit(EXIT_FAILURE);
+			}
+			delete pgen;
+		}
+
+		if (pthread_mutex_destroy(&pl.lock) != 0 || pthread_cond_destroy(&pl.cond) != 0) {
+			perror("pthread_mutex_destroy");
+			exit(EXIT_FAILURE);
+		}
+
+		if (!quiet) {
+			fprintf(stderr, "\n");
+		}
+		report_utilization(utilization);
+
+		if (pl.failed_gen != SIZE_MAX) {
+			// Threads that had gone on to deeper zoom levels before the
+			// failure may have written tiles that are now past the end,
+			// including the largest tile at the old maxzoom
+			tile_writer_discard_above(writer, pl.err);
+			*midx = 0;
+			*midy = 0;
+			return pl.err;
+		}
+		return maxzoom;
+	}
+
+	// Where the compressed blocks are in each temporary file, once the
+	// first zoom level has replaced the original geometry
+	std::vector<std::vector<block_entry>> tile_index(TEMP_FILES);
+	bool compressed = false;
+
 	int i;
 	for (i = 0; i <= maxzoom; i++) {
 		long long most = 0;
 
+		std::vector<std::vector<long long>> sub_starts(TEMP_FILES);
+		std::vector<long long> sub_pos(TEMP_FILES, 0);
+
 		FILE *sub[TEMP_FILES];
 		int subfd[TEMP_FILES];
 		for (size_t j = 0; j < TEMP_FILES; j++) {
@@ -2253,13 +3302,26 @@ int traverse_zooms(int *geomfd, off_t *geom_size, char *metabase, char *stringpo
 			unlink(geomname);
 		}
 
+		std::vector<std::vector<block_entry>> sub_index(TEMP_FILES);
+		struct block_writer *sub_writers[TEMP_FILES];
+		FILE *sub_streams[TEMP_FILES];
+		for (size_t j = 0; j < TEMP_FILES; j++) {
+			if (additional[A_COMPRESS_TEMPORARY]) {
+				sub_writers[j] = block_writer_open(sub[j], fname, &sub_index[j]);
+				sub_streams[j] = sub_writers[j]->fp;
+			} else {
+				sub_writers[j] = NULL;
+				sub_streams[j] = sub[j];
+			}
+		}
+
+		// Threads can take individual tiles from each other's files,
+		// so there is useful work for as many threads as there are tiles
 		size_t useful_threads = 0;
 		long long todo = 0;
 		for (size_t j = 0; j < TEMP_FILES; j++) {
 			todo += geom_size[j];
-			if (geom_size[j] > 0) {
-				useful_threads++;
-			}
+			useful_threads += tile_starts[j].size();
 		}
 
 		size_t threads = CPUS;
@@ -2330,7 +3392,7 @@ int traverse_zooms(int *geomfd, off_t *geom_size, char *metabase, char *stringpo
 		int err = INT_MAX;
 
 		size_t start = 1;
-		if (additional[A_INCREASE_GAMMA_AS_NEEDED] || additional[A_DROP_DENSEST_AS_NEEDED] || additional[A_DROP_FRACTION_AS_NEEDED] || additional[A_DROP_SMALLEST_AS_NEEDED] || additional[A_COALESCE_SMALLEST_AS_NEEDED]) {
+		if (needs_prepass) {
 			start = 0;
 		}
 
@@ -2339,25 +3401,57 @@ int traverse_zooms(int *geomfd, off_t *geom_size, char *metabase, char *stringpo
 		long long zoom_minextent = 0;
 		double zoom_fraction = 1;
 
+		zoom_utilization zu;
+		zu.threads = threads;
+		zu.wall = 0;
+		zu.busy = 0;
+		zu.tiles = 0;
+		zu.stolen = 0;
+		zu.retried = 0;
+		zu.retries = 0;
+
 		for (size_t pass = start; pass < 2; pass++) {
-			pthread_t pthreads[threads];
+			struct pool_task *workers[threads];
 			write_tile_args args[threads];
 			int running = threads;
 			long long along = 0;
 
+			tile_scheduler ts;
+			ts.starts = &tile_starts;
+			ts.geom_size = geom_size;
+			for (size_t j = 0; j < TEMP_FILES; j++) {
+				ts.head.push_back(0);
+				ts.tail.push_back(tile_starts[j].size());
+			}
+			if (pthread_mutex_init(&ts.lock, NULL) != 0) {
+				perror("pthread_mutex_init");
+				exit(EXIT_FAILURE);
+			}
+
+			double then = wall_time();
+
 			for (size_t thread = 0; thread < threads; thread++) {
 				args[thread].metabase = metabase;
 				args[thread].stringpool = stringpool;
 				args[thread].min_detail = min_detail;
 				args[thread].basezoom = basezoom;
-				args[thread].outdb = outdb;  // locked with db_lock
-				args[thread].outdir = outdir;
+				args[thread].writer = writer;
 				args[thread].droprate = droprate;
 				args[thread].buffer = buffer;
 				args[thread].fname = fname;
-				args[thread].geomfile = sub + thread * (TEMP_FILES / threads);
+				args[thread].geomfile = sub_streams + thread * (TEMP_FILES / threads);
+				if (additional[A_COMPRESS_TEMPORARY]) {
+					args[thread].geomwriters = sub_writers + thread * (TEMP_FILES / threads);
+				} else {
+					args[thread].geomwriters = NULL;
+				}
+				if (compressed) {
+					args[thread].geom_index = tile_index.data();
+				} else {
+					args[thread].geom_index = NULL;
+				}
 				args[thread].todo = todo;
-				args[thread].along = &along;  // locked with var_lock
+				args[thread].along = &along;  // atomic
 				args[thread].gamma = zoom_gamma;
 				args[thread].gamma_out = zoom_gamma;
 				args[thread].mingap = zoom_mingap;
@@ -2371,13 +3465,11 @@ int traverse_zooms(int *geomfd, off_t *geom_size, char *metabase, char *stringpo
 
 				args[thread].geomfd = geomfd;
 				args[thread].geom_size = geom_size;
-				args[thread].midx = midx;  // locked with var_lock
-				args[thread].midy = midy;  // locked with var_lock
+				args[thread].most = -1;
 				args[thread].maxzoom = maxzoom;
 				args[thread].minzoom = minzoom;
 				args[thread].full_detail = full_detail;
 				args[thread].low_detail = low_detail;
-				args[thread].most = &most;  // locked with var_lock
 				args[thread].meta_off = meta_off;
 				args[thread].pool_off = pool_off;
 				args[thread].initial_x = initial_x;
@@ -2389,29 +3481,45 @@ int traverse_zooms(int *geomfd, off_t *geom_size, char *metabase, char *stringpo
 				args[thread].postfilter = postfilter;
 
 				args[thread].tasks = dispatches[thread].tasks;
-				args[thread].running = &running;
+				args[thread].scheduler = &ts;
+				args[thread].child_starts = &sub_starts[thread * (TEMP_FILES / threads)];
+				args[thread].child_pos = &sub_pos[thread * (TEMP_FILES / threads)];
+				args[thread].tmpdir = tmpdir;
+				args[thread].stolen_geom = NULL;
+				args[thread].tiles = 0;
+				args[thread].stolen = 0;
+				args[thread].retried = 0;
+				args[thread].retries = 0;
+				args[thread].busy = 0;
+				args[thread].first = 0;
+				args[thread].last = 0;
+				args[thread].pipeline = NULL;
+				args[thread].generation = 0;
+				args[thread].thread = thread;
+				args[thread].running = &running;  // atomic
 				args[thread].pass = pass;
 				args[thread].passes = 2 - start;
 				args[thread].wrote_zoom = -1;
 				args[thread].still_dropping = false;
 
-				if (pthread_create(&pthreads[thread], NULL, run_thread, &args[thread]) != 0) {
-					perror("pthread_create");
-					exit(EXIT_FAILURE);
-				}
+				workers[thread] = task_start(run_thread, &args[thread]);
 			}
 
 			for (size_t thread = 0; thread < threads; thread++) {
-				void *retval;
-
-				if (pthread_join(pthreads[thread], &retval) != 0) {
-					perror("pthread_join");
-				}
+				void *retval = task_join(workers[thread]);
 
 				if (retval != NULL) {
 					err = *((int *) retval);
 				}
 
+				note_largest(args[thread].most, args[thread].midx, args[thread].midy, &most, midx, midy);
+
+				zu.busy += args[thread].busy;
+				zu.tiles += args[thread].tiles;
+				zu.stolen += args[thread].stolen;
+				zu.retried += args[thread].retried;
+				zu.retries += args[thread].retries;
+
 				if (args[thread].gamma_out > zoom_gamma) {
 					zoom_gamma = args[thread].gamma_out;
 				}
@@ -2434,8 +3542,18 @@ int traverse_zooms(int *geomfd, off_t *geom_size, char *metabase, char *stringpo
 					maxzoom++;
 				}
 			}
+
+			zu.wall += wall_time() - then;
+
+			if (pthread_mutex_destroy(&ts.lock) != 0) {
+				perror("pthread_mutex_destroy");
+				exit(EXIT_FAILURE);
+			}
 		}
 
+		zu.z = i;
+		utilization.push_back(zu);
+
 		for (size_t j = 0; j < TEMP_FILES; j++) {
 			// Can be < 0 if there is only one source file, at z0
 			if (geomfd[j] >= 0) {
@@ -2444,6 +3562,10 @@ int traverse_zooms(int *geomfd, off_t *geom_size, char *metabase, char *stringpo
 					exit(EXIT_FAILURE);
 				}
 			}
+			long long expected = sub_pos[j];
+			if (sub_writers[j] != NULL) {
+				expected = block_writer_close(sub_writers[j]);
+			}
 			if (fclose(sub[j]) != 0) {
 				perror("close subfile");
 				exit(EXIT_FAILURE);
@@ -2455,11 +3577,23 @@ int traverse_zooms(int *geomfd, off_t *geom_size, char *metabase, char *stringpo
 				exit(EXIT_FAILURE);
 			}
 
+			if (geomst.st_size != expected) {
+				fprintf(stderr, "Internal error: temporary file %zu is %lld bytes, expected %lld\n", j, (long long) geomst.st_size, expected);
+				exit(EXIT_FAILURE);
+			}
+
+			// Tiles are located by their uncompressed positions
 			geomfd[j] = subfd[j];
-			geom_size[j] = geomst.st_size;
+			geom_size[j] = sub_pos[j];
 		}
 
+		tile_starts.swap(sub_starts);
+		tile_index.swap(sub_index);
+		compressed = additional[A_COMPRESS_TEMPORARY];
+
 		if (err != INT_MAX) {
+			// Other threads may have finished tiles of the zoom level that failed
+			tile_writer_discard_above(writer, err);
 			return err;
 		}
 	}
@@ -2477,5 +3611,7 @@ int traverse_zooms(int *geomfd, off_t *geom_size, char *metabase, char *stringpo
 	if (!quiet) {
 		fprintf(stderr, "\n");
 	}
+
+	report_utilization(utilization);
 	return maxzoom;
 }
@@ -1,6 +1,11 @@
 #define CATCH_CONFIG_MAIN
 #include "catch/catch.hpp"
+#include <stdio.h>
+#include <stdint.h>
+#include <zlib.h>
 #include "text.hpp"
+#include "mvt.hpp"
+#include "threadpool.hpp"
 
 TEST_CASE("UTF-8 enforcement", "[utf8]") {
 	REQUIRE(check_utf8("") == std::string(""));
@@ -18,3 +23,41 @@ TEST_CASE("UTF-8 truncation", "[trunc]") {
 	REQUIRE(truncate16("0123456789😀😬😁😂😃😄😅😆", 17) == std::string("0123456789😀😬😁"));
 	REQUIRE(truncate16("0123456789あいうえおかきくけこさ", 16) == std::string("0123456789あいうえおか"));
 }
+
+TEST_CASE("Block-parallel gzip", "[compress]") {
+	// About a megabyte, so that it is compressed as several 128K blocks,
+	// each primed with the end of the one before it
+	std::string input;
+	unsigned long long seed = 1;
+	while (input.size() < 1000000) {
+		seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+		char buf[100];
+		snprintf(buf, sizeof(buf), "{\"id\":%llu,\"name\":\"feature %llu\"}\n", seed >> 48, (seed >> 40) % 1000);
+		input.append(buf);
+	}
+
+	threadpool_init(4);
+
+	std::string serial, parallel;
+	REQUIRE(compress_blocks(input, serial, SIZE_MAX, 1));
+	REQUIRE(compress_blocks(input, parallel, SIZE_MAX, 4));
+	REQUIRE(serial == parallel);
+	REQUIRE(is_compressed(parallel));
+	REQUIRE(parallel.size() < input.size() / 2);
+
+	// The gzip trailer: the CRC of the whole input, combined from the blocks, and its length
+	unsigned long crc = 0, len = 0;
+	for (size_t i = 0; i < 4; i++) {
+		crc |= (unsigned long) (unsigned char) parallel[parallel.size() - 8 + i] << (8 * i);
+		len |= (unsigned long) (unsigned char) parallel[parallel.size() - 4 + i] << (8 * i);
+	}
+	REQUIRE(crc == crc32(crc32(0, Z_NULL, 0), (const Bytef *) input.data(), input.size()));
+	REQUIRE(len == input.size());
+
+	std::string output;
+	REQUIRE(decompress(parallel, output) == 1);
+	REQUIRE(output == input);
+
+	std::string limited;
+	REQUIRE(!compress_blocks(input, limited, parallel.size() / 2, 4));
+}